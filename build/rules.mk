@@ -54,6 +54,9 @@ KERNELCXXFLAGS += -DHAVE_SANITIZERS
 SANITIZEFLAGS := -fsanitize=undefined -fsanitize=kernel-address
 $(OBJDIR)/k-alloc.ko $(OBJDIR)/k-sanitizers.ko: SANITIZEFLAGS :=
 endif
+ifeq ($(LOCKSTAT),1)
+KERNELCXXFLAGS += -DHAVE_LOCKSTAT
+endif
 
 # Linker flags
 LDFLAGS := $(LDFLAGS) -Os --gc-sections -z max-page-size=0x1000 \
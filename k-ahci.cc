@@ -9,6 +9,16 @@
 
 // HELPER FUNCTIONS FOR PREPARING, ISSUING, AND ACKNOWLEDGING COMMANDS
 
+// ahcistate::allocate_slot()
+//    Return the lowest-numbered free command slot. Requires `lock_` and
+//    `nslots_available_ > 0`.
+inline int ahcistate::allocate_slot() {
+    assert(lock_.is_locked() && nslots_available_ > 0);
+    uint32_t free_mask = slots_full_mask_ & ~slots_outstanding_mask_;
+    assert(free_mask != 0);
+    return __builtin_ctz(free_mask);
+}
+
 // ahcistate::clear(slot)
 //    Prepare `slot` to receive a command.
 inline void ahcistate::clear(int slot) {
@@ -83,49 +93,146 @@ inline void ahcistate::acknowledge(int slot, int result) {
     assert(slots_outstanding_mask_ & (1U << slot));
     slots_outstanding_mask_ ^= 1U << slot;
     ++nslots_available_;
-    if (slot_status_[slot]) {
-        *slot_status_[slot] = result;
-        slot_status_[slot] = nullptr;
+    while (request* r = slot_reqs_[slot].pop_front()) {
+        r->result_ = result;
+        completed_.push_back(r);
     }
 }
 
 
 // FUNCTIONS FOR READING AND WRITING BLOCKS
 
+// ahcistate::submit(r)
+//    Queue request `r` and start it if a slot is free. Never blocks.
+//    Requests wait in `queue_` sorted by sector, so `dispatch` can serve
+//    them in elevator order and merge adjacent ones.
+
+void ahcistate::submit(request* r) {
+    auto irqs = lock_.lock();
+    enqueue(r);
+    dispatch();
+    lock_.unlock(irqs);
+}
+
+// ahcistate::submit(rs)
+//    Queue every request in `rs`, leaving it empty, then start as many
+//    as slots allow. Requests queued together for consecutive sectors
+//    are issued as one scatter-gather command.
+
+void ahcistate::submit(list<request, &request::link_>& rs) {
+    auto irqs = lock_.lock();
+    while (request* r = rs.pop_front()) {
+        enqueue(r);
+    }
+    dispatch();
+    lock_.unlock(irqs);
+}
+
+// ahcistate::enqueue(r)
+//    Add `r` to `queue_` in sector order. Requires `lock_`.
+
+void ahcistate::enqueue(request* r) {
+    assert(lock_.is_locked());
+    assert(r->cmd_ == cmd_read_fpdma_queued
+           || r->cmd_ == cmd_write_fpdma_queued);
+    assert(r->sz_ > 0 && r->sz_ % sectorsize == 0);
+    assert(r->nsectors() <= max_command_sectors);
+    r->status_ = E_AGAIN;
+
+    request* pos = queue_.front();
+    while (pos && pos->sector_ <= r->sector_) {
+        pos = queue_.next(pos);
+    }
+    queue_.insert(pos, r);
+}
+
+// ahcistate::dispatch()
+//    Issue queued requests while command slots are free. Requires `lock_`.
+//
+//    Like an elevator (C-LOOK), each command starts at the first queued
+//    request at or after `head_sector_`, wrapping around to the lowest
+//    sector. Queued requests in the same direction that continue exactly
+//    where the command ends are merged into it, one buffer each.
+
+void ahcistate::dispatch() {
+    assert(lock_.is_locked());
+    while (nslots_available_ > 0 && !queue_.empty()) {
+        request* r = queue_.front();
+        while (r && r->sector_ < head_sector_) {
+            r = queue_.next(r);
+        }
+        if (!r) {
+            r = queue_.front();
+        }
+
+        int slot = allocate_slot();
+        clear(slot);
+        idecommand cmd = r->cmd_;
+        size_t sector = r->sector_;
+        size_t nsectors = 0;
+        while (r
+               && r->cmd_ == cmd
+               && r->sector_ == sector + nsectors
+               && dma_.ch[slot].nbuf < arraysize(dma_.ct[slot].buf)
+               && nsectors + r->nsectors() <= max_command_sectors) {
+            request* next = queue_.next(r);
+            queue_.erase(r);
+            push_buffer(slot, r->buf_, r->sz_);
+            slot_reqs_[slot].push_back(r);
+            nsectors += r->nsectors();
+            r = next;
+        }
+        issue_ncq(slot, cmd, sector);
+        head_sector_ = sector + nsectors;
+    }
+}
+
+// ahcistate::report_completed(done)
+//    Publish the status of each request in `done` and notify its owner.
+//    Called without `lock_`, since `done_` callbacks may submit more I/O.
+//    A request may be freed as soon as its `status_` is set, so its
+//    fields are read first.
+
+void ahcistate::report_completed(list<request, &request::link_>& done) {
+    while (request* r = done.pop_front()) {
+        auto fn = r->done_;
+        wait_queue* wq = r->wq_;
+        r->status_ = r->result_;
+        if (fn) {
+            fn(r);
+        } else if (wq) {
+            wq->wake_all();
+        }
+    }
+}
+
 // ahcistate::read_or_write(command, buf, sz, off)
 //    Issue an NCQ read or write command `command`. Read or write
 //    `sz` bytes of data to or from `buf`, starting at disk offset
 //    `off`. `sz` and `off` are measured in bytes, but must be
 //    sector-aligned (i.e., multiples of `ahcistate::sectorsize`).
 //    Can block. Returns 0 on success and an error code on failure.
+//
+//    This is a synchronous wrapper around `submit`.
 
 int ahcistate::read_or_write(idecommand command, void* buf, size_t sz,
                              size_t off) {
     // `sz` and `off` must be sector-aligned
     assert(sz % sectorsize == 0 && off % sectorsize == 0);
 
-    // obtain lock
-    auto irqs = lock_.lock();
-
-    // block until ready for command
-    waiter().block_until(wq_, [&] () {
-            return !slots_outstanding_mask_;
-        }, lock_, irqs);
-
-    // send command, record buffer and status storage
-    std::atomic<int> r = E_AGAIN;
-    clear(0);
-    push_buffer(0, buf, sz);
-    issue_ncq(0, command, off / sectorsize);
-    slot_status_[0] = &r;
-
-    lock_.unlock(irqs);
+    request r;
+    r.cmd_ = command;
+    r.buf_ = buf;
+    r.sz_ = sz;
+    r.sector_ = off / sectorsize;
+    r.wq_ = &done_wq_[current()->id_ % ndone_wq];
+    submit(&r);
 
     // wait for response
-    waiter().block_until(wq_, [&] () {
-            return r != E_AGAIN;
+    waiter().block_until(*r.wq_, [&] () {
+            return r.status_ != E_AGAIN;
         });
-    return r;
+    return r.status_;
 }
 
 
@@ -143,10 +250,10 @@ void ahcistate::handle_interrupt() {
 
     // acknowledge completed commands
     uint32_t acks = slots_outstanding_mask_ & ~pr_->ncq_active_mask;
-    for (int slot = 0; acks != 0; ++slot, acks >>= 1) {
-        if (acks & 1) {
-            acknowledge(slot, 0);
-        }
+    while (acks != 0) {
+        int slot = __builtin_ctz(acks);
+        acks &= acks - 1;
+        acknowledge(slot, 0);
     }
 
     // acknowledge errored commands
@@ -154,11 +261,15 @@ void ahcistate::handle_interrupt() {
         handle_error_interrupt();
     }
 
+    // refill freed slots from the queue
+    dispatch();
+    list<request, &request::link_> done;
+    done.swap(completed_);
     lock_.unlock(irqs);
 
-    // wake waiters
+    // notify requesters
     lapicstate::get().ack();
-    wq_.wake_all();
+    report_completed(done);
 }
 
 void ahcistate::handle_error_interrupt() {
@@ -222,10 +333,6 @@ ahcistate::ahcistate(int pci_addr, int sata_port, volatile regs* dr)
     : pci_addr_(pci_addr), sata_port_(sata_port),
       dr_(dr), pr_(&dr->p[sata_port]), nslots_(1),
       nslots_available_(1), slots_outstanding_mask_(0) {
-    for (int i = 0; i < 32; ++i) {
-        slot_status_[i] = nullptr;
-    }
-
     auto& pci = pcistate::get();
     pci.enable(pci_addr_);
 
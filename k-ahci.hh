@@ -108,6 +108,30 @@ struct ahcistate {
     };
 
     static constexpr size_t sectorsize = 512;
+    static constexpr size_t max_command_sectors = 0xFFFF;
+
+
+    // asynchronous block I/O requests
+    //    A `request` describes one transfer between a buffer (which must
+    //    meet `push_buffer`'s requirements) and consecutive disk sectors.
+    //    `submit` queues it and returns immediately. When the transfer
+    //    finishes, `status_` becomes 0 or an error code, and then either
+    //    `done_(this)` is called, in interrupt context, or `wq_` is woken.
+    //    The request must stay valid until then.
+    struct request {
+        idecommand cmd_;          // `cmd_read/write_fpdma_queued`
+        void* buf_;
+        size_t sz_;               // bytes; a multiple of `sectorsize`
+        size_t sector_;           // first sector
+        void (*done_)(request*) = nullptr;
+        void* arg_ = nullptr;     // for use by `done_`
+        wait_queue* wq_ = nullptr;
+        std::atomic<int> status_ = E_AGAIN;
+        int result_;              // status until `status_` is published
+        list_links link_;         // in queue, slot, or completion list
+
+        inline size_t nsectors() const;
+    };
 
 
     // DMA and memory-mapped I/O state
@@ -125,10 +149,16 @@ struct ahcistate {
 
     // modifiable state
     spinlock lock_;
-    wait_queue wq_;
     unsigned nslots_available_;         // # slots available for commands
     uint32_t slots_outstanding_mask_;   // 1 == that slot is used
-    std::atomic<int>* slot_status_[32]; // ptrs to status storage, one per slot
+    list<request, &request::link_> queue_;  // waiting requests, by sector
+    list<request, &request::link_> slot_reqs_[32]; // requests in each slot
+    list<request, &request::link_> completed_;  // finished, not yet reported
+    size_t head_sector_ = 0;            // sector after last dispatched command
+
+    // synchronous `read_or_write` callers sleep here, hashed by thread
+    static constexpr unsigned ndone_wq = 16;
+    wait_queue done_wq_[ndone_wq];
 
 
     ahcistate(int pci_addr, int sata_port, volatile regs* mr);
@@ -140,11 +170,19 @@ struct ahcistate {
     inline int write(const void* buf, size_t sz, size_t off);
     int read_or_write(idecommand cmd, void* buf, size_t sz, size_t off);
 
+    // asynchronous I/O (does not block)
+    void submit(request* r);
+    void submit(list<request, &request::link_>& rs);
+
     // interrupt handlers
     void handle_interrupt();
     void handle_error_interrupt();
 
     // internal functions
+    int allocate_slot();
+    void enqueue(request* r);
+    void dispatch();
+    void report_completed(list<request, &request::link_>& done);
     void clear(int slot);
     void push_buffer(int slot, void* data, size_t sz);
     void issue_meta(int slot, idecommand cmd, int features, int count = -1);
@@ -154,6 +192,10 @@ struct ahcistate {
     void await_basic(int slot);
 };
 
+inline size_t ahcistate::request::nsectors() const {
+    return sz_ / sectorsize;
+}
+
 inline int ahcistate::read(void* buf, size_t sz, size_t off) {
     return read_or_write(cmd_read_fpdma_queued, buf, sz, off);
 }
@@ -2,6 +2,7 @@
 #include "k-vmiter.hh"
 #include "k-lock.hh"
 #include "k-pages.hh"
+#include "k-chkfs.hh"
 
 // init_kalloc
 //    Initialize stuff needed by `kalloc`. Called from `init_hardware`,
@@ -11,42 +12,19 @@ void init_kalloc() {
     pages.try_merge_all();
 }
 
-// kalloc(sz)
-//    Allocate and return a pointer to at least `sz` contiguous bytes of
-//    memory. Returns `nullptr` if `sz == 0` or on failure.
-//
-//    The caller should initialize the returned memory before using it.
-//    The handout allocator sets returned memory to 0xCC (this corresponds
-//    to the x86 `int3` instruction and may help you debug).
-//
-//    If `sz` is a multiple of `PAGESIZE`, the returned pointer is guaranteed
-//    to be page-aligned.
-//
-//    The handout code does not free memory and allocates memory in units
-//    of pages.
-
-// TODO: return correct error values on failure
-void* kalloc(size_t sz) {
-    spinlock_guard guard(page_lock);
-
-    // validate size
-    if(sz == 0) {
-        return nullptr;
-    }
-
-    // validate order of allocation
-    const int order = msb(sz - 1) < MIN_ORDER ? MIN_ORDER : msb(sz - 1);
-    if(order > MAX_ORDER) {
-        return nullptr;
-    }
-
-    void* ptr = nullptr;
+// buddy_allocate(order)
+//    Remove a free block of order `order` from `pages`, splitting a larger
+//    block if necessary, and mark it allocated. Returns the block's head
+//    page, or `nullptr` if no memory is available. Requires `page_lock`.
+static page* buddy_allocate(int order) {
+    assert(page_lock.is_locked());
 
     // look for a free block with the desired order
     page* p = pages.freeblocks_pop(order);
     if(p) {
        // assert invariant
-       assert(p->order == MAX_ORDER || !pages.is_free(pages.get_buddy(p)));
+       page* b = pages.get_buddy(p);
+       assert(p->order == MAX_ORDER || !b || !pages.is_free_block(b, order));
        assert(pages.is_free(p));
     } else {
         // if not found, look for block with order o > order, minimizing o
@@ -55,7 +33,6 @@ void* kalloc(size_t sz) {
             if(p) {
                 // if found block, assert invariants and stop looking
                 assert(pages.has_order(p, o));
-                assert(p->order == MAX_ORDER || !pages.is_free(pages.get_buddy(p)));
                 assert(pages.is_free(p));
                 break;
             }
@@ -66,30 +43,480 @@ void* kalloc(size_t sz) {
             return nullptr;
         }
 
-        // split block into two and free one of them as much as possible
+        // split block into two and free the upper half as much as
+        // possible. Only the two block heads are updated per level.
         page* b;
         for(int o = p->order; o > order; o--) {
             pages.decrement_order(p);
             b = pages.get_buddy(p);
-            assert(pages.has_order(p, p->order));
-            assert(pages.has_order(b, p->order));
+            b->order = p->order;
+            pages.set_status(b, pg_free);
             pages.freeblocks_push(b);
         }
     }
 
-    // found block
-    ptr = pa2kptr<void*>(p->first());
-
      // at this point, block should have the desired order
     assert(pages.has_order(p, order));
 
     // set block's status to allocated
     pages.allocate(p);
+    return p;
+}
+
+// buddy_free(p)
+//    Return the allocated block headed by `p` to `pages` and merge it
+//    with its buddies. Requires `page_lock`.
+static void buddy_free(page* p) {
+    assert(page_lock.is_locked());
+    pages.free(p);
+    pages.freeblocks_push(p);
+    pages.try_merge(p);
+}
+
+
+// Per-CPU page caches
+//    Single-page (order-`MIN_ORDER`) allocations are served from a small
+//    cache in each `cpustate` without taking `page_lock`. An empty cache is
+//    refilled from `pages`, and a full cache drained to `pages`, in batches
+//    of `cpustate::pagecache_batch` pages under one `page_lock` acquisition.
+//    Cached pages look allocated to `pages` (their status is `pg_cached`),
+//    so they never merge with their buddies while cached.
+//
+//    The cache is only touched by its own CPU with interrupts disabled.
+
+// pagecache_drain(c, n)
+//    Return up to `n` pages from `c`'s cache to `pages`. Requires
+//    `page_lock` and disabled interrupts.
+static void pagecache_drain(cpustate* c, unsigned n) {
+    while(n > 0 && c->pagecache_count_ > 0) {
+        page* p = c->pagecache_[--c->pagecache_count_];
+        assert(p->status == pg_cached);
+        pages.allocate(p);
+        buddy_free(p);
+        --n;
+    }
+}
+
+// pagecache_allocate()
+//    Return an allocated single-page block from this CPU's cache,
+//    refilling the cache if necessary, or `nullptr` if out of memory.
+static page* pagecache_allocate() {
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+
+    if(c->pagecache_count_ > 0) {
+        ++c->pagecache_hits_;
+    } else {
+        ++c->pagecache_misses_;
+        spinlock_guard guard(page_lock);
+        while(c->pagecache_count_ < cpustate::pagecache_batch) {
+            page* p = buddy_allocate(MIN_ORDER);
+            if(!p) {
+                break;
+            }
+            pages.set_status(p, pg_cached);
+            c->pagecache_[c->pagecache_count_++] = p;
+        }
+    }
+
+    page* p = nullptr;
+    if(c->pagecache_count_ > 0) {
+        p = c->pagecache_[--c->pagecache_count_];
+        pages.allocate(p);
+    }
+    irqs.restore();
+    return p;
+}
+
+// pagecache_free(p)
+//    Return the single-page block headed by `p` to this CPU's cache,
+//    draining the cache first if it is full.
+static void pagecache_free(page* p) {
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+
+    if(c->pagecache_count_ == cpustate::pagecache_capacity) {
+        spinlock_guard guard(page_lock);
+        pagecache_drain(c, cpustate::pagecache_batch);
+    }
+
+    // catch double free
+    assert(p->status == pg_allocated);
+    pages.set_status(p, pg_cached);
+    c->pagecache_[c->pagecache_count_++] = p;
+    irqs.restore();
+}
+
+// kalloc_block(order)
+//    Return an allocated block of order `order`, or `nullptr` if out of
+//    memory. Single pages come from the per-CPU page cache; larger blocks
+//    from the buddy allocator under `page_lock`.
+static page* kalloc_block(int order) {
+    page* p;
+    if(order == MIN_ORDER) {
+        p = pagecache_allocate();
+    } else {
+        spinlock_guard guard(page_lock);
+        p = buddy_allocate(order);
+        if(!p) {
+            // pages cached on this CPU may complete a larger block
+            pagecache_drain(this_cpu(), cpustate::pagecache_capacity);
+            p = buddy_allocate(order);
+        }
+    }
+    if(p) {
+        p->ref_ = 1;
+    }
+    return p;
+}
+
+// kalloc_fill(ptr, sz, flags)
+//    Initialize `sz` newly allocated bytes at `ptr` as `flags` requests.
+static inline void kalloc_fill(void* ptr, size_t sz, int flags) {
+    if(flags & KALLOC_ZERO) {
+        memset(ptr, 0, sz);
+    } else if(!(flags & KALLOC_NOFILL)) {
+        // initialize to `int3`
+        memset(ptr, 0xCC, sz);
+    }
+}
+
+
+// Zeroed page pool
+//    Page tables and fresh user pages are requested with
+//    `kalloc(PAGESIZE, KALLOC_ZERO)`. Those requests are served from a
+//    small pool of pages that idle tasks zero ahead of time (see
+//    `refill_zero_pages`), taking the zeroing off the allocating path.
+//    Pooled pages are allocated as far as `pages` is concerned, so the
+//    pool is drained back if an allocation would otherwise fail.
+
+static constexpr unsigned zeropool_capacity = 16;
+static spinlock zeropool_lock("zeropool_lock"); // protects zeropool*
+static void* zeropool[zeropool_capacity];
+static unsigned zeropool_count = 0;
+static unsigned long zeropool_hits = 0;
+static unsigned long zeropool_misses = 0;
+
+// zeropool_pop()
+//    Return a zeroed page from the pool, or `nullptr` if it is empty.
+static void* zeropool_pop() {
+    spinlock_guard guard(zeropool_lock);
+    if(zeropool_count == 0) {
+        ++zeropool_misses;
+        return nullptr;
+    }
+    ++zeropool_hits;
+    return zeropool[--zeropool_count];
+}
+
+// zeropool_drain()
+//    Free every page in the pool. Returns true if any page was freed.
+static bool zeropool_drain() {
+    void* drained[zeropool_capacity];
+    unsigned n;
+    {
+        spinlock_guard guard(zeropool_lock);
+        n = zeropool_count;
+        memcpy(drained, zeropool, n * sizeof(void*));
+        zeropool_count = 0;
+    }
+    for(unsigned i = 0; i < n; ++i) {
+        kfree(drained[i]);
+    }
+    return n > 0;
+}
+
+// refill_zero_pages()
+//    Zero one free page and add it to the pool. Returns false if the pool
+//    is full or memory is short.
+bool refill_zero_pages() {
+    {
+        spinlock_guard guard(zeropool_lock);
+        if(zeropool_count == zeropool_capacity) {
+            return false;
+        }
+    }
+
+    // take the page directly so a short allocation doesn't drain the pool
+    page* p = kalloc_block(MIN_ORDER);
+    if(!p) {
+        return false;
+    }
+    void* ptr = pa2kptr<void*>(p->first());
+    asan_mark_memory(p->first(), p->size(), false);
+    memset(ptr, 0, PAGESIZE);
+
+    spinlock_guard guard(zeropool_lock);
+    if(zeropool_count < zeropool_capacity) {
+        zeropool[zeropool_count++] = ptr;
+        return true;
+    }
+    // another CPU filled the pool meanwhile
+    guard.unlock();
+    kfree(ptr);
+    return false;
+}
+
+
+// Slab allocator
+//    `kmalloc` serves requests of up to `KMALLOC_MAX` bytes from one-page
+//    *slabs*, each holding objects of a single power-of-two size class.
+//    A slab's state lives in its `page` entry (`status == pg_slab`), so
+//    objects are packed from the start of the page and `kfree` can tell a
+//    slab object from a `kalloc` block by looking at its page.
+//
+//    Each CPU allocates from its own *active* slab per class without
+//    locking: an active slab's `slab_free_` list belongs to its CPU.
+//    Other CPUs free into `slab_remote_` under the class lock, and the
+//    owner reclaims those objects when `slab_free_` runs dry. Inactive
+//    slabs are protected by the class lock; partly free ones sit on the
+//    class's `partial_` list, and empty ones are returned to `kalloc`.
+
+struct slab_class {
+    spinlock lock_{"slab_class"};          // protects inactive slabs
+    list<page, &page::link_> partial_;     // inactive, partly free slabs
+    unsigned long nslabs_ = 0;             // number of slabs
+};
+
+static slab_class slab_classes[cpustate::slab_nclasses];
+static constexpr size_t slab_min_size = 16;
+
+static_assert((slab_min_size << (cpustate::slab_nclasses - 1)) == KMALLOC_MAX,
+              "size classes must end at KMALLOC_MAX");
+
+// slab_object_size(cls)
+//    Return the object size of size class `cls`.
+static inline size_t slab_object_size(int cls) {
+    return slab_min_size << cls;
+}
+
+// slab_class_index(sz)
+//    Return the smallest size class whose objects hold `sz` bytes.
+static inline int slab_class_index(size_t sz) {
+    return sz <= slab_min_size ? 0 : msb(sz - 1) - msb(slab_min_size - 1);
+}
+
+// slab_push(list, obj), slab_pop(list)
+//    Free objects form a singly-linked list through their first word.
+static inline void slab_push(void*& list, void* obj) {
+    *reinterpret_cast<void**>(obj) = list;
+    list = obj;
+}
+static inline void* slab_pop(void*& list) {
+    void* obj = list;
+    if(obj) {
+        list = *reinterpret_cast<void**>(obj);
+    }
+    return obj;
+}
+
+// slab_create(cls)
+//    Return a new, inactive slab of size class `cls` with every object
+//    free, or `nullptr` if out of memory.
+static page* slab_create(int cls) {
+    char* ptr = reinterpret_cast<char*>(kalloc(PAGESIZE));
+    if(!ptr) {
+        return nullptr;
+    }
+    page* s = pages.get_block(ka2pa(ptr));
+
+    // push objects in reverse so they are handed out in address order
+    size_t objsz = slab_object_size(cls);
+    s->slab_free_ = nullptr;
+    for(size_t off = PAGESIZE; off >= objsz; off -= objsz) {
+        slab_push(s->slab_free_, ptr + off - objsz);
+    }
+    s->slab_remote_ = nullptr;
+    s->slab_inuse_ = 0;
+    s->slab_cpu_ = -1;
+    s->slab_class_ = cls;
+    pages.set_status(s, pg_slab);
+    return s;
+}
+
+// slab_refill(c, cls)
+//    Return a free object of class `cls` after `c`'s active slab ran dry:
+//    reclaim the slab's remotely freed objects, or else retire it and
+//    activate a partial or new slab. Returns `nullptr` if out of memory.
+//    Requires disabled interrupts.
+static void* slab_refill(cpustate* c, int cls) {
+    slab_class& sc = slab_classes[cls];
+    spinlock_guard guard(sc.lock_);
+
+    page* s = c->slab_active_[cls];
+    if(s) {
+        s->slab_free_ = s->slab_remote_;
+        s->slab_remote_ = nullptr;
+        if(!s->slab_free_) {
+            // every object is allocated; the slab goes on no list
+            s->slab_inuse_ = PAGESIZE / slab_object_size(cls);
+            s->slab_cpu_ = -1;
+            c->slab_active_[cls] = s = nullptr;
+        }
+    }
+
+    if(!s) {
+        s = sc.partial_.pop_front();
+        if(!s) {
+            s = slab_create(cls);
+            if(!s) {
+                return nullptr;
+            }
+            ++sc.nslabs_;
+        }
+        s->slab_cpu_ = c->cpuindex_;
+        c->slab_active_[cls] = s;
+    }
+    return slab_pop(s->slab_free_);
+}
+
+// slab_free(s, ptr)
+//    Return object `ptr` to slab `s`.
+static void slab_free(page* s, void* ptr) {
+    int cls = s->slab_class_;
+    // `ptr` must be the start of an object
+    assert((ka2pa(ptr) - s->first()) % slab_object_size(cls) == 0);
+
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+
+    if(s->slab_cpu_ == c->cpuindex_) {
+        // our own active slab: no one else touches `slab_free_`
+        slab_push(s->slab_free_, ptr);
+    } else {
+        slab_class& sc = slab_classes[cls];
+        bool empty = false;
+        {
+            spinlock_guard guard(sc.lock_);
+            if(s->slab_cpu_ >= 0) {
+                // another CPU's active slab
+                slab_push(s->slab_remote_, ptr);
+            } else {
+                slab_push(s->slab_free_, ptr);
+                if(--s->slab_inuse_ == 0) {
+                    if(s->link_.is_linked()) {
+                        sc.partial_.erase(s);
+                    }
+                    --sc.nslabs_;
+                    empty = true;
+                } else if(!s->link_.is_linked()) {
+                    sc.partial_.push_back(s);
+                }
+            }
+        }
+        if(empty) {
+            pages.allocate(s);
+            kfree(pa2kptr<void*>(s->first()));
+        }
+    }
+    irqs.restore();
+}
+
+// kmalloc(sz, flags)
+//    Allocate and return a pointer to at least `sz` bytes of memory, or
+//    `nullptr` if `sz == 0` or on failure. `flags` are as for `kalloc`.
+void* kmalloc(size_t sz, int flags) {
+    if(sz == 0) {
+        return nullptr;
+    }
+    if(sz > KMALLOC_MAX) {
+        return kalloc(sz, flags);
+    }
+
+    int cls = slab_class_index(sz);
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+    page* s = c->slab_active_[cls];
+    void* ptr = s ? slab_pop(s->slab_free_) : nullptr;
+    if(!ptr) {
+        ptr = slab_refill(c, cls);
+    }
+    irqs.restore();
+
+    if(ptr) {
+        kalloc_fill(ptr, slab_object_size(cls), flags);
+    }
+    return ptr;
+}
+
+
+// log_kalloc_stats()
+//    Print page cache, slab, and zeroed page pool statistics to the log.
+void log_kalloc_stats() {
+    for(int i = 0; i < ncpu; ++i) {
+        log_printf("CPU %d: page cache %lu hits, %lu misses, %u cached\n",
+                   i, cpus[i].pagecache_hits_, cpus[i].pagecache_misses_,
+                   cpus[i].pagecache_count_);
+    }
+    for(int cls = 0; cls < cpustate::slab_nclasses; ++cls) {
+        log_printf("kmalloc-%zu: %lu slabs\n", slab_object_size(cls),
+                   slab_classes[cls].nslabs_);
+    }
+    log_printf("zeroed page pool: %lu hits, %lu misses, %u pooled\n",
+               zeropool_hits, zeropool_misses, zeropool_count);
+}
+
+// buffers freed per `bufcache::shrink` call when `kalloc` fails
+static constexpr size_t kalloc_shrink_batch = 8;
+
+// kalloc(sz, flags)
+//    Allocate and return a pointer to at least `sz` contiguous bytes of
+//    memory. Returns `nullptr` if `sz == 0` or on failure.
+//
+//    By default the returned memory is set to 0xCC (this corresponds to
+//    the x86 `int3` instruction and may help you debug). `KALLOC_ZERO`
+//    returns zeroed memory instead, and `KALLOC_NOFILL` skips the fill
+//    for callers that overwrite the memory anyway.
+//
+//    If `sz` is a multiple of `PAGESIZE`, the returned pointer is guaranteed
+//    to be page-aligned.
+
+// TODO: return correct error values on failure
+void* kalloc(size_t sz, int flags) {
+    // validate size
+    if(sz == 0) {
+        return nullptr;
+    }
+
+    // validate order of allocation
+    const int order = msb(sz - 1) < MIN_ORDER ? MIN_ORDER : msb(sz - 1);
+    if(order > MAX_ORDER) {
+        return nullptr;
+    }
+
+    // a pre-zeroed page may be ready
+    if(order == MIN_ORDER && (flags & KALLOC_ZERO)) {
+        if(void* ptr = zeropool_pop()) {
+            return ptr;
+        }
+    }
+
+    // on failure, give back pooled pages, then shrink the buffer cache
+    // until the allocation fits or the cache can give no more. Only
+    // single pages are worth shrinking for: freed buffers are scattered,
+    // so emptying the cache rarely yields a larger block
+    page* p = kalloc_block(order);
+    if(!p && zeropool_drain()) {
+        p = kalloc_block(order);
+    }
+    while(!p && order == MIN_ORDER
+          && bufcache::get().shrink(kalloc_shrink_batch)) {
+        p = kalloc_block(order);
+    }
+    if(!p) {
+        return nullptr;
+    }
+
+    // found block
+    void* ptr = pa2kptr<void*>(p->first());
 
     // tell sanitizers the allocated page is accessible
     asan_mark_memory(ka2pa(ptr), p->size(), false);
-    // initialize to `int3`
-    memset(ptr, 0xCC, p->size());
+    kalloc_fill(ptr, p->size(), flags);
     return ptr;
 }
 
@@ -97,12 +524,6 @@ void* kalloc(size_t sz) {
 //    Free a pointer previously returned by `kalloc`. Does nothing if
 //    `ptr == nullptr`.
 void kfree(void* ptr) {
-    spinlock_guard guard(page_lock);
-
-    if(ptr == reinterpret_cast<void*>(0xffff800000010000)) {
-        log_printf("HERE\n");
-    }
-    
     if(!ptr) {
         return;
     }
@@ -114,25 +535,50 @@ void kfree(void* ptr) {
         return;
     }
 
-    // get block
-    page* p = pages.get_block(pa);
+    // objects from `kmalloc` live inside slab pages
+    page* s = pages.get_page(round_down(pa, PAGESIZE));
+    if(s->status == pg_slab) {
+        slab_free(s, ptr);
+        return;
+    }
 
-    // pa must be an address actually allocated by kalloc
+    // get block; pa must be an address actually allocated by kalloc.
+    // The head of an allocated block only changes when its owner frees it,
+    // so it can be examined without `page_lock`.
+    page* p = pages.get_block(pa);
     assert(p->first() == pa);
+    assert(p->status == pg_allocated);
 
-
-    // TODO: this should be an atomic operation!
-    // set pages within block to free
-    pages.free(p);
-    pages.freeblocks_push(p);
-
+    // drop a reference; other holders may still use the block
+    if(p->ref_.fetch_sub(1) > 1) {
+        return;
+    }
 
     // tell sanitizers the freed block is inaccessible
     asan_mark_memory(pa, p->size(), true);
 
+    if(p->order == MIN_ORDER) {
+        pagecache_free(p);
+    } else {
+        spinlock_guard guard(page_lock);
+        buddy_free(p);
+    }
+}
+
+// kref(ptr)
+//    Add a reference to the block at `ptr`.
+void kref(void* ptr) {
+    page* p = pages.get_block(ka2pa(ptr));
+    assert(p->status == pg_allocated && p->ref_ > 0);
+    ++p->ref_;
+}
 
-    // try merging the block
-    return pages.try_merge(p);
+// krefcount(ptr)
+//    Return the number of references to the block at `ptr`.
+unsigned krefcount(void* ptr) {
+    page* p = pages.get_block(ka2pa(ptr));
+    assert(p->status == pg_allocated);
+    return p->ref_;
 }
 
 // kfree_mem(p)
@@ -161,6 +607,8 @@ void kfree_mem(proc* p) {
     // assumes that process 'p' is no longer in the ptable
     // to avoid synchronization conflicts with memviewer
     assert(p && p->pg_ && p->pg_->pagetable_);
+    // release the program segments' source files
+    p->pg_->set_vmas(nullptr, 0);
     return kfree_mem(p->pg_->pagetable_, p->pg_);
 }
 
@@ -178,22 +626,24 @@ void kfree_pagetable(x86_64_pagetable* pagetable) {
 
 // operator new, operator delete
 //    Expressions like `new (std::nothrow) T(...)` and `delete x` work,
-//    and call kalloc/kfree.
+//    and call kmalloc/kfree.
+//    Size classes are aligned to their size, so an aligned request is
+//    rounded up to its alignment.
 void *operator new(size_t sz, const std::nothrow_t &) noexcept
 {
-    return kalloc(sz);
+    return kmalloc(sz);
 }
-void *operator new(size_t sz, std::align_val_t, const std::nothrow_t &) noexcept
+void *operator new(size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept
 {
-    return kalloc(sz);
+    return kmalloc(sz < size_t(al) ? size_t(al) : sz);
 }
 void *operator new[](size_t sz, const std::nothrow_t &) noexcept
 {
-    return kalloc(sz);
+    return kmalloc(sz);
 }
-void *operator new[](size_t sz, std::align_val_t, const std::nothrow_t &) noexcept
+void *operator new[](size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept
 {
-    return kalloc(sz);
+    return kmalloc(sz < size_t(al) ? size_t(al) : sz);
 }
 void operator delete(void *ptr)noexcept
 {
@@ -75,6 +75,8 @@ struct lapicstate {
 
     // send an IPI to all other processes
     inline void ipi_others(ipi_type_t ipi_type, int vector = 0);
+    // send interrupt `vector` to the CPU with APIC ID `lapic_id`
+    inline void ipi(int lapic_id, int vector);
     // return if the previous IPI has not completed
     inline bool ipi_pending() const;
 
@@ -157,6 +159,10 @@ inline void lapicstate::ack() {
 inline void lapicstate::ipi_others(ipi_type_t t, int vector) {
     write(reg_icr_low, ipi_all_excluding_self | ipi_level_assert | t | vector);
 }
+inline void lapicstate::ipi(int lapic_id, int vector) {
+    write(reg_icr_high, unsigned(lapic_id) << 24);
+    write(reg_icr_low, ipi_given | vector);
+}
 inline bool lapicstate::ipi_pending() const {
     return (read(reg_icr_low) & ipi_delivery_status) != 0;
 }
@@ -1,89 +1,188 @@
 #include "k-chkfs.hh"
 #include "k-ahci.hh"
 #include "k-chkfsiter.hh"
+#include "k-pages.hh"
 
 bufcache bufcache::bc;
 
 wait_queue bcentry::write_ref_wq_;
 list<bcentry, &bcentry::link_> bcentry::dirty_list_;
+spinlock bcentry::dirty_lock_("bcentry::dirty_lock_");
 wait_queue bufcache::evict_wq_;
+wait_queue bufcache::io_wq_;
+wait_queue bufcache::writeback_wq_;
 
 bufcache::bufcache() {
-    for(size_t i = 0; i < ne; ++i) {
-        lru_stack[i] = -1;
-    }
 }
 
-// bufcache::mark_mru(ei)
-//    Marsk the buffer cache entry with entry index 'ei' as the most 
-//    recently used one. It is wrong to call mark_mru when the
-//    lru_stack is full and 'ei' is not in the lru_stack. Instad,
-//    call bufcache::evict_lru() first to make a slot available.
-void bufcache::mark_mru(int ei) {
+// bufcache::init()
+//    Sizes the buffer cache from the memory free now. Entries are
+//    allocated a page at a time as the cache fills (see `take_free`);
+//    only the table of those pages is allocated here. Called once by
+//    `init_hardware`.
+void bufcache::init() {
+    assert(!chunks_);
+    size_t nfree = pages.nfree();
+    ne_ = max(nfree * max_percent / 100, min_ne);
+    size_t nchunks = (ne_ + chunk_entries - 1) / chunk_entries;
+    chunks_ = reinterpret_cast<bcentry**>(kalloc(nchunks * sizeof(bcentry*)));
+    assert(chunks_);
+    limit_ = max(nfree * initial_percent / 100, min_ne);
+    grow_free_ = nfree / 8;
+    log_printf("bufcache: %zu entries allowed, up to %zu\n", limit_, ne_);
+}
+
+// bufcache::lookup(bn)
+//    Returns the entry caching block `bn`, or nullptr if there is none.
+bcentry* bufcache::lookup(blocknum_t bn) {
     assert(lock_.is_locked());
-    size_t i, slot = -1;
-    // loof for slot with 'ei' of that is empty
-    for(i = 0; i < ne; ++i) {
-        if(lru_stack[i] == ei) {
-            slot = i;
-            break;
-        } else if(lru_stack[i] < 0) {
-            slot = i;
+    auto& chain = hash_[bn % nhash];
+    for(bcentry* e = chain.front(); e; e = chain.next(e)) {
+        if(e->bn_ == bn) {
+            return e;
         }
     }
+    return nullptr;
+}
 
-    // a slot must have been found
-    assert(slot != size_t(-1));
+// bufcache::free_entry(e)
+//    Frees the buffer of unreferenced entry `e` and returns it to the
+//    free list.
+void bufcache::free_entry(bcentry* e) {
+    assert(lock_.is_locked() && e != &sb_);
+    e->clear();
+    hash_[e->bn_ % nhash].erase(e);
+    lru_.erase(e);
+    free_.push_front(e);
+    --nused_;
+}
 
-    // mark 'ei' the most recently used one
-    for(int j = slot; j > 0; j--) {
-        lru_stack[j] = lru_stack[j - 1];
+// bufcache::grow()
+//    Raises `limit_` by one entry if the cache is below its maximum size
+//    and memory is not short. Returns true if it did.
+bool bufcache::grow() {
+    assert(lock_.is_locked());
+    if(limit_ < ne_ && pages.nfree() > grow_free_) {
+        ++limit_;
+        return true;
     }
-    lru_stack[0] = ei;
+    return false;
+}
+
+// bufcache::take_free()
+//    Returns an entry from `free_`. If `free_` is empty, allocates a page
+//    of new entries, unless all `ne_` exist; returns nullptr if that
+//    fails. The `kalloc` cannot deadlock on `lock_`: `shrink` only
+//    try-locks it.
+bcentry* bufcache::take_free() {
+    assert(lock_.is_locked());
+    if(free_.empty() && nalloc_ < ne_) {
+        auto chunk = reinterpret_cast<bcentry*>(kalloc(PAGESIZE));
+        if(chunk) {
+            chunks_[nalloc_ / chunk_entries] = chunk;
+            size_t n = min(chunk_entries, ne_ - nalloc_);
+            for(size_t i = 0; i != n; ++i) {
+                new (&chunk[i]) bcentry;
+                chunk[i].index_ = nalloc_ + i;
+                free_.push_back(&chunk[i]);
+            }
+            nalloc_ += n;
+        }
+    }
+    return free_.pop_front();
+}
+
+// bufcache::shrink(n)
+//    Frees the buffers of up to `n` clean, unreferenced entries, least
+//    recently used first, and lowers `limit_` to match. Called by `kalloc`
+//    when it runs out of memory, so it must not block or allocate: it
+//    skips the cache (or an entry) if its lock is already held. Returns
+//    the number of buffers freed.
+size_t bufcache::shrink(size_t n) {
+    irqstate irqs;
+    if(!lock_.trylock(irqs)) {
+        return 0;
+    }
+    size_t nfreed = 0;
+    bcentry* e = lru_.back();
+    while(e && nfreed < n && limit_ > min_ne) {
+        bcentry* prev = lru_.prev(e);
+        if(e->lock_.trylock_noirq()) {
+            if(!e->ref_ && e->estate_ == bcentry::es_clean) {
+                free_entry(e);
+                --limit_;
+                ++nfreed;
+            }
+            e->lock_.unlock_noirq();
+        }
+        e = prev;
+    }
+    lock_.unlock(irqs);
+    return nfreed;
 }
 
 
 // bufcache::evict_lru(irqs)
-//    returns the entry of the evicted entry.
-int bufcache::evict_lru(irqstate& irqs) {
+//    Frees the least recently used unreferenced entry. May release
+//    `lock_` to write back dirty entries, so callers must look up their
+//    block again. Returns false if no entry could be evicted.
+bool bufcache::evict_lru(irqstate& irqs) {
     assert(lock_.is_locked());
 
     // only evict when buffer cache is full
-    assert(lru_stack[ne - 1] >= 0);
+    assert(nused_ >= limit_);
 
-    int bci;
     bool observed_unreferenced_dirty = false;
 
     while(true) {
         // look for lru entry with a zero ref count
-        for(int i = ne - 1; i >= 0; --i) {
-            bci = lru_stack[i];
-            irqstate eirqs = e_[bci].lock_.lock();
-            if(!e_[bci].ref_) {
-                if(e_[bci].estate_ != bcentry::es_dirty) {
-                    e_[bci].clear();
-                    lru_stack[i] = -1;
-                    e_[bci].lock_.unlock(eirqs);
-                    return bci;
-                } else {
+        for(bcentry* e = lru_.back(); e; e = lru_.prev(e)) {
+            spinlock_guard eguard(e->lock_);
+            if(!e->ref_) {
+                if(e->estate_ == bcentry::es_dirty) {
                     observed_unreferenced_dirty = true;
+                } else if(e->estate_ != bcentry::es_loading) {
+                    free_entry(e);
+                    return true;
                 }
             }
-            e_[bci].lock_.unlock(eirqs);
         }
 
         if(observed_unreferenced_dirty) {
+            // `sync` also waits for entries the writeback task is
+            // writing, so they are clean when we rescan
             lock_.unlock(irqs);
             sync(1);
             irqs = lock_.lock();
+            if(nused_ < limit_) {
+                return true;
+            }
             // try again
+            observed_unreferenced_dirty = false;
         } else {
             // couldn't evict any entry
-            return -1;
+            return false;
         }
     }
 }
 
+// bufcache::evict_clean()
+//    Frees the least recently used unreferenced entry that is neither
+//    dirty nor loading. Unlike `evict_lru`, never writes back or blocks.
+bool bufcache::evict_clean() {
+    assert(lock_.is_locked());
+    for(bcentry* e = lru_.back(); e; e = lru_.prev(e)) {
+        spinlock_guard eguard(e->lock_);
+        if(!e->ref_
+           && e->estate_ != bcentry::es_dirty
+           && e->estate_ != bcentry::es_loading) {
+            free_entry(e);
+            return true;
+        }
+    }
+    return false;
+}
+
 // bufcache::get_disk_entry(bn, cleaner)
 //    Reads disk block `bn` into the buffer cache, obtains a reference to it,
 //    and returns a pointer to its bcentry. The returned bcentry has
@@ -98,67 +197,141 @@ bcentry* bufcache::get_disk_entry(chkfs::blocknum_t bn,
                                   bcentry_clean_function cleaner) {
     assert(chkfs::blocksize == PAGESIZE);
     auto irqs = lock_.lock();
-    
-    size_t i;
+
+    bcentry* e;
     if(bn == 0) {
-        // superblock is always the last entry
-        i = ne;
+        // superblock has its own entry
+        e = &sb_;
     } else {
-        // look for slot containing `bn`
-        size_t empty_slot = -1;
-        for (i = 0; i != ne; ++i) {
-            if (e_[i].empty()) {
-                if (empty_slot == size_t(-1)) {
-                    empty_slot = i;
-                }
-            } else if (e_[i].bn_ == bn) {
+        while(true) {
+            // look for entry containing `bn`
+            if((e = lookup(bn))) {
+                lru_.erase(e);
                 break;
             }
-        }
-
-        // if not found, use a free slot
-        if (i == ne) {
-            // if cache is full, evict lru entry
-            if (empty_slot == size_t(-1)) {
-                // this may block
-                empty_slot = evict_lru(irqs);
-                if(empty_slot == size_t(-1)) {
-                    // eviction failed
-                    lock_.unlock(irqs);
-                    return nullptr;
-                }
+            // if not found, use a free entry
+            if((nused_ < limit_ || grow()) && (e = take_free())) {
+                e->bn_ = bn;
+                hash_[bn % nhash].push_front(e);
+                ++nused_;
+                break;
+            }
+            // if cache is full, or memory is too short for more entries,
+            // evict lru entry (this may block)
+            limit_ = min(limit_, nused_);
+            if(!evict_lru(irqs)) {
+                // eviction failed
+                lock_.unlock(irqs);
+                return nullptr;
             }
-            i = empty_slot;
         }
 
-        // mark most recently used slot
-        mark_mru(i);
+        // mark most recently used entry
+        lru_.push_front(e);
     }
 
     // obtain entry lock
-    e_[i].lock_.lock_noirq();
+    e->lock_.lock_noirq();
 
     // mark allocated if empty
-    if (e_[i].empty()) {
-        e_[i].estate_ = bcentry::es_allocated;
-        e_[i].bn_ = bn;
+    if (e->empty()) {
+        e->estate_ = bcentry::es_allocated;
+        e->bn_ = bn;
     }
 
     // no longer need cache lock
     lock_.unlock_noirq();
 
     // mark reference
-    ++e_[i].ref_;
+    ++e->ref_;
 
     // load block
-    bool ok = e_[i].load(irqs, cleaner);
+    bool ok = e->load(irqs, cleaner);
 
     // unlock and return entry
     if (!ok) {
-        --e_[i].ref_;
+        --e->ref_;
+    }
+    e->lock_.unlock(irqs);
+    return ok ? e : nullptr;
+}
+
+
+// bufcache::load_run(bn, count)
+//    Starts loading the uncached blocks among `[bn, bn + count)` and
+//    returns without waiting. Their requests are submitted together, so
+//    the disk reads consecutive blocks with one scatter-gather command.
+//    `get_disk_entry` then waits for each block like any other loading
+//    entry. Stops early rather than block for an entry or buffer. Only
+//    for data blocks: no cleaner runs.
+//
+//    Returns the number of blocks, from `bn` on, that are now cached or
+//    loading; this is less than `count` if the cache ran out of room.
+
+unsigned bufcache::load_run(blocknum_t bn, unsigned count) {
+    assert(bn > 0 && sata_disk);
+    count = min(count, max_run);
+    list<ahcistate::request, &ahcistate::request::link_> batch;
+
+    auto irqs = lock_.lock();
+    unsigned i;
+    for(i = 0; i != count; ++i) {
+        if(lookup(bn + i)) {
+            continue;
+        }
+        if(nused_ >= limit_ && !grow() && !evict_clean()) {
+            break;
+        }
+        bcentry* e = take_free();
+        if(!e) {
+            break;
+        }
+        spinlock_guard eguard(e->lock_);
+        if(!e->buf_) {
+            e->buf_ = reinterpret_cast<unsigned char*>
+                (kalloc(chkfs::blocksize, KALLOC_NOFILL));
+            if(!e->buf_) {
+                free_.push_front(e);
+                break;
+            }
+        }
+        e->bn_ = bn + i;
+        e->estate_ = bcentry::es_loading;
+        hash_[e->bn_ % nhash].push_front(e);
+        lru_.push_front(e);
+        ++nused_;
+
+        e->io_.cmd_ = ahcistate::cmd_read_fpdma_queued;
+        e->io_.buf_ = e->buf_;
+        e->io_.sz_ = chkfs::blocksize;
+        e->io_.sector_ = e->bn_ * (chkfs::blocksize / ahcistate::sectorsize);
+        e->io_.done_ = bcentry::finish_load;
+        e->io_.arg_ = e;
+        e->io_.wq_ = nullptr;
+        batch.push_back(&e->io_);
+    }
+    lock_.unlock(irqs);
+
+    if(!batch.empty()) {
+        sata_disk->submit(batch);
+    }
+    return i;
+}
+
+// bcentry::finish_load(r)
+//    Completion callback for `bufcache::load_run` requests. Runs in
+//    interrupt context. A failed read leaves the entry allocated, so the
+//    next `load` retries it synchronously.
+
+void bcentry::finish_load(ahcistate::request* r) {
+    bcentry* e = reinterpret_cast<bcentry*>(r->arg_);
+    bufcache& bc = bufcache::get();
+    {
+        spinlock_guard guard(e->lock_);
+        assert(e->estate_ == es_loading);
+        e->estate_ = r->status_ == 0 ? es_clean : es_allocated;
     }
-    e_[i].lock_.unlock(irqs);
-    return ok ? &e_[i] : nullptr;
+    bc.read_wq_.wake_all();
 }
 
 
@@ -176,7 +349,7 @@ bool bcentry::load(irqstate& irqs, bcentry_clean_function cleaner) {
         if (estate_ == es_allocated) {
             if (!buf_) {
                 buf_ = reinterpret_cast<unsigned char*>
-                    (kalloc(chkfs::blocksize));
+                    (kalloc(chkfs::blocksize, KALLOC_NOFILL));
                 if (!buf_) {
                     return false;
                 }
@@ -245,13 +418,75 @@ void bcentry::put_write(bool md) {
 
 
 // bcentry::mark_dirty()
-//    Marks this entry as dirty and add it to the dirty list
+//    Marks this entry as dirty and add it to the dirty list. Kicks the
+//    writeback task if too much of the cache is dirty.
 void bcentry::mark_dirty() {
     spinlock_guard g(lock_);
     if(estate_ != es_dirty) {
         estate_ = es_dirty;
-        dirty_list_.push_front(this);
-    }  
+        dirty_time_ = ktime();
+        {
+            spinlock_guard dguard(dirty_lock_);
+            dirty_list_.push_front(this);
+        }
+        bufcache& bc = bufcache::get();
+        if(++bc.ndirty_ > bc.limit_ * bufcache::dirty_ratio / 100) {
+            bufcache::writeback_wq_.wake_all();
+        }
+    }
+}
+
+
+// bufcache::write_back(dirty)
+//    Writes the entries on `dirty`, leaving it empty, and blocks until
+//    they are clean. The requests are submitted together, so runs of
+//    consecutive blocks go out as scatter-gather commands. Returns 0 or
+//    the first I/O error.
+//
+//    Callers take the entries off `dirty_list_` and count them in
+//    `nwriting_` under `dirty_lock_`, so `sync` can tell that they are
+//    not yet on disk.
+
+int bufcache::write_back(list<bcentry, &bcentry::link_>& dirty) {
+    list<bcentry, &bcentry::link_> inflight;
+    list<ahcistate::request, &ahcistate::request::link_> batch;
+    while(bcentry *e = dirty.pop_front()) {
+        // prevent buffer modifications while it's in flight to the disk
+        e->get_write();
+        e->io_.cmd_ = ahcistate::cmd_write_fpdma_queued;
+        e->io_.buf_ = e->buf_;
+        e->io_.sz_ = chkfs::blocksize;
+        e->io_.sector_ = e->bn_ * (chkfs::blocksize / ahcistate::sectorsize);
+        e->io_.done_ = nullptr;
+        e->io_.wq_ = &io_wq_;
+        batch.push_back(&e->io_);
+        inflight.push_back(e);
+    }
+    sata_disk->submit(batch);
+
+    int r = 0;
+    while(bcentry *e = inflight.pop_front()) {
+        waiter().block_until(io_wq_, [&] () {
+                return e->io_.status_ != E_AGAIN;
+            });
+        if(e->io_.status_ != 0) {
+            r = e->io_.status_;
+        }
+        {
+            // `finish_load` takes entry locks in interrupt context
+            spinlock_guard eguard(e->lock_);
+            e->estate_ = bcentry::es_clean;
+            --ndirty_;
+            // wake processes waiting for available entries to evict
+            if(!e->ref_) bufcache::evict_wq_.wake_all();
+        }
+        // only now may a writer dirty the entry again
+        e->put_write(false);
+        if(--nwriting_ == 0) {
+            io_wq_.wake_all();
+        }
+    }
+    return r;
 }
 
 
@@ -266,47 +501,136 @@ int bufcache::sync(int drop) {
 
     // save dirty list state
     list<bcentry, &bcentry::link_> dirty_list;
-    dirty_list.swap(bcentry::dirty_list_);
-    bcentry::dirty_list_.reset();
-
-    // write dirty entries to disk
-    while(bcentry *e = dirty_list.pop_front()) {
-        // prevent buffer modifications while it's in flight to the disk
-        e->get_write();
-        sata_disk->write(e->buf_, chkfs::blocksize, e->bn_ * chkfs::blocksize);
-        e->put_write(false);
-        
-        e->lock_.lock_noirq();
-        e->estate_ = bcentry::es_clean;
-        // wake processes waiting for available entries to evict
-        if(!e->ref_) bufcache::evict_wq_.wake_all();
-        e->lock_.unlock_noirq();
+    {
+        spinlock_guard dguard(bcentry::dirty_lock_);
+        dirty_list.swap(bcentry::dirty_list_);
+        for(bcentry* e = dirty_list.front(); e; e = dirty_list.next(e)) {
+            ++nwriting_;
+        }
     }
 
+    int r = write_back(dirty_list);
+
+    // entries the writeback task took off the dirty list earlier may
+    // still be in flight; they must reach the disk before sync returns
+    waiter().block_until(io_wq_, [&] () {
+            return nwriting_ == 0;
+        });
+
     // drop clean buffers if requested
     if (drop > 0) {
         spinlock_guard guard(lock_);
-        for (size_t i = 0; i != ne; ++i) {
-            spinlock_guard eguard(e_[i].lock_);
+        for (size_t i = 0; i != nalloc_; ++i) {
+            bcentry* e = entry(i);
+            spinlock_guard eguard(e->lock_);
 
             // validity checks: referenced entries aren't empty; if drop > 1,
             // no data blocks are referenced
-            assert(e_[i].ref_ == 0 || e_[i].estate_ != bcentry::es_empty);
-            if (e_[i].ref_ > 0 && drop > 1 && e_[i].bn_ >= 2) {
-                error_printf(CPOS(22, 0), COLOR_ERROR, "sync(2): block %u has nonzero reference count\n", e_[i].bn_);
-                assert_fail(__FILE__, __LINE__, "e_[i].bn_ < 2");
+            assert(e->ref_ == 0 || e->estate_ != bcentry::es_empty);
+            if (e->ref_ > 0 && drop > 1 && e->bn_ >= 2) {
+                error_printf(CPOS(22, 0), COLOR_ERROR, "sync(2): block %u has nonzero reference count\n", e->bn_);
+                assert_fail(__FILE__, __LINE__, "e->bn_ < 2");
             }
 
             // actually drop buffer
-            if (e_[i].ref_ == 0) {
-                e_[i].clear();
+            if (e->ref_ == 0 && !e->empty()
+                && e->estate_ != bcentry::es_loading
+                && e->estate_ != bcentry::es_dirty) {
+                free_entry(e);
                 // wake processes waiting for available entries to evict
                 bufcache::evict_wq_.wake_all();
             }
         }
     }
 
-    return 0;
+    return r;
+}
+
+
+// Background writeback
+//    The writeback task wakes every `writeback_interval_ns` and writes
+//    back entries that have been dirty for `dirty_expire_ns`, so dirty
+//    data reaches the disk in bounded time. `mark_dirty` wakes it early
+//    when more than `dirty_ratio` percent of the cache is dirty; it then
+//    writes back every dirty entry. Either way blocks are submitted in
+//    block-number order. This keeps clean entries available, so
+//    `evict_lru` rarely has to write back from the allocating process.
+
+// bufcache::writeback_once()
+//    Writes back expired dirty entries, or all of them if the dirty ratio
+//    is exceeded. Returns the number of entries written.
+
+size_t bufcache::writeback_once() {
+    bool all = ndirty_ > limit_ * dirty_ratio / 100;
+    uint64_t now = ktime();
+    uint64_t cutoff = now > dirty_expire_ns ? now - dirty_expire_ns : 0;
+
+    // the dirty list is newest first, so expired entries are at its back
+    list<bcentry, &bcentry::link_> dirty;
+    size_t n = 0;
+    {
+        spinlock_guard dguard(bcentry::dirty_lock_);
+        while(bcentry* e = bcentry::dirty_list_.back()) {
+            if(!all && e->dirty_time_ > cutoff) {
+                break;
+            }
+            bcentry::dirty_list_.erase(e);
+            // insert in block-number order
+            bcentry* pos = dirty.front();
+            while(pos && pos->bn_ < e->bn_) {
+                pos = dirty.next(pos);
+            }
+            dirty.insert(pos, e);
+            ++nwriting_;
+            ++n;
+        }
+    }
+    if(n) {
+        write_back(dirty);
+    }
+    return n;
+}
+
+// writeback_function()
+//    Body of the writeback task.
+
+static void writeback_function() {
+    bufcache& bc = bufcache::get();
+    // after a pass that found nothing to write (the dirty entries were
+    // all in flight elsewhere), wait for the timer even if over the ratio
+    bool stalled = false;
+    while(true) {
+        ktimer timer;
+        timer.start(ktime() + bufcache::writeback_interval_ns,
+                    ktimer::wake_wait_queue, &bufcache::writeback_wq_);
+        waiter().block_until(bufcache::writeback_wq_, [&] () {
+                return timer.fired()
+                    || (!stalled && bc.ndirty_ > bc.limit_
+                                    * bufcache::dirty_ratio / 100);
+            });
+        timer.cancel();
+        stalled = sata_disk && bc.writeback_once() == 0;
+    }
+}
+
+// bufcache::start_writeback()
+//    Creates the writeback task, a kernel task like the idle tasks.
+//    Called once by `kernel_start`.
+
+void bufcache::start_writeback() {
+    proc* p = knew<proc>();
+    assert(p);
+    p->init_kernel(-1, writeback_function);
+
+    // add writeback task to a process group
+    proc_group* pg = knew<proc_group>(-1, early_pagetable);
+    assert(pg);
+    pg->ppid_ = pg->pid_;
+    pg->add_child(pg);
+    p->pg_ = pg;
+    pg->add_proc(p);
+
+    cpus[ncpu - 1].enqueue(p);
 }
 
 
@@ -430,13 +754,32 @@ chkfs::inode* chkfsstate::get_inode(inum_t inum) {
 }
 
 
+// chkfsstate::inode_number(ino)
+//    Returns the inode number of `ino`, which must be located in the
+//    buffer cache (as returned by `get_inode`).
+
+chkfs::inum_t chkfsstate::inode_number(inode* ino) {
+    auto& bc = bufcache::get();
+    auto superblock_entry = bc.get_disk_entry(0);
+    assert(superblock_entry);
+    auto& sb = *reinterpret_cast<chkfs::superblock*>
+        (&superblock_entry->buf_[chkfs::superblock_offset]);
+    blocknum_t inode_bn = sb.inode_bn;
+    superblock_entry->put();
+
+    bcentry* e = ino->entry();
+    assert(e->bn_ >= inode_bn);
+    return (e->bn_ - inode_bn) * chkfs::inodesperblock
+        + (ino - reinterpret_cast<inode*>(e->buf_));
+}
+
+
 namespace chkfs {
 // chkfs::inode::entry()
 //    Returns a pointer to the buffer cache entry containing this inode.
 //    Requires that this inode is a pointer into buffer cache data.
 bcentry* inode::entry() {
-    assert(mbcindex < bufcache::ne);
-    auto entry = &bufcache::get().e_[mbcindex];
+    auto entry = bufcache::get().entry(mbcindex);
     assert(entry->contains(this));
     return entry;
 }
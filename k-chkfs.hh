@@ -2,6 +2,7 @@
 #define CHICKADEE_K_CHKFS_HH
 #include "kernel.hh"
 #include "chickadeefs.hh"
+#include "k-ahci.hh"
 #include "k-lock.hh"
 #include "k-wait.hh"
 
@@ -25,7 +26,13 @@ struct bcentry {
     std::atomic<int> write_ref_ = 0;     // write reference
     static wait_queue write_ref_wq_;     // write reference wait queue
     list_links link_;
-    static list<bcentry, &bcentry::link_> dirty_list_;
+    static list<bcentry, &bcentry::link_> dirty_list_;  // newest first
+    static spinlock dirty_lock_;         // protects dirty_list_
+    uint64_t dirty_time_ = 0;            // `ktime()` when last dirtied
+    list_links lru_link_;                // link in bufcache LRU or free list
+    list_links hash_link_;               // link in bufcache hash chain
+    ahcistate::request io_;              // disk request for `buf_`
+    uint32_t index_ = 0;                 // index in buffer cache
 
 
     // return the index of this entry in the buffer cache
@@ -49,33 +56,91 @@ struct bcentry {
     // internal functions
     void clear();
     bool load(irqstate& irqs, bcentry_clean_function cleaner);
+    static void finish_load(ahcistate::request* r);
 };
 
 struct bufcache {
     using blocknum_t = bcentry::blocknum_t;
 
-    // TODO: increase number of entries
-    static constexpr size_t ne = 100;
-
-    spinlock lock_;                  // protects lru_stack and all entries' bn_ and ref_
+    // The cache is sized at boot from free memory: it starts out allowed
+    // `initial_percent` of free pages, and may grow to `max_percent` while
+    // memory is plentiful. `kalloc` shrinks it when memory runs out.
+    static constexpr size_t initial_percent = 25;
+    static constexpr size_t max_percent = 50;
+    static constexpr size_t min_ne = 16;    // never shrink below this
+    static constexpr size_t nhash = 128;    // number of hash chains
+    static constexpr unsigned max_run = 32; // most blocks per `load_run`
+
+    // background writeback (see `writeback_once`)
+    static constexpr uint64_t writeback_interval_ns = 250000000;
+    static constexpr uint64_t dirty_expire_ns = 1000000000;
+    static constexpr size_t dirty_ratio = 10;   // percent of `limit_`
+
+    spinlock lock_{spinlock::ticket, "bufcache"}; // protects lru_, free_,
+                                    // hash_, nused_, limit_, and all
+                                    // entries' bn_ and ref_
     wait_queue read_wq_;
     static wait_queue evict_wq_;
-    bcentry e_[ne + 1];             // add extra entry for superblock
-    int lru_stack[ne];              // least recently used entries
+    static wait_queue io_wq_;       // woken when an entry's `io_` completes
+    static wait_queue writeback_wq_;    // writeback task sleeps here
+    std::atomic<size_t> ndirty_ = 0;    // number of dirty entries
+    std::atomic<size_t> nwriting_ = 0;  // dirty entries off `dirty_list_`
+                                        // being written back
+    // Entries besides the superblock's are allocated a page at a time as
+    // the cache fills, up to `ne_` in all. Entry `i` is
+    // `chunks_[i / chunk_entries][i % chunk_entries]`.
+    static constexpr size_t chunk_entries = PAGESIZE / sizeof(bcentry);
+    bcentry** chunks_ = nullptr;    // allocated pages of entries
+    size_t ne_ = 0;                 // most entries besides superblock
+    size_t nalloc_ = 0;             // number of entries allocated
+    bcentry sb_;                    // superblock's entry
+    size_t nused_ = 0;              // number of entries on `lru_`
+    size_t limit_ = 0;              // current maximum `nused_`
+    size_t grow_free_ = 0;          // grow only while more pages are free
+
+    // Every entry but the superblock's is either on `free_` (if empty) or
+    // on `lru_` and the hash chain for its `bn_`
+    list<bcentry, &bcentry::lru_link_> lru_;    // most recently used first
+    list<bcentry, &bcentry::lru_link_> free_;
+    list<bcentry, &bcentry::hash_link_> hash_[nhash];
 
 
     static inline bufcache& get();
 
+    void init();
+
+    // return entry number `i`, which must be allocated
+    inline bcentry* entry(size_t i) const;
+
     bcentry* get_disk_entry(blocknum_t bn,
                             bcentry_clean_function cleaner = nullptr);
+    // start loading data blocks `[bn, bn + count)`; does not block
+    unsigned load_run(blocknum_t bn, unsigned count);
 
     int sync(int drop);
-    void mark_mru(int index);       // mark most recently used entry
-    int evict_lru(irqstate& irqs);   // evict least recently used entry
+    void start_writeback();
+    size_t writeback_once();
+    bool evict_lru(irqstate& irqs);   // evict least recently used entry
+    size_t shrink(size_t n);          // free up to `n` clean buffers
 
  private:
     static bufcache bc;
 
+    // return the cached entry for `bn`, or nullptr. Requires `lock_`
+    bcentry* lookup(blocknum_t bn);
+    // empty `e` and move it to `free_`. Requires `lock_` and `e->lock_`
+    void free_entry(bcentry* e);
+    // write back `dirty`'s entries and wait for them
+    int write_back(list<bcentry, &bcentry::link_>& dirty);
+    // try to raise `limit_`. Requires `lock_`
+    bool grow();
+    // return an entry from `free_`, allocating a page of entries if
+    // needed, or nullptr if memory is short. Requires `lock_`
+    bcentry* take_free();
+    // free the least recently used clean, unreferenced entry without
+    // blocking. Requires `lock_`
+    bool evict_clean();
+
     bufcache();
     NO_COPY_OR_ASSIGN(bufcache);
 };
@@ -94,6 +159,8 @@ struct chkfsstate {
 
     // obtain an inode by number
     inode* get_inode(inum_t inum);
+    // return the number of a buffer-cached inode
+    inum_t inode_number(inode* ino);
 
     // directory lookup in `dirino`
     inode* lookup_inode(inode* dirino, const char* name);
@@ -124,9 +191,13 @@ inline chkfsstate& chkfsstate::get() {
 }
 
 inline size_t bcentry::index() const {
-    auto& bc = bufcache::get();
-    assert(this >= bc.e_ && this < bc.e_ + bc.ne);
-    return this - bc.e_;
+    assert(this != &bufcache::get().sb_);
+    return index_;
+}
+
+inline bcentry* bufcache::entry(size_t i) const {
+    assert(i < nalloc_);
+    return &chunks_[i / chunk_entries][i % chunk_entries];
 }
 
 inline bool bcentry::empty() const {
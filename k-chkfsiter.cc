@@ -53,6 +53,24 @@ chkfs_fileiter& chkfs_fileiter::find(off_t off) {
 }
 
 
+void chkfs_fileiter::load_ahead(size_t len) {
+    blocknum_t bn = blocknum();
+    if (!bn || (bn >= run_first_ && bn < run_last_)) {
+        return;
+    }
+    size_t left = ino_->size > off_ ? min(len, ino_->size - off_) : 0;
+    unsigned n = min(size_t(extent_blocks_left()),
+                     (block_relative_offset() + left + blocksize - 1)
+                     / blocksize,
+                     size_t(bufcache::max_run));
+    if (n > 1) {
+        bufcache::get().load_run(bn, n);
+    }
+    run_first_ = bn;
+    run_last_ = bn + max(n, 1U);
+}
+
+
 void chkfs_fileiter::next() {
     if (eptr_ && eptr_->count != 0) {
         do {
@@ -32,6 +32,14 @@ class chkfs_fileiter {
     inline bcentry* get_disk_entry() const;
     // Return the file offset relative to the current block
     inline unsigned block_relative_offset() const;
+    // Return the number of blocks from the current block to the end of
+    // its extent, or 0 if the offset does not point at data.
+    inline unsigned extent_blocks_left() const;
+    // Start loading the blocks holding the next `len` bytes of the file
+    // (within the current extent) as one disk command, unless a previous
+    // `load_ahead` on this iterator already started the current block.
+    // Does not block.
+    void load_ahead(size_t len);
 
 
     // Move the iterator to file offset `off`. Returns `*this`.
@@ -75,6 +83,10 @@ class chkfs_fileiter {
 
     // bcentry containing indirect extent block for `eidx_`
     bcentry* indirect_entry_ = nullptr;
+
+    // blocks `[run_first_, run_last_)` were started by `load_ahead`
+    blocknum_t run_first_ = 0;
+    blocknum_t run_last_ = 0;
 };
 
 
@@ -114,6 +126,13 @@ inline auto chkfs_fileiter::blocknum() const -> blocknum_t {
         return 0;
     }
 }
+inline unsigned chkfs_fileiter::extent_blocks_left() const {
+    if (!empty()) {
+        return eptr_->count - (off_ - eoff_) / blocksize;
+    } else {
+        return 0;
+    }
+}
 inline bcentry* chkfs_fileiter::get_disk_entry() const {
     blocknum_t bn = blocknum();
     return bn ? bufcache::get().get_disk_entry(bn) : nullptr;
@@ -29,9 +29,23 @@ void cpustate::init() {
     assert(self_ == this && !current_);
     cpuindex_ = this - cpus;
     runq_lock_.clear();
+    runq_count_ = 0;
+    min_vruntime_ = 0;
+    // stagger CPUs so they do not all balance at once
+    next_balance_ = balance_interval_ns * cpuindex_ / MAXCPU;
+    timer_lock_.clear();
+    timers_.reset();
+    timer_deadline_ = 0;
+    tickless_ = false;
     idle_task_ = nullptr;
     nschedule_ = 0;
     spinlock_depth_ = 0;
+    pagecache_count_ = 0;
+    pagecache_hits_ = 0;
+    pagecache_misses_ = 0;
+    for (int i = 0; i < slab_nclasses; ++i) {
+        slab_active_[i] = nullptr;
+    }
 
     // now initialize the CPU hardware
     init_cpu_hardware();
@@ -56,17 +70,88 @@ void cpustate::disable_irq(int irqno) {
 }
 
 
+// Fair scheduling
+//    Each CPU runs the queued process with the least virtual runtime
+//    `vruntime_`: the TSC cycles it has spent running, charged by
+//    `account` whenever the scheduler runs and on every timer interrupt.
+//    `runq_` is a pairing heap ordered by `vruntime_`. The timer
+//    interrupt preempts the current process only once some queued
+//    process has run less (see `should_preempt`), so processes that
+//    sleep a lot get the CPU as soon as they wake.
+//
+//    `min_vruntime_` tracks the least `vruntime_` on a CPU and never
+//    decreases. A process that blocked can't bank its idle time: when
+//    it is enqueued again, it starts at most `sched_wakeup_credit`
+//    cycles behind `min_vruntime_`.
+
 // cpustate::enqueue(p)
 //    Enqueue `p` on this CPU's run queue. Acquires `runq_lock_`. Does nothing
 //    if `p` is on a run queue or is currently running on this CPU; otherwise
 //    `p` must be resumable (or not runnable).
+//
+//    `p` stays on this CPU (`p->cpu_index_`) until another CPU steals it
+//    from the run queue, so `proc::wake` must enqueue it here. Kicks a
+//    halted CPU if one is needed to run `p`.
 
 void cpustate::enqueue(proc* p) {
-    spinlock_guard guard(runq_lock_);
-    if (current_ != p && !p->runq_link_.is_linked()) {
+    {
+        spinlock_guard guard(runq_lock_);
+        if (current_ == p || p->runq_link_.is_linked()) {
+            return;
+        }
         assert(p->resumable() || p->pstate_ != proc::ps_runnable);
-        runq_.push_back(p);
+        p->cpu_index_ = cpuindex_;
+        if (min_vruntime_ > p->vruntime_ + sched_wakeup_credit) {
+            p->vruntime_ = min_vruntime_ - sched_wakeup_credit;
+        }
+        runq_.push(p);
+        ++runq_count_;
+    }
+
+    // halted idle CPUs have no tick: wake this CPU, or if it is busy,
+    // an idle CPU that can steal `p`
+    if (tickless_) {
+        kick();
+        return;
+    }
+    for (int i = 0; i != ncpu; ++i) {
+        if (cpus[i].tickless_) {
+            cpus[i].kick();
+            return;
+        }
+    }
+}
+
+
+// cpustate::account(p)
+//    Charge `p`, which is running on this CPU, for the time since it was
+//    last charged. The idle task is never charged.
+
+void cpustate::account(proc* p) {
+    uint64_t now = rdtsc();
+    if (p != idle_task_) {
+        p->vruntime_ += now - p->run_start_;
     }
+    p->run_start_ = now;
+}
+
+
+// cpustate::should_preempt()
+//    Called from the timer interrupt. Charges the current process and
+//    returns true if it should yield: it is the idle task, it is no
+//    longer runnable or its process group is exiting, or a queued process
+//    has run less.
+
+bool cpustate::should_preempt() {
+    spinlock_guard guard(runq_lock_);
+    proc* p = current_;
+    if (p == idle_task_
+        || p->pstate_ != proc::ps_runnable
+        || p->pg_->who_exited_) {
+        return true;
+    }
+    account(p);
+    return !runq_.empty() && runq_.front()->vruntime_ < p->vruntime_;
 }
 
 
@@ -74,6 +159,8 @@ void cpustate::enqueue(proc* p) {
 //    Run a process, or the current CPU's idle task if no runnable
 //    process exists. If `yielding_from != nullptr`, then do not
 //    run `yielding_from` unless no other runnable process exists.
+//    Before falling back to the idle task, try to steal a process
+//    from another CPU.
 
 void cpustate::schedule(proc* yielding_from) {
     assert(contains(rdrsp()));     // running on CPU stack
@@ -97,6 +184,10 @@ void cpustate::schedule(proc* yielding_from) {
     if (current_ == idle_task_) {
         yielding_from = idle_task_;
     }
+    // charge the old current for its time
+    if (current_) {
+        account(current_);
+    }
     
     // increment schedule counter
     ++nschedule_;
@@ -107,41 +198,133 @@ void cpustate::schedule(proc* yielding_from) {
            || current_ == yielding_from) {
         runq_lock_.lock_noirq();
         
-        // re-enqueue old current if necessary
+        // re-enqueue old current if necessary (the idle task is never
+        // enqueued, so other CPUs can't steal it)
         proc* prev = current_;
-        if (prev && prev->pstate_ == proc::ps_runnable) {
+        if (prev && prev != idle_task_ && prev->pstate_ == proc::ps_runnable) {
             assert(prev->resumable());
             assert(!prev->runq_link_.is_linked());
-            runq_.push_back(prev);
+            runq_.push(prev);
+            ++runq_count_;
         }
 
-        // run idle task as last resort
-        current_ = runq_.empty() ? idle_task_ : runq_.pop_front();
+        // run the process with the least virtual runtime, skipping
+        // `yielding_from` if possible; run idle task as last resort
+        current_ = runq_.pop();
+        if (current_ && current_ == yielding_from && !runq_.empty()) {
+            proc* next = runq_.pop();
+            runq_.push(current_);
+            current_ = next;
+        }
+        if (current_) {
+            --runq_count_;
+            uint64_t v = current_->vruntime_;
+            if (!runq_.empty()) {
+                v = min(v, runq_.front()->vruntime_);
+            }
+            min_vruntime_ = max(min_vruntime_, v);
+        } else {
+            current_ = idle_task_;
+        }
 
         runq_lock_.unlock_noirq();
+
+        // rather than idle, take a process from a busy CPU
+        if (current_ == idle_task_) {
+            if (proc* p = steal(1)) {
+                runq_lock_.lock_noirq();
+                current_ = p;
+                runq_lock_.unlock_noirq();
+            }
+        }
+
         // no need to skip `current_` if no other runnable procs
         yielding_from = nullptr;
     }
 
+    // a CPU that was idle needs its scheduler tick back
+    if (current_ != idle_task_) {
+        restart_tick();
+    }
+
     // run `current_`
     set_pagetable(current_->pg_->pagetable_);
     // increase resume count
     current_->resume_count_++;
+    current_->run_start_ = rdtsc();
 
     current_->resume(); // does not return
 }
 
 
+// Work stealing
+//    Processes start on the CPU chosen by `fork` and stay there while
+//    they block and wake. An idle CPU steals from the CPU with the
+//    longest run queue, and every CPU periodically calls `balance` from
+//    the timer interrupt so queue lengths even out when no CPU is idle.
+//    A CPU never holds its own `runq_lock_` while taking another's.
+
+// cpustate::steal(min_count)
+//    Remove a process from the longest other run queue, if that queue
+//    holds at least `min_count` processes, and make this CPU its home.
+//    Returns the process or nullptr. Interrupts must be disabled and
+//    `runq_lock_` must not be held.
+
+proc* cpustate::steal(unsigned min_count) {
+    assert(is_cli() && !runq_lock_.is_locked());
+    cpustate* victim = nullptr;
+    unsigned victim_count = 0;
+    for (int i = 0; i != ncpu; ++i) {
+        unsigned n = cpus[i].runq_count_.load(std::memory_order_relaxed);
+        if (&cpus[i] != this && n >= min_count && n > victim_count) {
+            victim = &cpus[i];
+            victim_count = n;
+        }
+    }
+    if (!victim) {
+        return nullptr;
+    }
+
+    victim->runq_lock_.lock_noirq();
+    // take the process `victim` would run next, keeping its lag behind
+    // `victim`'s least virtual runtime
+    proc* p = victim->runq_.pop();
+    if (p) {
+        --victim->runq_count_;
+        p->cpu_index_ = cpuindex_;
+        int64_t lag = p->vruntime_ - victim->min_vruntime_;
+        p->vruntime_ = lag > 0 || uint64_t(-lag) < min_vruntime_
+            ? min_vruntime_ + lag : 0;
+    }
+    victim->runq_lock_.unlock_noirq();
+    return p;
+}
+
+// cpustate::balance()
+//    Move one process to this CPU if another CPU's run queue is at
+//    least two longer than this one's. Called from the timer interrupt.
+
+void cpustate::balance() {
+    if (proc* p = steal(runq_count_ + 2)) {
+        enqueue(p);
+    }
+}
+
+
 // cpustate::idle_task
 //    Every CPU has an *idle task*, which is a kernel task (i.e., a
 //    `proc` that runs in kernel mode) that just stops the processor
 //    until an interrupt is received. The idle task runs when a CPU
-//    has nothing better to do.
+//    has nothing better to do; it first uses the time to zero pages
+//    for `kalloc`, then halts without a scheduler tick (see `k-timer.cc`).
 
 void idle() {
-    sti();
     while (true) {
-        asm volatile("hlt");
+        sti();
+        if (!refill_zero_pages()) {
+            cli();
+            this_cpu()->idle_halt();
+        }
     }
 }
 
@@ -250,7 +250,7 @@ void consolestate::cursor(bool show) {
 
 // memfile functions
 
-spinlock initfs_lock;
+spinlock initfs_lock("initfs_lock");
 
 // memfile::initfs_lookup(name, namelen, create)
 //    Search `memfile::initfs` for a file named `name`. Return the
@@ -359,6 +359,16 @@ void memfile_loader::put_page() {
     // no need to do anything
 }
 
+bool memfile_loader::set_source(vm_area& vma) {
+    // initfs memfiles live as long as the kernel
+    if (memfile_ < memfile::initfs
+        || memfile_ >= memfile::initfs + memfile::initfs_size) {
+        return false;
+    }
+    vma.mf_index = memfile_ - memfile::initfs;
+    return true;
+}
+
 // diskfile_loader functions
 
 ssize_t diskfile_loader::get_page(uint8_t** pg, size_t off) {
@@ -388,4 +398,11 @@ ssize_t diskfile_loader::get_page(uint8_t** pg, size_t off) {
 
 void diskfile_loader::put_page(){
     if(e_) e_->put();
+    e_ = nullptr;
+}
+
+bool diskfile_loader::set_source(vm_area& vma) {
+    if(!ino_) return false;
+    vma.inum = chkfsstate::get().inode_number(ino_);
+    return true;
 }
@@ -141,6 +141,7 @@ struct memfile_loader : public proc_loader {
     }
     ssize_t get_page(uint8_t** pg, size_t off) override;
     void put_page() override;
+    bool set_source(vm_area& vma) override;
 };
 
 
@@ -158,6 +159,7 @@ struct diskfile_loader : public proc_loader {
     }
     ssize_t get_page(uint8_t** pg, size_t off) override;
     void put_page() override;
+    bool set_source(vm_area& vma) override;
 };
 
 
@@ -4,24 +4,12 @@
 // global futex table
 futex_table ftable;
 
-// futex_table::wake_processes(kptr, count)
-//      wakes 'count' processes sleeping on the wait queue associated
-//      with 'kptr' addresses. Returns number of processes awaken.
-//      If wait_queue is non existent, or has no processes, return 0.
-int futex_table::wake_processes(int* kptr, int count) {
-    assert(lock_.is_locked());
-
-    // look for wait_queue of processess
-    wait_queue* wq = get_wait_queue(kptr);
-
-    // if not found, tell caller that 0 processes were awoken
-    if(!wq) return 0;
-    
-    // otherwise, try waking 'count' processes;
-    return wq->wake_some(count);
+static std::atomic<int>* futex_word(int* kptr) {
+    return reinterpret_cast<std::atomic<int>*>(kptr);
 }
 
-wait_queue* futex_table::get_wait_queue(int* kptr) {
+
+wait_queue* futex_bucket::get_wait_queue(int* kptr) {
     assert(lock_.is_locked());
 
     // look for entry whose containing 'paddr'
@@ -36,9 +24,26 @@ wait_queue* futex_table::get_wait_queue(int* kptr) {
     return nullptr;
 }
 
-wait_queue* futex_table::create_wait_queue(int* kptr) {
+wait_queue* futex_bucket::create_wait_queue(int* kptr) {
     assert(lock_.is_locked());
-    
+
+    // reuse this address's entry or an idle one. Waiters join and leave
+    // a queue only while holding `lock_`, so an empty queue stays empty.
+    futex_entry* idle = nullptr;
+    for (futex_entry* entry = entries_.front(); entry;
+         entry = entries_.next(entry)) {
+        if (entry->kptr_ == kptr) {
+            return &entry->wq_;
+        }
+        if (!idle && entry->wq_.q_.empty()) {
+            idle = entry;
+        }
+    }
+    if (idle) {
+        idle->kptr_ = kptr;
+        return &idle->wq_;
+    }
+
     // try allocating a new entry
     futex_entry* new_entry = knew<futex_entry>(kptr);
     if(!new_entry) return nullptr;
@@ -48,4 +53,280 @@ wait_queue* futex_table::create_wait_queue(int* kptr) {
 
     // return its wait_queue
     return &new_entry->wq_;
-}
\ No newline at end of file
+}
+
+// futex_bucket::wake(kptr, count, bitset)
+//      wakes 'count' processes sleeping on the wait queue associated
+//      with 'kptr' addresses. Returns number of processes awaken.
+//      If wait_queue is non existent, or has no processes, return 0.
+int futex_bucket::wake(int* kptr, int count, uint32_t bitset) {
+    assert(lock_.is_locked());
+
+    // look for wait_queue of processess
+    wait_queue* wq = get_wait_queue(kptr);
+
+    // if not found, tell caller that 0 processes were awoken
+    if(!wq) return 0;
+
+    // otherwise, try waking 'count' matching processes
+    spinlock_guard guard(wq->lock_);
+    int awoken = 0;
+    waiter* w = wq->q_.front();
+    while (w && awoken < count) {
+        waiter* next = wq->q_.next(w);
+        if (static_cast<futex_waiter*>(w)->bitset_ & bitset) {
+            wq->q_.erase(w);
+            w->wake();
+            ++awoken;
+        }
+        w = next;
+    }
+    return awoken;
+}
+
+
+// futex_table::lock_waiter_bucket(w, irqs)
+//    Lock and return the bucket holding `w`'s current futex. Returns with
+//    interrupts disabled; `irqs` gets the previous interrupt state.
+futex_bucket& futex_table::lock_waiter_bucket(futex_waiter& w, irqstate& irqs) {
+    while (true) {
+        int* kptr = w.kptr_;
+        futex_bucket& b = bucket(kptr);
+        irqs = b.lock_.lock();
+        // a requeue may have moved `w` before we got the lock
+        if (w.kptr_ == kptr) {
+            return b;
+        }
+        b.lock_.unlock(irqs);
+    }
+}
+
+// futex_table::lock_pair(b1, b2), futex_table::unlock_pair(b1, b2, irqs)
+//    Lock two buckets, which may be the same, in address order.
+irqstate futex_table::lock_pair(futex_bucket& b1, futex_bucket& b2) {
+    if (&b1 == &b2) {
+        return b1.lock_.lock();
+    }
+    futex_bucket& first = &b1 < &b2 ? b1 : b2;
+    futex_bucket& second = &b1 < &b2 ? b2 : b1;
+    irqstate irqs = first.lock_.lock();
+    second.lock_.lock_noirq();
+    return irqs;
+}
+
+void futex_table::unlock_pair(futex_bucket& b1, futex_bucket& b2,
+                              irqstate& irqs) {
+    if (&b1 != &b2) {
+        b2.lock_.unlock_noirq();
+    }
+    b1.lock_.unlock(irqs);
+}
+
+
+// futex_table::wait(kptr, val, bitset, timeout_ms)
+//    Block until woken by a wake operation whose bitset intersects
+//    `bitset`, as long as `*kptr == val`. Returns E_AGAIN if `*kptr != val`
+//    to begin with. Returns E_TIMEDOUT if `timeout_ms` is nonzero and that
+//    many milliseconds pass first.
+//
+//    A waiter woken while the value is unchanged goes back to sleep. But a
+//    waiter that was requeued onto another futex returns 0 when woken
+//    there, without checking any value, as on Linux.
+int futex_table::wait(int* kptr, int val, uint32_t bitset,
+                      unsigned long timeout_ms) {
+    proc* p = current();
+    futex_waiter w;
+    w.kptr_ = kptr;
+    w.bitset_ = bitset;
+
+    ktimer timer;
+    if (timeout_ms) {
+        timer.start(ktime() + timeout_ms * 1000000, ktimer::wake_proc, p);
+    }
+
+    int r = E_AGAIN;
+    while (true) {
+        irqstate irqs;
+        futex_bucket& b = lock_waiter_bucket(w, irqs);
+        int* cur = w.kptr_;
+
+        // if value at 'kptr' doesn't match 'val', we're done
+        if (cur == kptr && futex_word(kptr)->load() != val) {
+            b.lock_.unlock(irqs);
+            break;
+        }
+
+        // get the wait_queue of processes that care about this futex,
+        // allocating a new entry if necessary. Look it up again after each
+        // wakeup: once its queue is empty, an entry may be reused for
+        // another address
+        wait_queue* wq = b.create_wait_queue(cur);
+        if (!wq) {
+            b.lock_.unlock(irqs);
+            r = E_NOMEM;
+            break;
+        }
+        w.prepare(*wq);
+        // `fired_` is set before the timer wakes us, so checking after
+        // `prepare` can't miss a timeout
+        if (timer.fired()) {
+            w.clear();
+            b.lock_.unlock(irqs);
+            r = E_TIMEDOUT;
+            break;
+        }
+        b.lock_.unlock(irqs);
+
+        if (p->pstate_ == proc::ps_blocked) {
+            p->yield();
+        }
+
+        // wakers remove waiters from the queue; timeouts and other
+        // wakeups leave them there
+        futex_bucket& b2 = lock_waiter_bucket(w, irqs);
+        bool woken = !w.links_.is_linked();
+        bool requeued = w.kptr_ != kptr;
+        w.clear();
+        b2.lock_.unlock(irqs);
+
+        r = 0;
+        if (woken && requeued) {
+            break;
+        } else if (!woken && timer.fired()) {
+            r = E_TIMEDOUT;
+            break;
+        }
+    }
+
+    timer.cancel();
+    return r;
+}
+
+// futex_table::wake(kptr, count, bitset)
+//    Wake up to `count` waiters on `kptr` whose bitsets intersect
+//    `bitset`. Returns the number woken.
+int futex_table::wake(int* kptr, int count, uint32_t bitset) {
+    futex_bucket& b = bucket(kptr);
+    spinlock_guard guard(b.lock_);
+    return b.wake(kptr, count, bitset);
+}
+
+// futex_table::requeue(kptr, kptr2, count, count2, cmpval)
+//    Wake up to `count` waiters on `kptr`, then move up to `count2` of the
+//    remaining waiters to `kptr2`'s queue without waking them. If `cmpval`
+//    is nonnull, first check that `*kptr == *cmpval`, returning E_AGAIN if
+//    not. Returns the number of waiters woken or moved.
+int futex_table::requeue(int* kptr, int* kptr2, int count, int count2,
+                         const int* cmpval) {
+    futex_bucket& b1 = bucket(kptr);
+    futex_bucket& b2 = bucket(kptr2);
+    irqstate irqs = lock_pair(b1, b2);
+
+    if (cmpval && futex_word(kptr)->load() != *cmpval) {
+        unlock_pair(b1, b2, irqs);
+        return E_AGAIN;
+    }
+
+    int n = b1.wake(kptr, count, ~0U);
+    wait_queue* wq = b1.get_wait_queue(kptr);
+    if (count2 > 0 && kptr2 != kptr && wq && !wq->q_.empty()) {
+        wait_queue* wq2 = b2.create_wait_queue(kptr2);
+        list<waiter, &waiter::links_> moving;
+        if (wq2) {
+            spinlock_guard guard(wq->lock_);
+            for (int i = 0; i != count2; ++i) {
+                waiter* w = wq->q_.pop_front();
+                if (!w) {
+                    break;
+                }
+                moving.push_back(w);
+            }
+        }
+        if (!moving.empty()) {
+            spinlock_guard guard(wq2->lock_);
+            while (waiter* w = moving.pop_front()) {
+                wq2->q_.push_back(w);
+                w->wq_ = wq2;
+                static_cast<futex_waiter*>(w)->kptr_ = kptr2;
+                ++n;
+            }
+        }
+    }
+
+    unlock_pair(b1, b2, irqs);
+    return n;
+}
+
+// futex_table::wake_op(kptr, kptr2, count, count2, op)
+//    Atomically update `*kptr2` as `op` describes (see `FUTEX_OP` in
+//    lib.hh), then wake up to `count` waiters on `kptr`, and, if the old
+//    value of `*kptr2` passes `op`'s comparison, up to `count2` waiters
+//    on `kptr2`. Returns the total number woken.
+int futex_table::wake_op(int* kptr, int* kptr2, int count, int count2,
+                         uint32_t op) {
+    int opcode = (op >> 28) & 0xF;
+    int cmp = (op >> 24) & 0xF;
+    int oparg = int(op << 8) >> 20;
+    int cmparg = int(op << 20) >> 20;
+    if (opcode & FUTEX_OP_OPARG_SHIFT) {
+        oparg = 1 << (oparg & 31);
+        opcode &= ~FUTEX_OP_OPARG_SHIFT;
+    }
+    if (opcode > FUTEX_OP_XOR || cmp > FUTEX_OP_CMP_GE) {
+        return E_INVAL;
+    }
+
+    futex_bucket& b1 = bucket(kptr);
+    futex_bucket& b2 = bucket(kptr2);
+    irqstate irqs = lock_pair(b1, b2);
+
+    std::atomic<int>* word2 = futex_word(kptr2);
+    int old;
+    switch (opcode) {
+    case FUTEX_OP_SET:
+        old = word2->exchange(oparg);
+        break;
+    case FUTEX_OP_ADD:
+        old = word2->fetch_add(oparg);
+        break;
+    case FUTEX_OP_OR:
+        old = word2->fetch_or(oparg);
+        break;
+    case FUTEX_OP_ANDN:
+        old = word2->fetch_and(~oparg);
+        break;
+    default:
+        old = word2->fetch_xor(oparg);
+        break;
+    }
+
+    int n = b1.wake(kptr, count, ~0U);
+
+    bool match;
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ:
+        match = old == cmparg;
+        break;
+    case FUTEX_OP_CMP_NE:
+        match = old != cmparg;
+        break;
+    case FUTEX_OP_CMP_LT:
+        match = old < cmparg;
+        break;
+    case FUTEX_OP_CMP_LE:
+        match = old <= cmparg;
+        break;
+    case FUTEX_OP_CMP_GT:
+        match = old > cmparg;
+        break;
+    default:
+        match = old >= cmparg;
+        break;
+    }
+    if (match) {
+        n += b2.wake(kptr2, count2, ~0U);
+    }
+
+    unlock_pair(b1, b2, irqs);
+    return n;
+}
@@ -4,9 +4,11 @@
 #include "k-waitstruct.hh"
 
 // access a global futex hastable keyed by physical address.
-// Each entry is a wait queue of processes waiting on that address
+// Each entry is a wait queue of processes waiting on that address.
+// The table is split into `FUTEX_NBUCKETS` buckets, each with its own
+// lock, so futex operations on different addresses rarely contend.
 
-#define FUTEX_TABLE_SIZE 50
+#define FUTEX_NBUCKETS 64
 
 struct futex_entry {
     inline futex_entry(int* kptr) : kptr_(kptr) {
@@ -17,19 +19,64 @@ struct futex_entry {
     list_links link_;
 };
 
-struct futex_table {
-    spinlock lock_;                             // protects access to the table
+// futex_waiter
+//    Every waiter on a futex wait queue is a `futex_waiter`. `kptr_` and
+//    the waiter's `wq_` change only with the bucket locks for the old and
+//    new futex held (see `futex_table::requeue`).
+struct futex_waiter : waiter {
+    std::atomic<int*> kptr_;                    // futex currently waited on
+    uint32_t bitset_;                           // for FUTEX_WAKE_BITSET
+};
+
+struct futex_bucket {
+    spinlock lock_;                             // protects `entries_`,
+                                                // entries' `kptr_`, and
+                                                // entries' wait queues
 
+    // Return the wait queue for `kptr`, or nullptr if none.
+    // Requires `lock_`.
     wait_queue* get_wait_queue(int* kptr);
-    wait_queue* create_wait_queue(int* ktpr);
-    int wake_processes(int* kptr, int count);
+    // Return the wait queue for `kptr`, creating it if necessary; returns
+    // nullptr if out of memory. Requires `lock_`.
+    wait_queue* create_wait_queue(int* kptr);
+    // Wake up to `count` waiters on `kptr` whose bitsets intersect
+    // `bitset`. Returns the number woken. Requires `lock_`.
+    int wake(int* kptr, int count, uint32_t bitset);
 
 private:
-    // TODO: future improvement: use hashtable instead
+    // Entries are never freed. An entry whose wait queue is empty is
+    // reused for the next new address that hashes to this bucket.
     list<futex_entry, &futex_entry::link_> entries_;
 };
 
+struct futex_table {
+    // Return the bucket responsible for `kptr`
+    inline futex_bucket& bucket(int* kptr);
 
-#endif
+    // The futex operations. `kptr` and `kptr2` are kernel pointers to
+    // futex words; see `proc::syscall_futex`.
+    int wait(int* kptr, int val, uint32_t bitset, unsigned long timeout_ms);
+    int wake(int* kptr, int count, uint32_t bitset);
+    int requeue(int* kptr, int* kptr2, int count, int count2,
+                const int* cmpval);
+    int wake_op(int* kptr, int* kptr2, int count, int count2, uint32_t op);
 
+private:
+    futex_bucket buckets_[FUTEX_NBUCKETS];
 
+    futex_bucket& lock_waiter_bucket(futex_waiter& w, irqstate& irqs);
+    irqstate lock_pair(futex_bucket& b1, futex_bucket& b2);
+    void unlock_pair(futex_bucket& b1, futex_bucket& b2, irqstate& irqs);
+};
+
+
+inline futex_bucket& futex_table::bucket(int* kptr) {
+    // Fibonacci hashing of the word index
+    uint64_t h = (reinterpret_cast<uintptr_t>(kptr) >> 2)
+        * 0x9E3779B97F4A7C15UL;
+    static_assert((FUTEX_NBUCKETS & (FUTEX_NBUCKETS - 1)) == 0,
+                  "FUTEX_NBUCKETS must be a power of 2");
+    return buckets_[h >> (64 - __builtin_ctz(FUTEX_NBUCKETS))];
+}
+
+#endif
@@ -15,13 +15,13 @@ pcistate pcistate::state;
 
 // kalloc_pagetable
 //    Allocate, initialize, and return a new, empty page table. Memory is
-//    allocated using `kalloc()`. The page table's high memory is copied
-//    from `early_pagetable`.
+//    allocated using `kalloc()`, already zeroed. The page table's high
+//    memory is copied from `early_pagetable`.
 
 x86_64_pagetable* kalloc_pagetable() {
-    x86_64_pagetable* pt = knew<x86_64_pagetable>();
+    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
+        (kalloc(PAGESIZE, KALLOC_ZERO));
     if (pt) {
-        memset(&pt->entry[0], 0, sizeof(x86_64_pageentry_t) * 256);
         memcpy(&pt->entry[256], &early_pagetable->entry[256],
                sizeof(x86_64_pageentry_t) * 256);
     }
@@ -135,6 +135,7 @@ void process_halt() {
             halt_at = ticks + halt_after;
         }
     }
+    log_kalloc_stats();
     // yield until halt time
     while (halt_at == 0 || long(halt_at - ticks) > 0) {
         current()->yield();
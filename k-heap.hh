@@ -0,0 +1,181 @@
+#ifndef CHICKADEE_HEAP_HH
+#define CHICKADEE_HEAP_HH
+#include "types.h"
+
+// heap<T, member, Less>: an intrusive pairing heap. `front()` is the
+// least element according to `Less`. `push` is O(1); `pop` and `erase`
+// take amortized O(log n) time. Like `list`, elements embed their own
+// `heap_links`, so a heap never allocates.
+
+struct heap_links {
+    heap_links* child_ = nullptr;      // first child
+    heap_links* next_ = nullptr;       // next sibling
+    heap_links* prev_ = nullptr;       // previous sibling, or parent
+    bool linked_ = false;
+
+
+    // Initialize an empty `heap_links`
+    heap_links() = default;
+    NO_COPY_OR_ASSIGN(heap_links);
+
+    // Reset this `heap_links` to empty
+    inline void reset();
+
+    // Return true iff this `heap_links` is linked in to some heap
+    inline bool is_linked() const;
+};
+
+
+template <typename T, heap_links (T::* member), typename Less>
+struct heap {
+    heap_links* root_ = nullptr;
+
+
+    // Construct an empty heap
+    inline heap() = default;
+    // Reset this heap to empty, ignoring its current contents
+    inline void reset();
+
+    // Return true iff heap is empty
+    inline constexpr bool empty() const;
+
+    // Return least element (nullptr if empty)
+    inline T* front() const;
+
+    // Add `x` to heap
+    inline void push(T* x);
+    // Remove and return least element (return nullptr if empty)
+    inline T* pop();
+    // Remove `x` from heap
+    inline void erase(T* x);
+
+
+private:
+    static T* from_links(heap_links* hl) {
+        return mem_container(hl, member);
+    }
+    static inline heap_links* meld(heap_links* a, heap_links* b);
+    static inline heap_links* merge_pairs(heap_links* first);
+};
+
+
+inline void heap_links::reset() {
+    child_ = next_ = prev_ = nullptr;
+    linked_ = false;
+}
+
+inline bool heap_links::is_linked() const {
+    return linked_;
+}
+
+
+template <typename T, heap_links (T::* member), typename Less>
+inline void heap<T, member, Less>::reset() {
+    root_ = nullptr;
+}
+
+template <typename T, heap_links (T::* member), typename Less>
+inline constexpr bool heap<T, member, Less>::empty() const {
+    return !root_;
+}
+
+template <typename T, heap_links (T::* member), typename Less>
+inline T* heap<T, member, Less>::front() const {
+    return root_ ? from_links(root_) : nullptr;
+}
+
+template <typename T, heap_links (T::* member), typename Less>
+inline void heap<T, member, Less>::push(T* x) {
+    heap_links* hl = &(x->*member);
+    assert(!hl->is_linked());
+    hl->linked_ = true;
+    root_ = meld(root_, hl);
+}
+
+template <typename T, heap_links (T::* member), typename Less>
+inline T* heap<T, member, Less>::pop() {
+    heap_links* hl = root_;
+    if (!hl) {
+        return nullptr;
+    }
+    root_ = merge_pairs(hl->child_);
+    hl->reset();
+    return from_links(hl);
+}
+
+template <typename T, heap_links (T::* member), typename Less>
+inline void heap<T, member, Less>::erase(T* x) {
+    heap_links* hl = &(x->*member);
+    assert(hl->is_linked());
+    if (hl == root_) {
+        pop();
+        return;
+    }
+    // unlink `hl` from its parent or previous sibling, then meld its
+    // children back into the heap
+    if (hl->prev_->child_ == hl) {
+        hl->prev_->child_ = hl->next_;
+    } else {
+        hl->prev_->next_ = hl->next_;
+    }
+    if (hl->next_) {
+        hl->next_->prev_ = hl->prev_;
+    }
+    root_ = meld(root_, merge_pairs(hl->child_));
+    hl->reset();
+}
+
+// heap::meld(a, b)
+//    Combine two heap roots (either may be nullptr) and return the new
+//    root. The loser becomes the winner's first child.
+template <typename T, heap_links (T::* member), typename Less>
+inline heap_links* heap<T, member, Less>::meld(heap_links* a, heap_links* b) {
+    if (!a || !b) {
+        return a ? a : b;
+    }
+    if (Less()(from_links(b), from_links(a))) {
+        heap_links* t = a;
+        a = b;
+        b = t;
+    }
+    b->prev_ = a;
+    b->next_ = a->child_;
+    if (a->child_) {
+        a->child_->prev_ = b;
+    }
+    a->child_ = b;
+    a->next_ = a->prev_ = nullptr;
+    return a;
+}
+
+// heap::merge_pairs(first)
+//    Meld the sibling list starting at `first` into one heap using the
+//    standard two-pass scheme, and return its root.
+template <typename T, heap_links (T::* member), typename Less>
+inline heap_links* heap<T, member, Less>::merge_pairs(heap_links* first) {
+    // pass 1: meld adjacent pairs left to right, stacking the results
+    heap_links* pairs = nullptr;
+    while (first) {
+        heap_links* a = first;
+        heap_links* b = a->next_;
+        first = b ? b->next_ : nullptr;
+        a->next_ = a->prev_ = nullptr;
+        if (b) {
+            b->next_ = b->prev_ = nullptr;
+        }
+        heap_links* m = meld(a, b);
+        m->next_ = pairs;
+        pairs = m;
+    }
+    // pass 2: meld the stack right to left
+    heap_links* root = nullptr;
+    while (pairs) {
+        heap_links* m = pairs;
+        pairs = m->next_;
+        m->next_ = nullptr;
+        root = meld(root, m);
+    }
+    return root;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include "lib.hh"
 #include "k-ahci.hh"
 #include "k-apic.hh"
+#include "k-chkfs.hh"
 #include "k-devices.hh"
 #include "elf.h"
 
@@ -55,6 +56,9 @@ void init_hardware() {
     // enable interrupts
     cpus[0].enable_irq(IRQ_KEYBOARD);
 
+    // size the buffer cache from the memory left free
+    bufcache::get().init();
+
     // initialize SATA drive
     sata_disk = ahcistate::find();
     if (sata_disk && sata_disk->irq_ > 0) {
@@ -198,9 +202,32 @@ void init_constructors() {
 
 memrangeset<16> physical_ranges(0x100000000UL);
 
+// cmos_read(reg)
+//    Return the value of CMOS register `reg`.
+static uint8_t cmos_read(int reg) {
+    outb(0x70, reg);
+    return inb(0x71);
+}
+
+// memsize_physical()
+//    Return the size of physical memory below the high I/O region, as the
+//    BIOS records it in CMOS, but at least `MEMSIZE_PHYSICAL`.
+static uintptr_t memsize_physical() {
+    uintptr_t sz;
+    // registers 0x34-0x35 count 64KiB blocks above 16MiB;
+    // registers 0x30-0x31 count 1KiB blocks above 1MiB
+    if (uintptr_t n = cmos_read(0x34) | (cmos_read(0x35) << 8)) {
+        sz = 0x1000000 + (n << 16);
+    } else {
+        uintptr_t k = cmos_read(0x30) | (cmos_read(0x31) << 8);
+        sz = 0x100000 + (k << 10);
+    }
+    return min(max(sz, uintptr_t(MEMSIZE_PHYSICAL)), uintptr_t(PA_IOHIGHMIN));
+}
+
 void init_physical_ranges() {
-    // [0, MEMSIZE_PHYSICAL) starts out available
-    physical_ranges.set(0, MEMSIZE_PHYSICAL, mem_available);
+    // [0, memory size) starts out available
+    physical_ranges.set(0, memsize_physical(), mem_available);
     // 0 page is reserved (because nullptr)
     physical_ranges.set(0, PAGESIZE, mem_reserved);
     // I/O memory is reserved (except the console is `mem_console`)
@@ -229,7 +256,8 @@ void init_physical_ranges() {
     init_sanitizers();
 #endif
 
-    // `physical_ranges` is constant after this point.
+    // `physical_ranges` is constant after this point, except that
+    // `init_kalloc` reserves memory for its page descriptors.
 }
 
 
@@ -296,10 +324,13 @@ void cpustate::init_cpu_hardware() {
 
     lapic_id_ = lapic.id();
 
-    // lapic timer goes off every 0.01s
+    // lapic timer is one-shot (see `k-timer.cc`); first interrupt in 0.01s
+    if (cpuindex_ == 0) {
+        ktime_init();
+    }
     lapic.write(lapic.reg_timer_divide, lapic.timer_divide_1);
-    lapic.write(lapic.reg_lvt_timer,
-                lapic.timer_periodic | (INT_IRQ + IRQ_TIMER));
+    lapic.write(lapic.reg_lvt_timer, INT_IRQ + IRQ_TIMER);
+    timer_deadline_ = ktime() + 1000000000 / HZ;
     lapic.write(lapic.reg_timer_initial_count, 1000000000 / HZ);
 
     // disable logical interrupt lines
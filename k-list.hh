@@ -175,7 +175,7 @@ inline void list<T, member>::erase(T* x) {
 
 template <typename T, list_links (T::* member)>
 inline void list<T, member>::insert(T* position, T* x) {
-    (x->*member).insert_before(position ? &head_ : &(position->*member));
+    (x->*member).insert_before(position ? &(position->*member) : &head_);
 }
 
 template <typename T, list_links (T::* member)>
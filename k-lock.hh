@@ -43,9 +43,79 @@ struct irqstate {
 };
 
 
+// lockstat
+//    Contention statistics for all spinlocks with one name (for example,
+//    every CPU's `runq_lock`). Only kept in kernels built with `make
+//    LOCKSTAT=1` (which defines `HAVE_LOCKSTAT`); see `log_lockstats` and
+//    `sys_lockstats`. Locks sharing an entry may be held at the same time,
+//    so the counters are atomic. `rwspinlock` readers count as
+//    acquisitions too; only exclusive holds are timed.
+
+struct lockstat {
+    const char* name_;
+    std::atomic<uint64_t> nacquire_;        // # acquisitions
+    std::atomic<uint64_t> ncontended_;      // # acquisitions that had to spin
+    std::atomic<uint64_t> spin_cycles_;     // total TSC cycles spent spinning
+    std::atomic<uint64_t> max_hold_cycles_; // longest hold, in TSC cycles
+
+    // Return the entry in `lockstats` for `name`, adding one if needed.
+    // Returns nullptr (and counts the lock in `nlockstats_dropped`) if
+    // the table is full.
+    static lockstat* make(const char* name);
+
+    // Record an acquisition that started spinning at `spin_start` (0 if
+    // it did not spin). Returns the acquisition time.
+    uint64_t acquired(uint64_t spin_start) {
+        uint64_t now = rdtsc();
+        nacquire_.fetch_add(1, std::memory_order_relaxed);
+        if (spin_start) {
+            ncontended_.fetch_add(1, std::memory_order_relaxed);
+            spin_cycles_.fetch_add(now - spin_start,
+                                   std::memory_order_relaxed);
+        }
+        return now;
+    }
+    // Record a release of a lock acquired at `hold_start`.
+    void released(uint64_t hold_start) {
+        uint64_t held = rdtsc() - hold_start;
+        uint64_t max = max_hold_cycles_.load(std::memory_order_relaxed);
+        while (held > max
+               && !max_hold_cycles_.compare_exchange_weak(
+                      max, held, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+#define NLOCKSTATS 64
+extern lockstat lockstats[NLOCKSTATS];
+extern std::atomic<unsigned> nlockstats;
+extern std::atomic<unsigned> nlockstats_dropped;
+
+
+// spinlock
+//    A test-and-set lock by default. A lock constructed as
+//    `spinlock(spinlock::ticket)` is a FIFO ticket lock instead: each
+//    waiter takes a ticket and spins reading `now_serving_` until its
+//    turn comes. Ticket locks are fair and waiters don't write the lock's
+//    cache line while spinning, so use them for heavily contended locks.
+//
+//    Long-lived locks should be given a `name`, which identifies them in
+//    lock contention statistics (see `lockstat`).
+
 struct spinlock {
-    spinlock() {
-        f_.f.clear();
+    enum kind_t { test_and_set, ticket };
+
+    explicit spinlock(kind_t kind = test_and_set, const char* name = nullptr)
+        : ticket_(kind == ticket) {
+        clear();
+#if HAVE_LOCKSTAT
+        stat_ = name ? lockstat::make(name) : nullptr;
+#else
+        (void) name;
+#endif
+    }
+    explicit spinlock(const char* name)
+        : spinlock(test_and_set, name) {
     }
 
     irqstate lock() {
@@ -62,7 +132,7 @@ struct spinlock {
         if (r) {
             adjust_this_cpu_spinlock_depth(1);
         } else {
-            irqs.clear();
+            irqs.restore();
         }
         return r;
     }
@@ -73,31 +143,90 @@ struct spinlock {
     }
 
     void lock_noirq() {
-        while (f_.f.test_and_set()) {
-            pause();
+#if HAVE_LOCKSTAT
+        if (stat_) {
+            uint64_t spin_start = 0;
+            if (!try_acquire()) {
+                spin_start = rdtsc();
+                acquire();
+            }
+            hold_start_ = stat_->acquired(spin_start);
+            return;
         }
+#endif
+        acquire();
     }
     bool trylock_noirq() {
-        return !f_.f.test_and_set();
+        bool r = try_acquire();
+#if HAVE_LOCKSTAT
+        if (r && stat_) {
+            hold_start_ = stat_->acquired(0);
+        }
+#endif
+        return r;
     }
     void unlock_noirq() {
+#if HAVE_LOCKSTAT
+        if (stat_) {
+            stat_->released(hold_start_);
+        }
+#endif
+        if (ticket_) {
+            uint16_t t = now_serving_.load(std::memory_order_relaxed);
+            now_serving_.store(t + 1, std::memory_order_release);
+            return;
+        }
         f_.f.clear();
     }
 
     void clear() {
         f_.f.clear();
+        now_serving_.store(0, std::memory_order_relaxed);
+        next_ticket_.store(0, std::memory_order_relaxed);
     }
 
     bool is_locked() const {
+        if (ticket_) {
+            return now_serving_.load(std::memory_order_relaxed)
+                != next_ticket_.load(std::memory_order_relaxed);
+        }
         static_assert(sizeof(f_) == 1, "expect atomic_flag to occupy 1 byte");
         return f_.alias.load(std::memory_order_relaxed) != 0;
     }
 
 private:
+    void acquire() {
+        if (ticket_) {
+            uint16_t t = next_ticket_.fetch_add(1, std::memory_order_relaxed);
+            while (now_serving_.load(std::memory_order_acquire) != t) {
+                pause();
+            }
+            return;
+        }
+        while (f_.f.test_and_set()) {
+            pause();
+        }
+    }
+    bool try_acquire() {
+        if (ticket_) {
+            // free iff no tickets are outstanding
+            uint16_t t = now_serving_.load(std::memory_order_relaxed);
+            return next_ticket_.compare_exchange_strong(t, t + 1);
+        }
+        return !f_.f.test_and_set();
+    }
+
     union {
         std::atomic_flag f;
         std::atomic<unsigned char> alias;
     } f_;
+    bool ticket_;
+    std::atomic<uint16_t> now_serving_;
+    std::atomic<uint16_t> next_ticket_;
+#if HAVE_LOCKSTAT
+    lockstat* stat_;
+    uint64_t hold_start_;
+#endif
 };
 
 
@@ -133,4 +262,134 @@ struct spinlock_guard {
     bool locked_;
 };
 
+// rwspinlock
+//    A reader-writer spinlock. Any number of readers can hold the lock
+//    at once (`read_lock`), or one writer can hold it exclusively
+//    (`lock`). Writers take turns through a ticket lock, then announce
+//    themselves in `state_` and wait for current readers to drain; new
+//    readers back off while a writer is waiting, so writers don't starve.
+
+struct rwspinlock {
+    explicit rwspinlock(const char* name = nullptr)
+        : wlock_(spinlock::ticket, name), state_(0) {
+#if HAVE_LOCKSTAT
+        // shares `wlock_`'s entry
+        stat_ = name ? lockstat::make(name) : nullptr;
+#endif
+    }
+
+    // exclusive (writer) locking
+    irqstate lock() {
+        irqstate irqs = irqstate::get();
+        cli();
+        lock_noirq();
+        adjust_this_cpu_spinlock_depth(1);
+        return irqs;
+    }
+    void unlock(irqstate& irqs) {
+        adjust_this_cpu_spinlock_depth(-1);
+        unlock_noirq();
+        irqs.restore();
+    }
+    void lock_noirq() {
+        wlock_.lock_noirq();
+        state_.fetch_or(writer, std::memory_order_relaxed);
+        while (state_.load(std::memory_order_acquire) != writer) {
+            pause();
+        }
+    }
+    void unlock_noirq() {
+        state_.store(0, std::memory_order_release);
+        wlock_.unlock_noirq();
+    }
+
+    // shared (reader) locking
+    irqstate read_lock() {
+        irqstate irqs = irqstate::get();
+        cli();
+        read_lock_noirq();
+        adjust_this_cpu_spinlock_depth(1);
+        return irqs;
+    }
+    void read_unlock(irqstate& irqs) {
+        adjust_this_cpu_spinlock_depth(-1);
+        read_unlock_noirq();
+        irqs.restore();
+    }
+    void read_lock_noirq() {
+#if HAVE_LOCKSTAT
+        uint64_t spin_start = 0;
+#endif
+        while (true) {
+            while (state_.load(std::memory_order_relaxed) & writer) {
+#if HAVE_LOCKSTAT
+                if (!spin_start) {
+                    spin_start = rdtsc();
+                }
+#endif
+                pause();
+            }
+            if (!(state_.fetch_add(1, std::memory_order_acquire) & writer)) {
+#if HAVE_LOCKSTAT
+                if (stat_) {
+                    stat_->acquired(spin_start);
+                }
+#endif
+                return;
+            }
+            // lost a race with a writer; let it go first
+            state_.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    void read_unlock_noirq() {
+        state_.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Return true iff some CPU holds the lock exclusively
+    bool is_locked() const {
+        return state_.load(std::memory_order_relaxed) == writer;
+    }
+    // Return true iff the lock is held in either mode, so reading the
+    // data it protects is safe
+    bool is_read_locked() const {
+        return state_.load(std::memory_order_relaxed) != 0;
+    }
+
+private:
+    static constexpr unsigned writer = 0x80000000U;
+
+    spinlock wlock_;                    // serializes writers
+    std::atomic<unsigned> state_;       // `writer` bit + # readers
+#if HAVE_LOCKSTAT
+    lockstat* stat_;                    // for readers
+#endif
+};
+
+
+struct rwspinlock_guard {
+    explicit rwspinlock_guard(rwspinlock& lock)
+        : lock_(lock), irqs_(lock_.lock()) {
+    }
+    ~rwspinlock_guard() {
+        lock_.unlock(irqs_);
+    }
+    NO_COPY_OR_ASSIGN(rwspinlock_guard);
+
+    rwspinlock& lock_;
+    irqstate irqs_;
+};
+
+struct rwspinlock_read_guard {
+    explicit rwspinlock_read_guard(rwspinlock& lock)
+        : lock_(lock), irqs_(lock_.read_lock()) {
+    }
+    ~rwspinlock_read_guard() {
+        lock_.read_unlock(irqs_);
+    }
+    NO_COPY_OR_ASSIGN(rwspinlock_read_guard);
+
+    rwspinlock& lock_;
+    irqstate irqs_;
+};
+
 #endif
@@ -67,7 +67,7 @@ class memusage {
 
 void memusage::refresh() {
     if (!v_) {
-        v_ = reinterpret_cast<unsigned*>(kalloc(PAGESIZE));
+        v_ = reinterpret_cast<unsigned*>(kalloc(PAGESIZE, KALLOC_NOFILL));
         assert(v_ != nullptr);
     }
 
@@ -88,7 +88,7 @@ void memusage::refresh() {
     }
 
     // mark pages accessible from process page tables
-    assert(ptable_lock.is_locked());
+    assert(ptable_lock.is_read_locked());
     for (int pid = 1; pid < NPROC; ++pid) {
         proc *p = ptable[pid];
         if (p) {
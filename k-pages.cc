@@ -1,103 +1,110 @@
 #include "kernel.hh"
 #include "k-pages.hh"
 
-uint32_t pageset::index(uintptr_t addr) {
-    assert(addr < physical_ranges.limit());
-    assert(addr % PAGESIZE == 0);
-    return addr / PAGESIZE;
-}
+spinlock page_lock(spinlock::ticket, "page_lock");
+pageset pages;
 
-bool pageset::is_free(page* p) {
-    for(uintptr_t addr = p->first(); addr < p->last(); addr += PAGESIZE) {
-        if(ps_[index(addr)].status != pg_free) {
-            return false;
-        }
-    }
-    return true;
-}
+// pageset::init()
+//    Size the page set to cover every available physical page, reserve
+//    memory for its page descriptors and free bitmaps, and mark available
+//    pages free. Called once at boot, before any allocation.
+void pageset::init() {
+    assert(!ps_);
 
-bool pageset::has_order(page* p, int order) {
-    for(uintptr_t addr = p->first(); addr < p->last(); addr += PAGESIZE) {
-        if(ps_[index(addr)].order != order) {
-            return false;
+    // cover memory up to the end of the last available range
+    uintptr_t top = 0;
+    for(auto& r : physical_ranges) {
+        if(r.type() == mem_available) {
+            top = r.last();
         }
     }
-    return true;
-}
-
-void pageset::set_status(page* p, pagestatus_t s) {
-    for(uintptr_t addr = p->first(); addr < p->last(); addr += PAGESIZE) {
-        ps_[index(addr)].status = s;
+    npages_ = round_down(top, PAGESIZE) / PAGESIZE;
+    assert(npages_ > 0);
+
+    // lay out page descriptors, then free bitmaps
+    size_t fbm_words = 0;
+    for(int o = MIN_ORDER; o <= MAX_ORDER; o++) {
+        fbm_offset_[o - MIN_ORDER] = fbm_words;
+        fbm_words += (freemap_bits(o) + 63) / 64;
     }
-}
-
-void pageset::increment_order_by(page* p, int v) {
-    uintptr_t first = p->first();
-    uintptr_t last = p->last();
-    for(uintptr_t addr = first; addr < last; addr += PAGESIZE) {
-        ps_[index(addr)].order += v;
+    size_t ps_sz = round_up(npages_ * sizeof(page), alignof(uint64_t));
+    size_t sz = round_up(ps_sz + fbm_words * sizeof(uint64_t), PAGESIZE);
+
+    // reserve the first available range above 1MiB that is large enough
+    uintptr_t pa = 0;
+    for(auto& r : physical_ranges) {
+        uintptr_t first = round_up(max(r.first(), uintptr_t(0x100000)), PAGESIZE);
+        if(r.type() == mem_available && first + sz <= r.last()) {
+            pa = first;
+            break;
+        }
     }
-}
+    assert(pa != 0);
+    physical_ranges.set(pa, pa + sz, mem_kernel);
 
-void pageset::increment_order(page* p) {
-    increment_order_by(p, 1);
-}
-
-void pageset::decrement_order(page* p) {
-    increment_order_by(p, -1);
-}
-
-void pageset::init() {
-    for(uintptr_t pa = 0; pa < physical_ranges.limit(); pa += PAGESIZE) {
-        if(physical_ranges.type(pa) == mem_available) {
-            ps_[index(pa)].status = pg_free;
-            ps_[index(pa)].addr = pa;
-            freeblocks_push(&ps_[index(pa)]);
+    ps_ = pa2kptr<page*>(pa);
+    for(size_t i = 0; i < npages_; i++) {
+        new (&ps_[i]) page;
+    }
+    fbm_ = pa2kptr<uint64_t*>(pa + ps_sz);
+    memset(fbm_, 0, fbm_words * sizeof(uint64_t));
+
+    for(uintptr_t a = 0; a < limit(); a += PAGESIZE) {
+        page* p = &ps_[index(a)];
+        p->addr = a;
+        if(physical_ranges.type(a) == mem_available) {
+            p->status = pg_free;
+            freeblocks_push(p);
         }
     }
 }
 
 void pageset::try_merge_all() {
-    for(int i = 0; i < PAGES_COUNT; i++) { 
+    for(size_t i = 0; i < npages_; i++) {
         try_merge(&ps_[i]);
     }
 }
 
+// pageset::try_merge(p)
+//    Merge the block headed by `p` with its buddy, as many times as
+//    possible. Each level costs O(1): the buddy is mergeable iff its bit
+//    is set in the free bitmap of `p`'s order.
 void pageset::try_merge(page* p) {
-    // block and buddy must be free
-    page* b = get_buddy(p);
-    if(!is_free(p) || !is_free(b)) {
+    // only free block heads can merge
+    if(!is_free(p) || !is_free_block(p, p->order)) {
         return;
     }
 
-    // block and buddy must have the same order
-    if(!has_order(p, p->order) || !has_order(b, p->order)) {
-        return;
+    while(p->order < MAX_ORDER) {
+        // buddy must be a free block with the same order
+        page* b = get_buddy(p);
+        if(!b || !is_free_block(b, p->order)) {
+            return;
+        }
+        assert(is_free(b) && has_order(b, p->order));
+
+        // the left block heads the merged block; the right one
+        // becomes a tail page
+        page* l = p->is_left() ? p : b;
+        page* r = l == p ? b : p;
+        freeblocks_erase(p, p->order);
+        freeblocks_erase(b, b->order);
+        set_status(r, pg_tail);
+        increment_order(l);
+        freeblocks_push(l);
+        p = l;
     }
-    
-    // get left block before altering their order
-    page* l = p->is_left() ? p : b;
-
-    // merge and recurse
-    increment_order(p);
-    increment_order(b);
-    freeblocks_erase(p, p->order - 1);
-    freeblocks_erase(b, b->order - 1);
-    freeblocks_push(l);
-    try_merge(l);
 }
 
 
 void pageset::print_block(page* p) {
-    // print pages
-    for(uintptr_t addr = p->first(); addr < p->last(); addr += PAGESIZE) {
-        ps_[index(addr)].print_page();
-    }
+    // print head page; the other pages of the block are tails
+    p->print_page();
 }
 
 void pageset::print_pageset() {
     // print pages
-    for(uintptr_t i = 0; i < PAGES_COUNT; i++) {
+    for(size_t i = 0; i < npages_; i++) {
         ps_[i].print_page();
     }
 }
@@ -1,32 +1,48 @@
 #ifndef CHICKADEE_PAGES_HH
 #define CHICKADEE_PAGES_HH
 
-static spinlock page_lock;  // protect pages object
+extern spinlock page_lock;  // protect pages object
 
 enum pagestatus_t {
     pg_unavailable = 0,   // the page cannot be allocated
     pg_free = 1,          // the page is free to be allocated
     pg_allocated = 2,     // the page is already allocated
+    pg_tail = 3,          // the page is inside a larger block (not its head)
+    pg_cached = 4,        // the page is held in a per-CPU page cache
+    pg_slab = 5,          // the page is a `kmalloc` slab
 };
 
+// Block state (status and order) is only meaningful in the first page
+// of a block (its *head*). The other pages of the block are `pg_tail`
+// and their `order` is stale, so splitting and merging a block only
+// touches the two heads involved.
 struct page {
-    pagestatus_t status = pg_unavailable; 
+    pagestatus_t status = pg_unavailable;
     int order = MIN_ORDER;
     uintptr_t addr = 0;
     list_links link_;
-    
+    std::atomic<unsigned> ref_ = 0;      // references to an allocated block
+
+    // slab state, valid while `status == pg_slab` (see `k-alloc.cc`)
+    void* slab_free_ = nullptr;          // free objects (owned by `slab_cpu_`)
+    void* slab_remote_ = nullptr;        // objects freed by other CPUs
+    unsigned slab_inuse_ = 0;            // allocated objects, if not active
+    std::atomic<int> slab_cpu_ = -1;     // CPU using this as active slab
+    int slab_class_ = 0;                 // size class index
+
     inline uintptr_t size();    // size of the block
     inline uintptr_t first();    // first address in block
     inline uintptr_t last();     // last address in block
     inline uintptr_t middle();  // middle address in the block
     inline bool is_left();
-    inline uintptr_t buddy();     // first address of buddy 
-    inline uintptr_t parent(); 
+    inline uintptr_t buddy();     // first address of buddy
+    inline uintptr_t parent();
+    inline bool is_head();      // true iff page holds its block's state
     inline void print_page();
 };
 
 inline uintptr_t page::size() {
-    return 1<<(order);
+    return uintptr_t(1) << order;
 }
 
 inline uintptr_t page::first() {
@@ -54,27 +70,38 @@ inline uintptr_t page::parent() {
     return (is_left() || (order == MAX_ORDER)) ? first() : first() - size();
 }
 
+inline bool page::is_head() {
+    return status == pg_free || status == pg_allocated || status == pg_cached
+        || status == pg_slab;
+}
+
 inline void page::print_page() {
-    log_printf("addr: %p | buddy: %p | block: %p - %p | parent: %p | %s | order: %d\n", addr, buddy(), first(), last(), parent(), status == pg_free ? "free" : (status == pg_unavailable ? "unavailable" : "allocated"), order);
+    log_printf("addr: %p | buddy: %p | block: %p - %p | parent: %p | %s | order: %d\n", addr, buddy(), first(), last(), parent(), status == pg_free ? "free" : (status == pg_unavailable ? "unavailable" : (status == pg_tail ? "tail" : (status == pg_cached ? "cached" : (status == pg_slab ? "slab" : "allocated")))), order);
 }
 
+// The page descriptors and free bitmaps are sized from `physical_ranges`
+// and stored in memory reserved at boot by `pageset::init`.
 struct pageset {
     void init();
     void try_merge_all();
     void try_merge(page* p);
     inline page* get_page(uintptr_t addr);     // returns page at addr
-    inline page* get_block(uintptr_t addr);    // gets first page of the block
+    inline page* get_block(uintptr_t addr);    // gets head page of the block
     inline page* get_buddy(page* p);   // get first page in buddy block
+                                       // (nullptr if past end of memory)
     inline page* get_parent(page* p);
-    void increment_order(page*p);
-    void increment_order_by(page*p, int v);
-    void decrement_order(page*p);
-    void set_status(page* p, pagestatus_t s);     // update block's status
+    inline void increment_order(page*p);
+    inline void increment_order_by(page*p, int v);
+    inline void decrement_order(page*p);
+    inline void set_status(page* p, pagestatus_t s);     // update block's status
     inline void free(page* p);     // free the block
     inline void allocate(page* p);     // allocate the block
-    bool is_free(page* b);  // returns true if all pages within block are free
-    bool has_order(page* b, int o);  // returns true if all pages within block have order o
-    uint32_t index(uintptr_t addr);  // get the index of page at address addr
+    inline bool is_free(page* b);  // returns true if block is free
+    inline bool has_order(page* b, int o);  // returns true if block has order o
+    inline bool is_free_block(page* b, int o);  // true iff b heads a free order-o block
+    inline size_t index(uintptr_t addr);  // get the index of page at address addr
+    inline uintptr_t limit() const;       // end of memory covered by pages
+    inline size_t nfree() const;          // number of pages in free blocks
 
     inline void freeblocks_push(page* p);
     inline page* freeblocks_pop(int o);
@@ -88,30 +115,103 @@ struct pageset {
 
 
     private:
-        page ps_[PAGES_COUNT];
+        page* ps_ = nullptr;          // one descriptor per physical page
+        size_t npages_ = 0;
         list<page, &page::link_> fbs_[ORDER_COUNT];
+        size_t nfree_ = 0;            // pages on `fbs_`
+
+        // free bitmaps: bit `pa >> o` of `freemap(o)` is set iff the
+        // order-`o` block starting at `pa` is on `fbs_[o - MIN_ORDER]`
+        uint64_t* fbm_ = nullptr;
+        size_t fbm_offset_[ORDER_COUNT];
+        inline size_t freemap_bits(int o) const;
+        inline bitset_view freemap(int o);
 };
 
-static pageset pages;
+extern pageset pages;
+
+inline size_t pageset::index(uintptr_t addr) {
+    assert(addr < limit());
+    assert(addr % PAGESIZE == 0);
+    return addr / PAGESIZE;
+}
+
+inline uintptr_t pageset::limit() const {
+    return npages_ * PAGESIZE;
+}
+
+// pageset::nfree()
+//    Pages in per-CPU page caches are not counted. May be called without
+//    `page_lock` for an approximate answer.
+inline size_t pageset::nfree() const {
+    return nfree_;
+}
+
+inline size_t pageset::freemap_bits(int o) const {
+    // one bit per order-`o` block that starts below `limit()`
+    return ((npages_ - 1) >> (o - MIN_ORDER)) + 1;
+}
+
+inline bitset_view pageset::freemap(int o) {
+    return bitset_view(&fbm_[fbm_offset_[o - MIN_ORDER]], freemap_bits(o));
+}
 
 inline void pageset::freeblocks_push(page* p) {
     fbs_[p->order - MIN_ORDER].push_back(p);
+    nfree_ += size_t(1) << (p->order - MIN_ORDER);
+    freemap(p->order)[p->addr >> p->order] = true;
 }
 
 inline page* pageset::freeblocks_pop(int o) {
-    return fbs_[o - MIN_ORDER].pop_front();
+    page* p = fbs_[o - MIN_ORDER].pop_front();
+    if (p) {
+        freemap(o)[p->addr >> o] = false;
+        nfree_ -= size_t(1) << (o - MIN_ORDER);
+    }
+    return p;
 }
 
 inline void pageset::freeblocks_erase(page* p, int o) {
     fbs_[o - MIN_ORDER].erase(p);
+    freemap(o)[p->addr >> o] = false;
+    nfree_ -= size_t(1) << (o - MIN_ORDER);
+}
+
+inline bool pageset::is_free_block(page* p, int o) {
+    assert(p->addr % (uintptr_t(1) << o) == 0);
+    return freemap(o)[p->addr >> o];
+}
+
+inline bool pageset::is_free(page* p) {
+    return p->status == pg_free;
+}
+
+inline bool pageset::has_order(page* p, int order) {
+    return p->order == order;
+}
+
+inline void pageset::set_status(page* p, pagestatus_t s) {
+    p->status = s;
+}
+
+inline void pageset::increment_order_by(page* p, int v) {
+    p->order += v;
+}
+
+inline void pageset::increment_order(page* p) {
+    increment_order_by(p, 1);
+}
+
+inline void pageset::decrement_order(page* p) {
+    increment_order_by(p, -1);
 }
 
 inline void pageset::free(page* p) {
      if(is_free(p)) {
         log_printf("p->first() %p p->last() %p already free\n", p->first(), p->last());
     }
-    // catch double free
-    assert_eq(is_free(p), false);
+    // catch double free (and frees of pages inside a block)
+    assert(p->status == pg_allocated);
     set_status(p, pg_free);
 }
 
@@ -120,7 +220,8 @@ inline void pageset::allocate(page* p) {
 }
 
 inline page* pageset::get_buddy(page* p) {
-    return &ps_[index(p->buddy())];
+    uintptr_t b = p->buddy();
+    return b < limit() ? &ps_[index(b)] : nullptr;
 }
 
 inline page* pageset::get_parent(page* p) {
@@ -132,7 +233,10 @@ inline page* pageset::get_page(uintptr_t addr) {
 }
 
 inline page* pageset::get_block(uintptr_t addr) {
-    return &ps_[index(get_page(addr)->first())];
+    // only block heads carry state, so `addr` must be a block's first page
+    page* p = get_page(addr);
+    assert(p->is_head());
+    return p;
 }
 
-#endif
\ No newline at end of file
+#endif
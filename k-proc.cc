@@ -4,9 +4,9 @@
 #include "k-devices.hh"
 
 proc* ptable[NPROC];                        // array of thread descriptor pointers
-spinlock ptable_lock;                       // protects `ptable`
+rwspinlock ptable_lock("ptable_lock");        // protects `ptable`
 proc_group* pgtable[NPROC];                   // array of process descriptor pointers
-spinlock pgtable_lock;                  // protects 'pidtable'
+rwspinlock pgtable_lock("pgtable_lock");    // protects 'pidtable'
 keyboard_console_vnode *kbd_cons_vnode;     // global keyboard/console vnode
 
 
@@ -65,7 +65,7 @@ int proc_group::alloc_shared_mem_seg(size_t sz) {
     sz = !sz ? PAGESIZE : round_up(sz, PAGESIZE);
 
     // allocate segment memory
-    void* pa = kalloc(sz);
+    void* pa = kalloc(sz, KALLOC_ZERO);
     if(!pa) return -1;
 
     // allocate segment
@@ -230,6 +230,394 @@ int proc_group::unmap_all_shared_mem() {
 }
 
 
+// Demand paging
+//    Program segments recorded by `proc::load_segment` are loaded a page
+//    at a time by `vm_fault`, called on a fault on a missing user page.
+//    The page's contents are read through a fresh `proc_loader` for the
+//    segment's source, so no loader state outlives `proc::load`.
+
+// Text sources
+//    Pages are read from a segment's source file until the process exits,
+//    so each `vm_area` holds a reference on its source here. While a file
+//    has references, writing or truncating it fails with `E_TXTBSY`, and
+//    late-loaded pages match the ones loaded first. (Files are never
+//    deleted, so the reference need not keep the file itself alive.)
+//
+//    Writers check `text_source_busy` while holding the file's lock
+//    (`memfile::lock_` or the inode write lock). `exec` takes its first
+//    reference while holding the inode's read lock, before reading the
+//    program, so a write either completes before the program is loaded
+//    or fails. Boot-time processes load from initfs before any writer
+//    can run.
+
+struct text_source {
+    int mf_index = -1;              // source `memfile::initfs` index, or
+    uint32_t inum = 0;              // source disk file inode number
+    unsigned ref = 0;               // number of references (0 if unused)
+};
+
+// every `vm_area` of every process, plus one `exec` pin per process
+static text_source text_sources[NPROC * (NVMAS + 1)];
+static spinlock text_source_lock("text_source");  // protects text_sources
+
+void text_source_hold(int mf_index, uint32_t inum) {
+    spinlock_guard guard(text_source_lock);
+    text_source* free_ts = nullptr;
+    for(auto& ts : text_sources) {
+        if(ts.ref && ts.mf_index == mf_index && ts.inum == inum) {
+            ++ts.ref;
+            return;
+        } else if(!ts.ref && !free_ts) {
+            free_ts = &ts;
+        }
+    }
+    assert(free_ts);
+    free_ts->mf_index = mf_index;
+    free_ts->inum = inum;
+    free_ts->ref = 1;
+}
+
+void text_source_release(int mf_index, uint32_t inum) {
+    spinlock_guard guard(text_source_lock);
+    for(auto& ts : text_sources) {
+        if(ts.ref && ts.mf_index == mf_index && ts.inum == inum) {
+            --ts.ref;
+            return;
+        }
+    }
+    assert(false);
+}
+
+bool text_source_busy(int mf_index, uint32_t inum) {
+    spinlock_guard guard(text_source_lock);
+    for(auto& ts : text_sources) {
+        if(ts.ref && ts.mf_index == mf_index && ts.inum == inum) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// proc_group::set_vmas(vmas, n)
+//    Replace this process group's demand-paged segments, moving source
+//    references from the old segments to the new ones. `set_vmas(nullptr,
+//    0)` drops them all.
+void proc_group::set_vmas(const vm_area* vmas, unsigned n) {
+    assert(n <= NVMAS);
+    spinlock_guard guard(lock_);
+    for(unsigned i = 0; i != n; ++i) {
+        text_source_hold(vmas[i].mf_index, vmas[i].inum);
+    }
+    for(unsigned i = 0; i != nvmas_; ++i) {
+        text_source_release(vmas_[i].mf_index, vmas_[i].inum);
+    }
+    for(unsigned i = 0; i != n; ++i) {
+        vmas_[i] = vmas[i];
+    }
+    nvmas_ = n;
+}
+
+// loader_read(ld, dst, off, n)
+//    Read `n` bytes at offset `off` of `ld`'s program into `dst`.
+//    Returns 0 or an error code.
+static int loader_read(proc_loader& ld, uint8_t* dst, size_t off, size_t n) {
+    while(n > 0) {
+        uint8_t* datapg = nullptr;
+        size_t req_off = round_down(off, PAGESIZE);
+        ssize_t r = ld.get_page(&datapg, req_off);
+        if(r < 0) {
+            return r;
+        }
+        if(req_off + r <= off) {
+            // error: not enough data in page!
+            ld.put_page();
+            return E_NOEXEC;
+        }
+        size_t copy_sz = min(size_t(req_off + r - off), n);
+        memcpy(dst, datapg + (off - req_off), copy_sz);
+        ld.put_page();
+        dst += copy_sz;
+        off += copy_sz;
+        n -= copy_sz;
+    }
+    return 0;
+}
+
+// vm_area_read(vma, dst, va, end)
+//    Read segment bytes `[va, end)` of `vma` into `dst`. Returns 0 or an
+//    error code.
+static int vm_area_read(const vm_area& vma, uint8_t* dst,
+                        uintptr_t va, uintptr_t end) {
+    size_t off = vma.off + (va - vma.va);
+    if(vma.mf_index >= 0) {
+        memfile_loader ld(vma.mf_index, nullptr);
+        return loader_read(ld, dst, off, end - va);
+    }
+    auto ino = chkfsstate::get().get_inode(vma.inum);
+    if(!ino) {
+        return E_NOENT;
+    }
+    diskfile_loader ld(ino, nullptr);
+    return loader_read(ld, dst, off, end - va);
+}
+
+// Shared text pages
+//    A page covered by a single read-only segment depends only on the
+//    file bytes it holds, so `vm_fault` maps the same physical page into
+//    every process running that program. `text_cache` remembers these
+//    pages, keyed by source and file range. The cache holds one `kref` on
+//    each page and every mapping holds another, so `kfree_mem` frees a
+//    page only once no process maps it and its entry has been replaced or
+//    invalidated. Writing to a file invalidates its entries; per-source
+//    page counts let writes to files with no cached pages skip the scan.
+
+struct text_page {
+    int mf_index = -1;              // source `memfile::initfs` index, or
+    uint32_t inum = 0;              // source disk file inode number
+    size_t off = 0;                 // file offset of first loaded byte
+    unsigned pgoff = 0;             // page offset of first loaded byte
+    unsigned len = 0;               // number of loaded bytes
+    void* pg = nullptr;             // page (nullptr if entry unused)
+
+    bool same_range(const text_page& x) const {
+        return mf_index == x.mf_index && inum == x.inum
+            && off == x.off && pgoff == x.pgoff && len == x.len;
+    }
+};
+
+#define NTEXTPAGES 256
+#define NTEXTSOURCES 64
+static text_page text_cache[NTEXTPAGES];
+static unsigned text_cache_gen;     // incremented on every invalidation
+static unsigned text_cache_npages[NTEXTSOURCES];  // # entries per
+                                                  // `text_source_slot`
+static spinlock text_cache_lock("text_cache");  // protects text_cache,
+                                                // text_cache_gen,
+                                                // text_cache_npages
+
+// text_page_key(vma, pva)
+//    Return the `text_cache` key for page `pva`, which `vma` alone covers.
+static text_page text_page_key(const vm_area& vma, uintptr_t pva) {
+    text_page key;
+    key.mf_index = vma.mf_index;
+    key.inum = vma.inum;
+    uintptr_t first = max(pva, vma.va);
+    uintptr_t last = min(pva + PAGESIZE, vma.end_file);
+    if(first < last) {
+        key.off = vma.off + (first - vma.va);
+        key.pgoff = first - pva;
+        key.len = last - first;
+    }
+    return key;
+}
+
+static uint32_t text_source_hash(int mf_index, uint32_t inum) {
+    return mf_index >= 0 ? mf_index : inum + 1000;
+}
+
+static unsigned text_source_slot(int mf_index, uint32_t inum) {
+    return text_source_hash(mf_index, inum) % NTEXTSOURCES;
+}
+
+static unsigned text_page_slot(const text_page& key) {
+    uint32_t h = text_source_hash(key.mf_index, key.inum);
+    h = h * 2654435761U + (key.off + key.pgoff) / PAGESIZE;
+    return (h ^ (h >> 16)) % NTEXTPAGES;
+}
+
+// text_cache_find(key, gen)
+//    Return the cached page for `key` with a new reference, or nullptr.
+//    On a miss, sets `gen` for a later `text_cache_insert`.
+static void* text_cache_find(const text_page& key, unsigned& gen) {
+    spinlock_guard guard(text_cache_lock);
+    text_page& tp = text_cache[text_page_slot(key)];
+    if(tp.pg && tp.same_range(key)) {
+        kref(tp.pg);
+        return tp.pg;
+    }
+    gen = text_cache_gen;
+    return nullptr;
+}
+
+// text_cache_insert(key, pg, gen)
+//    Remember `pg` as the page for `key`, replacing any entry in its slot.
+//    Does nothing if a file was changed since `text_cache_find` returned
+//    `gen`, since `pg` may hold stale data.
+static void text_cache_insert(const text_page& key, void* pg, unsigned gen) {
+    spinlock_guard guard(text_cache_lock);
+    if(gen != text_cache_gen) {
+        return;
+    }
+    text_page& tp = text_cache[text_page_slot(key)];
+    if(tp.pg) {
+        --text_cache_npages[text_source_slot(tp.mf_index, tp.inum)];
+        kfree(tp.pg);
+    }
+    tp = key;
+    tp.pg = pg;
+    kref(pg);
+    ++text_cache_npages[text_source_slot(key.mf_index, key.inum)];
+}
+
+void text_cache_invalidate(int mf_index, uint32_t inum) {
+    spinlock_guard guard(text_cache_lock);
+    // stop in-progress loads from caching data read before the change
+    ++text_cache_gen;
+    unsigned& npages = text_cache_npages[text_source_slot(mf_index, inum)];
+    for(auto it = text_cache; npages && it != text_cache + NTEXTPAGES; ++it) {
+        if(it->pg && it->mf_index == mf_index && it->inum == inum) {
+            --npages;
+            kfree(it->pg);
+            it->pg = nullptr;
+        }
+    }
+}
+
+// proc_group::vm_fault(va)
+//    Load and map the page containing user address `va` from this process
+//    group's program segments. Returns false if no segment covers `va` or
+//    on error. May block reading the disk.
+bool proc_group::vm_fault(uintptr_t va) {
+    uintptr_t pva = round_down(va, PAGESIZE);
+    vm_area vmas[NVMAS];
+    unsigned n = 0;
+    {
+        spinlock_guard guard(lock_);
+        for(unsigned i = 0; i != nvmas_; ++i) {
+            if(pva < vmas_[i].end_mem && vmas_[i].va < pva + PAGESIZE) {
+                vmas[n++] = vmas_[i];
+            }
+        }
+    }
+    if(n == 0) {
+        return false;
+    }
+
+    // pages of a single read-only segment come from `text_cache`
+    bool shared = n == 1 && !vmas[0].writable;
+    text_page key;
+    unsigned gen = 0;
+    uint8_t* pg = nullptr;
+    if(shared) {
+        key = text_page_key(vmas[0], pva);
+        pg = reinterpret_cast<uint8_t*>(text_cache_find(key, gen));
+    }
+
+    if(!pg) {
+        // fill a zeroed page with the file data of every segment on it
+        pg = reinterpret_cast<uint8_t*>(kalloc(PAGESIZE, KALLOC_ZERO));
+        if(!pg) {
+            return false;
+        }
+        for(unsigned i = 0; i != n; ++i) {
+            uintptr_t first = max(pva, vmas[i].va);
+            uintptr_t last = min(pva + PAGESIZE, vmas[i].end_file);
+            if(first < last
+               && vm_area_read(vmas[i], pg + (first - pva), first, last) < 0) {
+                kfree(pg);
+                return false;
+            }
+        }
+        if(shared) {
+            text_cache_insert(key, pg, gen);
+        }
+    }
+
+    spinlock_guard guard(lock_);
+    vmiter it(pagetable_, pva);
+    if(it.present()) {
+        // another thread loaded the page first
+        guard.unlock();
+        kfree(pg);
+        return true;
+    }
+    if(it.try_map(ka2pa(pg), shared ? PTE_P | PTE_U : PTE_PWU) < 0) {
+        guard.unlock();
+        kfree(pg);
+        return false;
+    }
+    return true;
+}
+
+
+// Copy-on-write
+//    `fork` shares a single-threaded parent's user pages with the child
+//    instead of copying them. Shared pages hold one `kref` per mapping,
+//    and writable ones are mapped read-only with `PTE_COW` in both
+//    processes; the first write faults into `cow_fault`, which copies the
+//    page (or, if no one else references it, just makes it writable).
+//
+//    There is no TLB shootdown, so a process group with several threads
+//    must never have `PTE_COW` pages: `fork` copies eagerly from such a
+//    group, and `clone` calls `unshare_cow` before adding a thread.
+
+// proc_group::cow_copy(it)
+//    Give this process group a private, writable copy of the
+//    copy-on-write page at `it`. Returns 0 or `E_NOMEM`. Requires `lock_`.
+int proc_group::cow_copy(vmiter& it) {
+    assert(lock_.is_locked());
+    assert(it.perm(PTE_P | PTE_U | PTE_COW));
+    int perm = (it.perm() & ~PTE_COW) | PTE_W;
+    void* pg = it.kptr();
+
+    if(krefcount(pg) == 1) {
+        // no one else maps the page
+        int r = it.try_map(it.pa(), perm);
+        assert(r == 0);
+        return 0;
+    }
+
+    void* copy = kalloc(PAGESIZE, KALLOC_NOFILL);
+    if(!copy) {
+        return E_NOMEM;
+    }
+    memcpy(copy, pg, PAGESIZE);
+    int r = it.try_map(ka2pa(copy), perm);
+    assert(r == 0);
+    kfree(pg);
+    return 0;
+}
+
+// proc_group::cow_fault(va)
+//    Handle a write fault at user address `va`. Returns true if `va` is
+//    now writable, false if the fault was not on a copy-on-write page or
+//    memory is exhausted.
+bool proc_group::cow_fault(uintptr_t va) {
+    spinlock_guard guard(lock_);
+    vmiter it(pagetable_, round_down(va, PAGESIZE));
+    if(it.perm(PTE_P | PTE_U | PTE_W)) {
+        // resolved already; the faulting CPU had a stale TLB entry
+        invlpg(reinterpret_cast<void*>(it.va()));
+        return true;
+    }
+    if(!it.perm(PTE_P | PTE_U | PTE_COW) || cow_copy(it) < 0) {
+        return false;
+    }
+    invlpg(reinterpret_cast<void*>(it.va()));
+    return true;
+}
+
+// proc_group::unshare_cow()
+//    Copy every copy-on-write page in this process group. Called before
+//    the group gains a thread. Returns 0 or `E_NOMEM`.
+int proc_group::unshare_cow() {
+    spinlock_guard guard(lock_);
+    bool changed = false;
+    for(vmiter it(pagetable_, 0); it.low(); it.next()) {
+        if(it.perm(PTE_P | PTE_U | PTE_COW)) {
+            if(cow_copy(it) < 0) {
+                return E_NOMEM;
+            }
+            changed = true;
+        }
+    }
+    if(changed && rdcr3() == ka2pa(pagetable_)) {
+        wrcr3(rdcr3());
+    }
+    return 0;
+}
+
+
 // proc::proc()
 //    The constructor initializes the `proc` to empty.
 
@@ -384,6 +772,9 @@ int proc::load(proc_loader& ld) {
 //    Calls `kalloc` to allocate pages and uses `vmiter::map`
 //    to map them in `pagetable_`. Returns 0 on success and an error
 //    code on failure.
+//
+//    If the loader supports it, the segment is instead recorded in
+//    `ld.vmas_` and its pages are loaded on demand.
 
 int proc::load_segment(const elf_program& ph, proc_loader& ld) {
     uintptr_t va = (uintptr_t) ph.p_va;
@@ -398,11 +789,27 @@ int proc::load_segment(const elf_program& ph, proc_loader& ld) {
         return E_NOMEM;
     }
 
+    // if the loader can find the program again later, record the
+    // segment and load its pages on first access (see `vm_fault`)
+    if (ld.nvmas_ < NVMAS) {
+        vm_area& vma = ld.vmas_[ld.nvmas_];
+        vma = vm_area();
+        if (ld.set_source(vma)) {
+            vma.va = va;
+            vma.end_file = end_file;
+            vma.end_mem = end_mem;
+            vma.off = ph.p_offset;
+            vma.writable = ph.p_flags & ELF_PFLAG_WRITE;
+            ++ld.nvmas_;
+            return 0;
+        }
+    }
+
     // allocate memory
     for (vmiter it(ld.pagetable_, round_down(va, PAGESIZE));
          it.va() < end_mem;
          it += PAGESIZE) {
-        void* pg = kalloc(PAGESIZE);
+        void* pg = kalloc(PAGESIZE, KALLOC_ZERO);
         if (!pg || it.try_map(ka2pa(pg), PTE_PWU) < 0) {
             kfree(pg);
             return E_NOMEM;
@@ -440,12 +847,8 @@ int proc::load_segment(const elf_program& ph, proc_loader& ld) {
         ld.put_page();
     }
 
-    // set initialized, but not copied, memory to zero
-    for (vmiter it(ld.pagetable_, end_file); it.va() < end_mem; ) {
-        size_t sz = min(it.last_va(), end_mem) - it.va();
-        memset(it.kptr<uint8_t*>(), 0, sz);
-        it += sz;
-    }
+    // memory past `end_file` is already zero: the pages were allocated
+    // with `KALLOC_ZERO`
 
     return 0;
 }
@@ -453,10 +856,9 @@ int proc::load_segment(const elf_program& ph, proc_loader& ld) {
 // proc::wake()
 //      unblock this process and schedule it on its home CPU
 void proc::wake() {
-    // TODO: proceses should remember their home cpu. Is id_ % ncpu enough?
     int s = proc::ps_blocked;
     if(pstate_.compare_exchange_strong(s, proc::ps_runnable)) {
-        cpus[id_ % ncpu].enqueue(this);
+        cpus[cpu_index_].enqueue(this);
     }
 }
 
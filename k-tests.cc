@@ -1,4 +1,5 @@
 #include "kernel.hh"
+#include "k-pages.hh"
 
 /**********************************************************
  BUDDY ALLOCATOR TESTS
@@ -179,6 +180,212 @@ int proc::syscall_testkalloc(regstate* regs) {
             break;
         }
 
+        case 8: {
+
+            // buddy merge test
+            // find the largest block that can be allocated, then split
+            // memory into blocks of random multi-page orders and free
+            // them in random order; the pieces must merge back, so the
+            // largest block is available again
+
+            int largest = MIN_ORDER;
+            for (int o = MAX_ORDER; o > MIN_ORDER; --o) {
+                if (void* p = kalloc(uintptr_t(1) << o)) {
+                    kfree(p);
+                    largest = o;
+                    break;
+                }
+            }
+            int max_piece = max(MIN_ORDER + 1, min(largest - 6, MIN_ORDER + 8));
+
+            for (int j = 0; j < 10; ++j) {
+                for (int i = 0; i < num_allocs; ++i) {
+                    int o = rand(MIN_ORDER + 1, max_piece);
+                    ptr_arr[i] = kalloc(uintptr_t(1) << o);
+                }
+                for (int i = num_allocs - 1; i > 0; --i) {
+                    int k = rand(0, i);
+                    void* t = ptr_arr[i];
+                    ptr_arr[i] = ptr_arr[k];
+                    ptr_arr[k] = t;
+                }
+                for (int i = 0; i < num_allocs; ++i) {
+                    kfree(ptr_arr[i]);
+                }
+
+                // other CPUs may hold a page of the largest block meanwhile
+                void* p = kalloc(uintptr_t(1) << largest);
+                if (!p) {
+                    p = kalloc(uintptr_t(1) << (largest - 1));
+                }
+                assert(p);
+                kfree(p);
+            }
+            console_printf("======= {BUDDY} TEST CASE [8] for PROCESS [%d] COMPLETED =======\n", this->id_);
+            break;
+        }
+
+        case 9: {
+
+            // per-CPU page cache test
+            // with interrupts disabled, so the test stays on one CPU,
+            // allocate and then free three times as many single pages as
+            // the cache holds; the cache must refill and drain in
+            // batches, never overflow, and never hand out a page twice
+
+            const int n = 3 * cpustate::pagecache_capacity;
+            void** pgs = reinterpret_cast<void**>(kalloc(n * sizeof(void*)));
+            assert(pgs);
+            irqstate irqs = irqstate::get();
+            cli();
+            cpustate* c = this_cpu();
+            unsigned long hits = c->pagecache_hits_;
+            unsigned long misses = c->pagecache_misses_;
+
+            for (int i = 0; i < n; ++i) {
+                pgs[i] = kalloc(PAGESIZE);
+                assert(pgs[i]);
+                assert(c->pagecache_count_ <= cpustate::pagecache_capacity);
+                memset(pgs[i], i, PAGESIZE);
+            }
+            assert(c->pagecache_hits_ + c->pagecache_misses_
+                   == hits + misses + n);
+            // each refill serves at most a batch of allocations
+            assert(c->pagecache_misses_ - misses
+                   >= (n - cpustate::pagecache_capacity) / cpustate::pagecache_batch);
+
+            for (int i = 0; i < n; ++i) {
+                unsigned char* p = reinterpret_cast<unsigned char*>(pgs[i]);
+                for (size_t k = 0; k < PAGESIZE; ++k) {
+                    assert(p[k] == (unsigned char) i);
+                }
+                kfree(pgs[i]);
+                assert(c->pagecache_count_ > 0
+                       && c->pagecache_count_ <= cpustate::pagecache_capacity);
+            }
+            // the cache drained the rest to the buddy allocator
+            assert(c->pagecache_count_ > cpustate::pagecache_capacity
+                                         - cpustate::pagecache_batch);
+
+            irqs.restore();
+            kfree(pgs);
+            console_printf("======= {PAGECACHE} TEST CASE [9] for PROCESS [%d] COMPLETED =======\n", this->id_);
+            break;
+        }
+
+        case 10: {
+
+            // kmalloc test
+            // small objects of every size class, mixed with page-sized
+            // requests; each object is filled with its index and checked
+            // before it is freed, to catch overlapping objects
+
+            for (int j = 0; j < 10; ++j) {
+                size_t szs[num_allocs];
+                for (int i = 0; i < num_allocs; ++i) {
+                    szs[i] = rand(1, KMALLOC_MAX + PAGESIZE);
+                    ptr_arr[i] = kmalloc(szs[i]);
+                    assert(ptr_arr[i]);
+                    assert(reinterpret_cast<uintptr_t>(ptr_arr[i]) % 16 == 0);
+                    memset(ptr_arr[i], i, szs[i]);
+                }
+                for (int i = 0; i < num_allocs; ++i) {
+                    unsigned char* p = reinterpret_cast<unsigned char*>(ptr_arr[i]);
+                    for (size_t k = 0; k < szs[i]; ++k) {
+                        assert(p[k] == (unsigned char) i);
+                    }
+                    kfree(ptr_arr[i]);
+                }
+            }
+            console_printf("======= {KMALLOC} TEST CASE [10] for PROCESS [%d] COMPLETED =======\n", this->id_);
+            break;
+        }
+
+        case 11: {
+
+            // zeroed page pool test
+            // fill the pool, then take more zeroed pages than it holds,
+            // so some come from the pool and some are zeroed on demand;
+            // every page must read as zero. Dirty the pages before
+            // freeing them, so a page that skipped zeroing would show.
+            // Default allocations are poisoned with 0xCC
+
+            for (int j = 0; j < 10; ++j) {
+                while (refill_zero_pages()) {
+                }
+                for (int i = 0; i < num_allocs; ++i) {
+                    ptr_arr[i] = kalloc(PAGESIZE, KALLOC_ZERO);
+                    assert(ptr_arr[i]);
+                    unsigned char* p = reinterpret_cast<unsigned char*>(ptr_arr[i]);
+                    for (size_t k = 0; k < PAGESIZE; ++k) {
+                        assert(p[k] == 0);
+                    }
+                    memset(p, 0xAB, PAGESIZE);
+                }
+                for (int i = 0; i < num_allocs; ++i) {
+                    kfree(ptr_arr[i]);
+                }
+            }
+
+            for (int i = 0; i < num_allocs; ++i) {
+                size_t sz = rand(1, 4 * PAGESIZE);
+                unsigned char* p = reinterpret_cast<unsigned char*>(kalloc(sz));
+                assert(p);
+                for (size_t k = 0; k < sz; ++k) {
+                    assert(p[k] == 0xCC);
+                }
+                kfree(p);
+            }
+            console_printf("======= {ZEROPOOL} TEST CASE [11] for PROCESS [%d] COMPLETED =======\n", this->id_);
+            break;
+        }
+
+        case 12: {
+
+            // boot sizing test
+            // the page set covers every available page of physical
+            // memory, not just the first MEMSIZE_PHYSICAL bytes; pages
+            // reserved for the page set itself are never allocatable;
+            // and blocks above the old 2 MiB limit can be allocated
+
+            uintptr_t top = 0;
+            for (auto& r : physical_ranges) {
+                if (r.type() == mem_available) {
+                    top = r.last();
+                }
+            }
+            assert(pages.limit() == round_down(top, PAGESIZE));
+            assert(pages.limit() >= MEMSIZE_PHYSICAL);
+
+            {
+                spinlock_guard guard(page_lock);
+                for (auto& r : physical_ranges) {
+                    for (uintptr_t pa = round_up(r.first(), PAGESIZE);
+                         pa < r.last() && pa < pages.limit();
+                         pa += PAGESIZE) {
+                        pagestatus_t s = pages.get_page(pa)->status;
+                        if (r.type() == mem_available) {
+                            assert(s != pg_unavailable);
+                        } else {
+                            assert(s == pg_unavailable);
+                        }
+                    }
+                }
+            }
+
+            int o = MIN_ORDER + 9;  // 2 MiB
+            if (pages.limit() >= (uintptr_t(8) << o)) {
+                void* p = kalloc(uintptr_t(1) << o);
+                assert(p);
+                uintptr_t pa = ka2pa(p);
+                assert(pa % (uintptr_t(1) << o) == 0);
+                assert(pa + (uintptr_t(1) << o) <= pages.limit());
+                kfree(p);
+            }
+            console_printf("======= {PAGESET} TEST CASE [12] for PROCESS [%d] COMPLETED =======\n", this->id_);
+            break;
+        }
+
         default: {
             // if an incorrect test case number is called
             console_printf("======= ERROR: Test case number %d not implemented  =======\n", tcase);
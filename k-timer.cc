@@ -0,0 +1,317 @@
+#include "kernel.hh"
+#include "k-apic.hh"
+#include "k-wait.hh"
+
+// k-timer.cc
+//
+//    The local APIC timer runs in one-shot mode. Whenever a CPU's timer
+//    interrupt fires, `run_timers` calls the expired `ktimer`s in that
+//    CPU's heap and rearms the APIC for the next event. While the CPU
+//    has processes to run, the next event is at most one scheduler
+//    tick (1/HZ sec) away; an idle CPU sleeps until its next `ktimer`,
+//    or until another CPU sends it work with `kick`.
+//
+//    Timers due in a later tick wait in the CPU's timer wheel, where
+//    starting and cancelling take constant time, and enter the heap
+//    only once due within the current tick. Most timeouts are
+//    cancelled long before that, so the heap stays small.
+//
+//    Like the rest of the kernel, this assumes the APIC timer counts at
+//    1 GHz with divider 1 (true for QEMU). `ktime_init` uses it to
+//    measure the TSC, which then serves as the global clock.
+
+static uint64_t ktime_base;         // TSC at `ktime_init`
+static uint64_t ktime_mult;         // ns per TSC cycle, 32.32 fixed point
+
+static constexpr uint64_t tick_ns = 1000000000 / HZ;
+
+
+// Timer wheel
+//    `wheel_levels` levels of `wheel_size` slots. A slot at level L
+//    covers `wheel_size`^L ticks; a timer goes in the lowest level whose
+//    span reaches its deadline. When the wheel's time passes a slot's
+//    start, its timers are reinserted, falling to a lower level or into
+//    the heap. `nonempty_` bitmaps let `wheel_next` find the next slot
+//    to process without scanning, so idle CPUs can sleep until then.
+//    Protected by the owning CPU's `timer_lock_`.
+
+static constexpr int wheel_bits = 6;
+static constexpr unsigned wheel_size = 1U << wheel_bits;
+static constexpr int wheel_levels = 4;
+
+struct timer_wheel {
+    list<ktimer, &ktimer::wheel_link_> slots_[wheel_levels][wheel_size];
+    uint64_t nonempty_[wheel_levels];      // bit i set iff slot i nonempty
+    uint64_t now_;                         // last tick processed
+};
+static_assert(wheel_size == 64, "`nonempty_` bitmaps are 64 bits");
+
+static timer_wheel wheels[MAXCPU];
+
+// wheel_insert(c, t)
+//    Add `t` to CPU `c`'s wheel, or to its heap if due this tick.
+static void wheel_insert(cpustate* c, ktimer* t) {
+    timer_wheel& w = wheels[c->cpuindex_];
+    uint64_t due = t->expires_ / tick_ns;
+    if (due <= w.now_) {
+        c->timers_.push(t);
+        return;
+    }
+    int level = 0;
+    while (level < wheel_levels - 1
+           && due - w.now_ >= uint64_t(1) << (wheel_bits * (level + 1))) {
+        ++level;
+    }
+    // deadlines past the wheel's span wait in its farthest slot
+    uint64_t span = uint64_t(1) << (wheel_bits * wheel_levels);
+    due = min(due, w.now_ + span - 1);
+    unsigned slot = (due >> (wheel_bits * level)) % wheel_size;
+    w.slots_[level][slot].push_back(t);
+    w.nonempty_[level] |= uint64_t(1) << slot;
+    t->wheel_slot_ = level * wheel_size + slot;
+}
+
+// wheel_erase(c, t)
+//    Remove `t` from CPU `c`'s wheel.
+static void wheel_erase(cpustate* c, ktimer* t) {
+    timer_wheel& w = wheels[c->cpuindex_];
+    int level = t->wheel_slot_ / wheel_size;
+    unsigned slot = t->wheel_slot_ % wheel_size;
+    w.slots_[level][slot].erase(t);
+    if (w.slots_[level][slot].empty()) {
+        w.nonempty_[level] &= ~(uint64_t(1) << slot);
+    }
+    t->wheel_slot_ = -1;
+}
+
+// wheel_advance(c, now_tick)
+//    Process every slot of CPU `c`'s wheel whose start has passed by
+//    tick `now_tick`, moving due timers into the heap.
+static void wheel_advance(cpustate* c, uint64_t now_tick) {
+    timer_wheel& w = wheels[c->cpuindex_];
+    if (now_tick <= w.now_) {
+        return;
+    }
+    list<ktimer, &ktimer::wheel_link_> moving;
+    for (int level = 0; level != wheel_levels; ++level) {
+        int shift = wheel_bits * level;
+        uint64_t first = (w.now_ >> shift) + 1;
+        uint64_t n = min((now_tick >> shift) - (w.now_ >> shift),
+                         uint64_t(wheel_size));
+        for (uint64_t i = first; i != first + n; ++i) {
+            unsigned slot = i % wheel_size;
+            while (ktimer* t = w.slots_[level][slot].pop_front()) {
+                moving.push_back(t);
+            }
+            w.nonempty_[level] &= ~(uint64_t(1) << slot);
+        }
+    }
+    w.now_ = now_tick;
+    while (ktimer* t = moving.pop_front()) {
+        t->wheel_slot_ = -1;
+        wheel_insert(c, t);
+    }
+}
+
+// wheel_next(c)
+//    Return the tick at which CPU `c`'s wheel next needs processing, or
+//    `~0` if it is empty.
+static uint64_t wheel_next(cpustate* c) {
+    timer_wheel& w = wheels[c->cpuindex_];
+    uint64_t next = ~uint64_t(0);
+    for (int level = 0; level != wheel_levels; ++level) {
+        if (!w.nonempty_[level]) {
+            continue;
+        }
+        int shift = wheel_bits * level;
+        uint64_t first = (w.now_ >> shift) + 1;
+        // rotate so bit 0 is the slot for index `first`
+        unsigned r = first % wheel_size;
+        uint64_t bits = w.nonempty_[level];
+        bits = r ? (bits >> r) | (bits << (wheel_size - r)) : bits;
+        uint64_t index = first + lsb(bits) - 1;
+        next = min(next, index << shift);
+    }
+    return next;
+}
+
+
+void ktime_init() {
+    auto& lapic = lapicstate::get();
+    // time 10ms of APIC timer counts, with the timer's interrupt masked
+    lapic.write(lapic.reg_timer_divide, lapic.timer_divide_1);
+    lapic.write(lapic.reg_lvt_timer, lapic.lvt_masked | (INT_IRQ + IRQ_TIMER));
+    uint64_t start = rdtsc();
+    lapic.write(lapic.reg_timer_initial_count, 10000000);
+    while (lapic.read(lapic.reg_timer_current_count) != 0) {
+        pause();
+    }
+    uint64_t cycles = rdtsc() - start;
+    ktime_mult = (uint64_t(10000000) << 32) / cycles;
+    ktime_base = rdtsc();
+}
+
+uint64_t ktime() {
+    uint64_t cycles = rdtsc() - ktime_base;
+    return (static_cast<unsigned __int128>(cycles) * ktime_mult) >> 32;
+}
+
+
+// ktimer::start(expires, fn, arg)
+//    Add this timer to the current CPU's timers, reprogramming the APIC
+//    if it is now the earliest deadline.
+
+void ktimer::start(uint64_t expires, void (*fn)(ktimer*), void* arg) {
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+    {
+        spinlock_guard guard(c->timer_lock_);
+        assert(!link_.is_linked());
+        expires_ = expires;
+        fn_ = fn;
+        arg_ = arg;
+        fired_ = false;
+        cpu_ = c->cpuindex_;
+        uint64_t now = ktime();
+        wheel_advance(c, now / tick_ns);
+        wheel_insert(c, this);
+        if (expires < c->timer_deadline_) {
+            c->program_timer(now);
+        }
+    }
+    irqs.restore();
+}
+
+// ktimer::cancel()
+//    `fn_` is called with the owning CPU's `timer_lock_` held, so once we
+//    hold that lock the timer is either still queued or completely done.
+
+void ktimer::cancel() {
+    if (cpu_ < 0) {
+        return;
+    }
+    cpustate* c = &cpus[cpu_];
+    spinlock_guard guard(c->timer_lock_);
+    if (link_.is_linked()) {
+        c->timers_.erase(this);
+    } else if (wheel_link_.is_linked()) {
+        wheel_erase(c, this);
+    }
+}
+
+void ktimer::wake_wait_queue(ktimer* t) {
+    static_cast<wait_queue*>(t->arg_)->wake_all();
+}
+
+void ktimer::wake_proc(ktimer* t) {
+    static_cast<proc*>(t->arg_)->wake();
+}
+
+
+// cpustate::program_timer(now)
+//    Arm the APIC timer for this CPU's earliest `ktimer` or timer wheel
+//    slot, or for the next scheduler tick if that is sooner and the CPU
+//    has work. Requires `timer_lock_` and disabled interrupts.
+
+void cpustate::program_timer(uint64_t now) {
+    assert(timer_lock_.is_locked() && is_cli());
+    uint64_t deadline = ~uint64_t(0);
+    if (current_ != idle_task_ || runq_count_ > 0) {
+        deadline = now + tick_ns;
+    }
+    if (ktimer* t = timers_.front()) {
+        deadline = min(deadline, t->expires_);
+    }
+    uint64_t wheel_tick = wheel_next(this);
+    if (wheel_tick != ~uint64_t(0)) {
+        deadline = min(deadline, wheel_tick * tick_ns);
+    }
+    timer_deadline_ = deadline;
+
+    auto& lapic = lapicstate::get();
+    if (deadline == ~uint64_t(0)) {
+        // nothing to wait for: writing 0 stops the timer
+        lapic.write(lapic.reg_timer_initial_count, 0);
+    } else {
+        // APIC counts are nanoseconds; far deadlines take several trips
+        uint64_t delay = deadline > now ? deadline - now : 1;
+        lapic.write(lapic.reg_timer_initial_count,
+                    min(delay, uint64_t(0xFFFFFFFF)));
+    }
+}
+
+
+// cpustate::restart_tick()
+//    Make sure the APIC timer fires within a tick. Called by `schedule`
+//    when this CPU runs a process, since it may have been idle without a
+//    tick. Requires disabled interrupts.
+
+void cpustate::restart_tick() {
+    uint64_t now = ktime();
+    spinlock_guard guard(timer_lock_);
+    if (timer_deadline_ > now + tick_ns) {
+        program_timer(now);
+    }
+}
+
+
+// cpustate::run_timers()
+//    Called from the timer interrupt. Moves due timers out of the wheel,
+//    fires every expired `ktimer` on this CPU, then rearms the APIC.
+
+void cpustate::run_timers() {
+    assert(is_cli());
+    tickless_ = false;
+    uint64_t now = ktime();
+    spinlock_guard guard(timer_lock_);
+    wheel_advance(this, now / tick_ns);
+    while (ktimer* t = timers_.front()) {
+        if (t->expires_ > now) {
+            break;
+        }
+        timers_.pop();
+        t->fired_ = true;
+        t->fn_(t);
+    }
+    program_timer(now);
+}
+
+
+// cpustate::idle_halt()
+//    Halt this CPU until an interrupt arrives, with the APIC timer armed
+//    only for this CPU's `ktimer`s. Called by the idle task with interrupts
+//    disabled; returns with interrupts enabled. If any CPU has queued
+//    processes, yields instead, so `schedule` can take one.
+
+void cpustate::idle_halt() {
+    assert(is_cli() && current_ == idle_task_);
+    // `enqueue` sets `runq_count_` before checking `tickless_`, so either
+    // it kicks this CPU or the loop below sees its work
+    tickless_ = true;
+    for (int i = 0; i != ncpu; ++i) {
+        if (cpus[i].runq_count_ > 0) {
+            tickless_ = false;
+            idle_task_->yield();
+            return;
+        }
+    }
+    {
+        spinlock_guard guard(timer_lock_);
+        program_timer(ktime());
+    }
+    // `sti` takes effect after `hlt` starts, so no interrupt is missed
+    asm volatile("sti; hlt" : : : "memory");
+}
+
+// cpustate::kick()
+//    Interrupt this CPU, which is halted in `idle_halt`, so it schedules.
+
+void cpustate::kick() {
+    irqstate irqs = irqstate::get();
+    cli();
+    if (this != this_cpu()) {
+        lapicstate::get().ipi(lapic_id_, INT_IRQ + IRQ_TIMER);
+    }
+    irqs.restore();
+}
@@ -0,0 +1,68 @@
+#ifndef CHICKADEE_K_TIMER_HH
+#define CHICKADEE_K_TIMER_HH
+#include "k-heap.hh"
+#include "k-list.hh"
+#include "k-lock.hh"
+
+// k-timer.hh
+//    Kernel clock and one-shot kernel timers. Each CPU keeps its timers in
+//    a hierarchical timer wheel, and moves them to a heap
+//    (`cpustate::timers_`) once they are due within the current tick; the
+//    local APIC timer is programmed in one-shot mode for the next event,
+//    plus a scheduler tick while the CPU has processes to run. See
+//    `k-timer.cc`.
+
+// ktime()
+//    Return nanoseconds since boot, measured with the TSC.
+uint64_t ktime();
+// ktime_init()
+//    Calibrate `ktime()`. Called once by the boot CPU.
+void ktime_init();
+
+
+struct ktimer {
+    uint64_t expires_ = 0;                 // `ktime()` deadline
+    void (*fn_)(ktimer*) = nullptr;        // called when the timer fires
+    void* arg_ = nullptr;                  // argument for `fn_`
+    std::atomic<bool> fired_ = false;
+    int cpu_ = -1;                         // CPU whose timers hold this
+    int wheel_slot_ = -1;                  // timer wheel slot, if in wheel
+    heap_links link_;                      // link in `cpustate::timers_`
+    list_links wheel_link_;                // link in timer wheel slot
+
+    ktimer() = default;
+    NO_COPY_OR_ASSIGN(ktimer);
+    inline ~ktimer();
+
+    // Arm the timer on this CPU to call `fn(this)` once `ktime()` reaches
+    // `expires`. `fn` runs in interrupt context, with interrupts disabled
+    // and a spinlock held, so it must not block.
+    void start(uint64_t expires, void (*fn)(ktimer*), void* arg);
+    // Disarm the timer. On return, `fn_` is not running and will not run.
+    void cancel();
+    // Return true iff the timer has fired since it was last started.
+    inline bool fired() const;
+
+    // `fn` for timers whose `arg` is a `wait_queue*` to wake
+    static void wake_wait_queue(ktimer* t);
+    // `fn` for timers whose `arg` is a `proc*` to wake
+    static void wake_proc(ktimer* t);
+};
+
+// orders `cpustate::timers_` by deadline
+struct ktimer_less {
+    bool operator()(const ktimer* a, const ktimer* b) const {
+        return a->expires_ < b->expires_;
+    }
+};
+
+
+inline ktimer::~ktimer() {
+    assert(!link_.is_linked() && !wheel_link_.is_linked());
+}
+
+inline bool ktimer::fired() const {
+    return fired_;
+}
+
+#endif
@@ -184,6 +184,10 @@ uintptr_t memfile_vnode::write(file_descriptor *f, uintptr_t addr, size_t sz) {
 
     // grab memfile lock to sync with memfile_vnode::read()
     spinlock_guard mf_guard(mf_->lock_);
+    // a running program's source file may not be changed
+    if(text_source_busy(mf_ - memfile::initfs, 0)) {
+        return E_TXTBSY;
+    }
     if(mf_->set_length(f->wpos_ + sz) == E_NOSPC) {
         return E_NOSPC;
     }
@@ -193,10 +197,83 @@ uintptr_t memfile_vnode::write(file_descriptor *f, uintptr_t addr, size_t sz) {
     memcpy(&mf_->data_[f->wpos_], reinterpret_cast<void*>(addr), sz);
     f->wpos_ += sz;
     memset(&mf_->data_[f->wpos_], 0, 1);
+    text_cache_invalidate(mf_ - memfile::initfs, 0);
 
     return sz;
 }
 
+// Readahead
+//    Sequential reads of a disk file keep `window_` blocks loading ahead
+//    of the reader. The window starts at `ra_min_window` blocks and
+//    doubles with each sequential read up to `ra_max_window`. It halves
+//    when the buffer cache has no room for the whole window, and it
+//    closes on any non-sequential read. More readahead is issued once
+//    the reader is within half a window of `ra_end_`, so disk reads stay
+//    in flight while earlier blocks are copied out.
+
+static constexpr unsigned ra_min_window = 4;
+static constexpr unsigned ra_max_window = bufcache::max_run;
+
+// readahead(ino, f, off, end)
+//    Update `f->ra_` for a read of `ino` covering `[off, end)` and start
+//    any readahead that is due. `f->ra_` is protected by `f->lock_`,
+//    which is not held while blocks load. Requires a read lock on `ino`.
+static void readahead(chkfs::inode* ino, file_descriptor* f,
+                      off_t off, off_t end) {
+    size_t raoff, limit;
+    {
+        spinlock_guard guard(f->lock_);
+        readahead_state& ra = f->ra_;
+        if(off != ra.next_off_) {
+            ra.window_ = 0;
+            ra.ra_end_ = 0;
+        } else if(ra.window_ == 0) {
+            ra.window_ = ra_min_window;
+        } else {
+            ra.window_ = min(ra.window_ * 2, ra_max_window);
+        }
+        ra.next_off_ = end;
+
+        off_t window_bytes = off_t(ra.window_) * chkfs::blocksize;
+        if(ra.window_ == 0 || ra.ra_end_ - end >= window_bytes / 2) {
+            return;
+        }
+
+        // load the blocks after `max(end, ra_end_)`
+        raoff = round_up(size_t(max(end, ra.ra_end_)), chkfs::blocksize);
+        limit = min(raoff + size_t(window_bytes), size_t(ino->size));
+    }
+
+    // one extent at a time
+    bool short_of_room = false;
+    chkfs_fileiter it(ino);
+    while(raoff < limit) {
+        it.find(raoff);
+        chkfs::blocknum_t bn = it.blocknum();
+        if(!bn) {
+            break;
+        }
+        unsigned want = min(size_t(it.extent_blocks_left()),
+                            (limit - raoff + chkfs::blocksize - 1)
+                            / chkfs::blocksize);
+        unsigned got = bufcache::get().load_run(bn, want);
+        raoff += size_t(got) * chkfs::blocksize;
+        if(got < want) {
+            short_of_room = true;
+            break;
+        }
+    }
+
+    spinlock_guard guard(f->lock_);
+    readahead_state& ra = f->ra_;
+    if(short_of_room) {
+        // buffer cache is short of room
+        ra.window_ = max(ra.window_ / 2, ra_min_window);
+    }
+    ra.ra_end_ = max(ra.ra_end_, off_t(raoff));
+}
+
+
 uintptr_t diskfile_vnode::read(file_descriptor *f, uintptr_t addr, size_t sz) {
     if(!f->readable_) return E_BADF;
 
@@ -207,14 +284,25 @@ uintptr_t diskfile_vnode::read(file_descriptor *f, uintptr_t addr, size_t sz) {
         return 0;
     }
 
+    // start readahead before waiting on this read's own blocks
+    off_t off = f->rpos_;
+    if(off < off_t(ino_->size)) {
+        readahead(ino_, f, off,
+                  off + off_t(min(sz, size_t(ino_->size - off))));
+    }
+
     chkfs_fileiter it(ino_);
 
     size_t nread = 0;
     unsigned char* buf = reinterpret_cast<unsigned char*>(addr);
 
     while(nread < sz) {
+        // start loading the rest of this read's blocks in the current
+        // extent as one disk command, unless already started
+        it.find(f->rpos_).load_ahead(sz - nread);
+
         // copy data from current block
-        if(bcentry* e = it.find(f->rpos_).get_disk_entry()) {
+        if(bcentry* e = it.get_disk_entry()) {
             unsigned b = it.block_relative_offset();
             size_t ncopy = min(
                 size_t(ino_->size - it.offset()),
@@ -244,6 +332,11 @@ uintptr_t diskfile_vnode::write(file_descriptor *f, uintptr_t addr, size_t sz) {
 
     // synchronize access to inode's size and data references
     ino_->lock_write();
+    // a running program's source file may not be changed
+    if(text_source_busy(-1, inum_)) {
+        ino_->unlock_write();
+        return E_TXTBSY;
+    }
     chkfs_fileiter it(ino_);
 
     // extend file if necessary
@@ -294,6 +387,7 @@ uintptr_t diskfile_vnode::write(file_descriptor *f, uintptr_t addr, size_t sz) {
         }
     }
 
+    text_cache_invalidate(-1, inum_);
     ino_->unlock_write();
     return nwritten;
 }
\ No newline at end of file
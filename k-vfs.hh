@@ -54,9 +54,10 @@ struct keyboard_console_vnode : public vnode {
 
 struct diskfile_vnode : public vnode {
     chkfs::inode* ino_;
+    chkfs::inum_t inum_;            // inode number of `ino_`
 
-    diskfile_vnode(chkfs::inode* ino, int ref = 1) :
-        vnode(ref), ino_(ino) {
+    diskfile_vnode(chkfs::inode* ino, chkfs::inum_t inum, int ref = 1) :
+        vnode(ref), ino_(ino), inum_(inum) {
         assert(ino_);
     }
 
@@ -64,6 +65,16 @@ struct diskfile_vnode : public vnode {
     uintptr_t write(file_descriptor* f, uintptr_t addr, size_t sz) override;
 };
 
+// readahead_state
+//    Sequential access detection for a disk file descriptor. A read that
+//    starts where the previous one ended doubles the readahead window;
+//    any other read closes it. See `diskfile_vnode::read`.
+struct readahead_state {
+    off_t next_off_ = 0;        // where a sequential read would start
+    off_t ra_end_ = 0;          // end of the readahead issued so far
+    unsigned window_ = 0;       // blocks to keep loaded ahead of reads
+};
+
 struct file_descriptor {
     inline file_descriptor(int type, int flags, vnode* v) :
         ref_(1),
@@ -87,6 +98,7 @@ struct file_descriptor {
     bool writable_ = false;                 // whether the file is writables
     int type_;                              // the fd_t of this file descriptor
     vnode* vnode_ = nullptr;
+    readahead_state ra_;                    // for disk files; protected by lock_
 };
 
 struct bounded_buffer {
@@ -67,11 +67,11 @@ int vmiter::try_map(uintptr_t pa, int perm) {
 
     while (lbits_ > PAGEOFFBITS && perm) {
         assert(!(*pep_ & PTE_P));
-        x86_64_pagetable* pt = knew<x86_64_pagetable>();
+        x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
+            (kalloc(PAGESIZE, KALLOC_ZERO));
         if (!pt) {
             return -1;
         }
-        memset(pt, 0, PAGESIZE);
         std::atomic_thread_fence(std::memory_order_release);
         *pep_ = ka2pa(pt) | PTE_P | PTE_W | PTE_U;
         down();
@@ -75,13 +75,13 @@ inline void waiter::block_until(wait_queue& wq, F predicate) {
 }
 
 // waiter::block_until(wq, predicate, lock, irqs)
-//    Block on `wq` until `predicate()` returns true. The `lock`
-//    must be locked; it is unlocked before blocking (if blocking
-//    is necessary). All calls to `predicate` have `lock` locked,
-//    and `lock` is locked on return.
-template <typename F>
+//    Block on `wq` until `predicate()` returns true. The `lock` (a
+//    `spinlock`, or a `rwspinlock` held exclusively) must be locked; it
+//    is unlocked before blocking (if blocking is necessary). All calls
+//    to `predicate` have `lock` locked, and `lock` is locked on return.
+template <typename F, typename L>
 inline void waiter::block_until(wait_queue& wq, F predicate,
-                                spinlock& lock, irqstate& irqs) {
+                                L& lock, irqstate& irqs) {
     while (true) {
         prepare(wq);
         if (predicate()) {
@@ -98,9 +98,8 @@ inline void waiter::block_until(wait_queue& wq, F predicate,
 //    Block on `wq` until `predicate()` returns true. The `guard`
 //    must be locked on entry; it is unlocked before blocking (if
 //    blocking is necessary) and locked on return.
-template <typename F>
-inline void waiter::block_until(wait_queue& wq, F predicate,
-                                spinlock_guard& guard) {
+template <typename F, typename G>
+inline void waiter::block_until(wait_queue& wq, F predicate, G& guard) {
     block_until(wq, predicate, guard.lock_, guard.irqs_);
 }
 
@@ -135,7 +134,6 @@ inline void wait_queue::wake_proc(proc* p) {
 inline int wait_queue::wake_some(int count) {
     spinlock_guard guard(lock_);
     int awaken = 0;
-    log_printf("count: %d\n", count);
     while (count > 0) {
         if(auto w = q_.pop_front()) {
             w->wake();
@@ -27,12 +27,11 @@ struct waiter {
 
     template <typename F>
     inline void block_until(wait_queue& wq, F predicate);
-    template <typename F>
-    inline void block_until(wait_queue& wq, F predicate,
-                            spinlock& lock, irqstate& irqs);
-    template <typename F>
+    template <typename F, typename L>
     inline void block_until(wait_queue& wq, F predicate,
-                            spinlock_guard& guard);
+                            L& lock, irqstate& irqs);
+    template <typename F, typename G>
+    inline void block_until(wait_queue& wq, F predicate, G& guard);
 };
 
 
@@ -15,14 +15,12 @@
 //
 //    This is the kernel.
 
-// # timer interrupts so far on CPU 0
+// # ticks (1/HZ sec) since boot
 std::atomic<unsigned long> ticks;
 proc* init_process = nullptr;
 
 // wait queues
 wait_queue wait_child_exit_wq;
-#define SLEEP_WQS_COUNT 10
-wait_queue sleep_wqs[SLEEP_WQS_COUNT];
 wait_queue proc_group_exiting_wq;
 
 static void tick();
@@ -43,6 +41,7 @@ void print_pgtable() {
 }
 
 void print_processes() {
+    rwspinlock_read_guard guard(ptable_lock);
     for(int i = 0; i < NPROC; ++i) {
         proc_group *parent = pgtable[i];
         proc_group *child;
@@ -68,6 +67,67 @@ void print_processes() {
 }
 
 
+lockstat lockstats[NLOCKSTATS];
+std::atomic<unsigned> nlockstats;
+std::atomic<unsigned> nlockstats_dropped;
+static std::atomic_flag lockstats_lock;     // serializes `lockstat::make`
+
+lockstat* lockstat::make(const char* name) {
+    while (lockstats_lock.test_and_set(std::memory_order_acquire)) {
+        pause();
+    }
+    lockstat* ls = nullptr;
+    unsigned n = nlockstats.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i != n && !ls; ++i) {
+        if (strcmp(lockstats[i].name_, name) == 0) {
+            ls = &lockstats[i];
+        }
+    }
+    if (!ls && n < NLOCKSTATS) {
+        ls = &lockstats[n];
+        ls->name_ = name;
+        nlockstats.store(n + 1, std::memory_order_release);
+    } else if (!ls) {
+        ++nlockstats_dropped;
+    }
+    lockstats_lock.clear(std::memory_order_release);
+    return ls;
+}
+
+int log_lockstats() {
+#if HAVE_LOCKSTAT
+    // sort by cycles spent spinning, most first
+    unsigned n = nlockstats.load();
+    lockstat* order[NLOCKSTATS];
+    for (unsigned i = 0; i != n; ++i) {
+        order[i] = &lockstats[i];
+        for (unsigned j = i; j > 0
+                 && order[j]->spin_cycles_ > order[j - 1]->spin_cycles_; --j) {
+            std::swap(order[j], order[j - 1]);
+        }
+    }
+
+    log_printf("%-16s %10s %10s %14s %14s\n", "lock", "acquired",
+               "contended", "spin cycles", "max hold");
+    int nprinted = 0;
+    for (unsigned i = 0; i != n; ++i) {
+        lockstat* ls = order[i];
+        if (ls->nacquire_) {
+            log_printf("%-16s %10lu %10lu %14lu %14lu\n", ls->name_,
+                       ls->nacquire_.load(), ls->ncontended_.load(),
+                       ls->spin_cycles_.load(), ls->max_hold_cycles_.load());
+            ++nprinted;
+        }
+    }
+    if (unsigned ndropped = nlockstats_dropped.load()) {
+        log_printf("(%u named locks not profiled: table full)\n", ndropped);
+    }
+    return nprinted;
+#else
+    return E_NOSYS;
+#endif
+}
+
 
 // kernel_start(command)
 //    Initialize the hardware and processes and start running. The `command`
@@ -87,6 +147,9 @@ void kernel_start(const char* command) {
     // start init process
     init_process_start();
 
+    // start buffer cache writeback task
+    bufcache::get().start_writeback();
+
     // start boot process
     boot_process_start(2, CHICKADEE_FIRST_PROCESS);;
 
@@ -111,7 +174,7 @@ void init_process_start() {
     assert(init_process);
     init_process->init_kernel(1, init_process_function);
     {
-        spinlock_guard guard(ptable_lock);
+        rwspinlock_guard guard(ptable_lock);
         assert(!ptable[1]);
         ptable[1] = init_process;
     }
@@ -124,7 +187,7 @@ void init_process_start() {
     pg->add_proc(init_process);
     // add process group to proces group table
     {
-        spinlock_guard guard(pgtable_lock);
+        rwspinlock_guard guard(pgtable_lock);
         assert(!pgtable[1]);
         pgtable[1] = pg;
     }
@@ -153,11 +216,12 @@ void boot_process_start(pid_t pid, const char* name) {
     proc_group* pg = knew<proc_group>(pid, ld.pagetable_);
     init_process->pg_->add_child(pg);
     pg->init_fd_table();
+    pg->set_vmas(ld.vmas_, ld.nvmas_);
 
     // add to process group table (requires lock in case another CPU is already
     // running processes)
     {
-        spinlock_guard guard(pgtable_lock);
+        rwspinlock_guard guard(pgtable_lock);
         assert(!pgtable[pid]);
         pgtable[pid] = pg;
     }
@@ -169,7 +233,7 @@ void boot_process_start(pid_t pid, const char* name) {
     pg->add_proc(p);
 
 
-    void* stkpg = kalloc(PAGESIZE);
+    void* stkpg = kalloc(PAGESIZE, KALLOC_ZERO);
     assert(stkpg);
     vmiter(p, MEMSIZE_VIRTUAL - PAGESIZE).map(stkpg, PTE_PWU);
     p->regs_->reg_rsp = MEMSIZE_VIRTUAL;
@@ -182,7 +246,7 @@ void boot_process_start(pid_t pid, const char* name) {
     // add to process table (requires lock in case another CPU is already
     // running processes)
     {
-        spinlock_guard guard(ptable_lock);
+        rwspinlock_guard guard(ptable_lock);
         assert(!ptable[pid]);
         ptable[pid] = p;
     }
@@ -216,17 +280,21 @@ void proc::exception(regstate* regs) {
     switch (regs->reg_intno) {
         case INT_IRQ + IRQ_TIMER: {
             cpustate* cpu = this_cpu();
-            if (cpu->cpuindex_ == 0) {
-                tick();
+            tick();
+            // fire expired timers, waking sleeping processes
+            cpu->run_timers();
+            // even out run queues ten times a second
+            if (uint64_t now = ktime(); now >= cpu->next_balance_) {
+                cpu->next_balance_ = now + cpustate::balance_interval_ns;
+                cpu->balance();
             }
-            // wake sleeping processes
-            sleep_wqs[ticks % SLEEP_WQS_COUNT].wake_all();
-            // wake exiting processes
-            proc_group_exiting_wq.wake_all();
             lapicstate::get().ack();
-            regs_ = regs;
-            yield_noreturn();
-            break; /* will not be reached */
+            // preempt only if a queued process has run less
+            if (cpu->should_preempt()) {
+                regs_ = regs;
+                yield_noreturn();
+            }
+            break;
         }
 
         case INT_PF: {  // pagefault exception
@@ -239,6 +307,32 @@ void proc::exception(regstate* regs) {
                                       ? "protection problem"
                                       : "missing page";
 
+            // missing pages of demand-loaded program segments are read
+            // in; this may block, so allow interrupts if the faulting
+            // context did. Kernel code holding a spinlock must not block,
+            // so it must call `prepare_user_range` before touching user
+            // memory; a fault there is a kernel bug.
+            bool may_block = (regs->reg_cs & 3) != 0
+                || this_cpu()->spinlock_depth_ == 0;
+            if (!(regs->reg_errcode & PFERR_PRESENT) && addr < VA_LOWEND
+                && may_block) {
+                if (regs->reg_rflags & EFLAGS_IF) {
+                    sti();
+                }
+                if (pg_->vm_fault(addr)) {
+                    break;
+                }
+            }
+
+            // writes to copy-on-write pages (from user code or from the
+            // kernel on the user's behalf) get a private copy and retry
+            if ((regs->reg_errcode & (PFERR_WRITE | PFERR_PRESENT))
+                    == (PFERR_WRITE | PFERR_PRESENT)
+                && addr < VA_LOWEND
+                && pg_->cow_fault(addr)) {
+                break;
+            }
+
             if ((regs->reg_cs & 3) == 0) {
                 panic_at(*regs, "Kernel page fault for %p (%s %s)!\n",
                          addr, operation, problem);
@@ -327,7 +421,7 @@ uintptr_t proc::unsafe_syscall(regstate* regs) {
             if (addr >= VA_LOWEND || addr & 0xFFF) {
                 return -1;
             }
-            void* pg = kalloc(PAGESIZE);
+            void* pg = kalloc(PAGESIZE, KALLOC_ZERO);
             if (!pg || vmiter(this, addr).try_map(ka2pa(pg), PTE_PWU) < 0) {
                 return -1;
             }
@@ -376,7 +470,7 @@ uintptr_t proc::unsafe_syscall(regstate* regs) {
 
         case SYSCALL_GETPPID: {
             // synchronize access to ppid_ with exit
-            spinlock_guard g(ptable_lock);
+            rwspinlock_read_guard g(ptable_lock);
             return pg_->ppid_;
         }
 
@@ -406,13 +500,17 @@ uintptr_t proc::unsafe_syscall(regstate* regs) {
         }
 
         case SYSCALL_SLEEP: {
-            unsigned long wakeup_time = ticks + (regs->reg_rdi + 9) / 10;
             sleeping_ = true;
+            wait_queue wq;
+            ktimer timer;
+            timer.start(ktime() + regs->reg_rdi * 1000000,
+                        ktimer::wake_wait_queue, &wq);
             waiter w;
             // sleep until wakeup time, or thread is interrupted, or should exit
-            w.block_until(sleep_wqs[wakeup_time % SLEEP_WQS_COUNT], [&] () {
-                return (long(wakeup_time - ticks) < 0 || interrupted_);
+            w.block_until(wq, [&] () {
+                return timer.fired() || interrupted_;
             });
+            timer.cancel();
             sleeping_ = false;
 
             if(interrupted_) {
@@ -471,11 +569,16 @@ uintptr_t proc::unsafe_syscall(regstate* regs) {
             return 0;
         }
 
+        case SYSCALL_LOCKSTATS: {
+            return log_lockstats();
+        }
+
         case SYSCALL_FUTEX: {
             uintptr_t uaddr = regs->reg_rdi;
             int futex_op = regs->reg_rsi;
             int val = regs->reg_rdx;
-            return syscall_futex(uaddr, futex_op, val);
+            return syscall_futex(uaddr, futex_op, val, regs->reg_r10,
+                                 regs->reg_r8, regs->reg_r9);
         }
 
         case SYSCALL_SHMGET: {
@@ -512,77 +615,117 @@ int proc::syscall_nasty() {
     return nasty_array[1] + nasty_array[2];
 }
 
+// Slots of `ptable` and `pgtable` that `fork` has claimed for a child
+// it is still building. Protected by `ptable_lock` and `pgtable_lock`.
+static bool ptable_reserved[NPROC];
+static bool pgtable_reserved[NPROC];
+
+// reserve_slot(table, reserved)
+//    Claim a free index of `table` and return it, or return 0 if none is
+//    free. Requires `ptable_lock` and `pgtable_lock`.
+template <typename T>
+static pid_t reserve_slot(T* const* table, bool* reserved) {
+    for (pid_t i = 1; i < NPROC; ++i) {
+        if (!table[i] && !reserved[i]) {
+            reserved[i] = true;
+            return i;
+        }
+    }
+    return 0;
+}
+
 // proc::syscall_fork(regs)
 //    Handle fork system call.
-// TODO: implement copy-on-write (see lecture 09)
 // TODO: make use of syscall_clone
 int proc::syscall_fork(regstate* regs) {
-    // protect access to ptable
-    spinlock_guard ptable_guard(ptable_lock);
-
-    // protect access to pgtable
-    spinlock_guard pgtable_guard(pgtable_lock);
-
-    // protect shared memory segments
-    spinlock_guard pg_lock(pg_->lock_);
-
-    proc_group* pg;
-    pid_t child_pid;
-    pid_t j;
-    // look for available process group PID
-    for(j = 1; j < NPROC; j++) {
-        if(!pgtable[j]) {
-            child_pid = j;
-            break;
+    // Reserve the child's pids with `ptable_lock` and `pgtable_lock` held
+    // exclusively, then build the child without them, so forks and table
+    // readers on other CPUs don't wait for the copy. The child enters the
+    // tables and this group's children only once it is complete, so
+    // readers never see it half-built.
+    pid_t child_pid, child_id = 0;
+    {
+        rwspinlock_guard ptable_guard(ptable_lock);
+        rwspinlock_guard pgtable_guard(pgtable_lock);
+        child_pid = reserve_slot(pgtable, pgtable_reserved);
+        if (child_pid) {
+            child_id = reserve_slot(ptable, ptable_reserved);
+            if (!child_id) {
+                pgtable_reserved[child_pid] = false;
+            }
         }
     }
     // return error if out of pids
-    if(j == NPROC) {
+    if (!child_id) {
         return E_NOMEM;
     }
 
-    // allocate pagetable for the process group
+    // allocate the child's pagetable, process group, and thread, then
+    // copy this process into it
+    int r = E_NOMEM;
     x86_64_pagetable* pagetable = kalloc_pagetable();
-    if (!pagetable) {
-        return E_NOMEM;
+    proc_group* pg = nullptr;
+    proc* p = nullptr;
+    if (pagetable) {
+        pg = knew<proc_group>(child_pid, pagetable);
     }
-
-    // allocate process group with PID child_pid, make it a child
-    // of this process group, and initiate its memory
-    pg = knew<proc_group>(child_pid, pagetable);
-    if (!pg) {
-        goto bad_fork_free_pagetable;
+    if (pg) {
+        p = knew<proc>();
+    }
+    if (p) {
+        p->init_user(child_id, pg);
+        pg->add_proc(p);
+        r = fork_copy(p, regs);
     }
-    pgtable[child_pid] = pg;
-    pg_->add_child(pg);
 
-    proc* p;
-    pid_t child_id;
-    pid_t i;
-    // look for available thread pid
-    for (i = 1; i < NPROC; ++i) {
-        if (!ptable[i]) {
-            child_id = i;
-            break;
+    // publish the child, or release its pids
+    {
+        rwspinlock_guard ptable_guard(ptable_lock);
+        rwspinlock_guard pgtable_guard(pgtable_lock);
+        ptable_reserved[child_id] = false;
+        pgtable_reserved[child_pid] = false;
+        if (r >= 0) {
+            ptable[child_id] = p;
+            pgtable[child_pid] = pg;
+            // if this group started exiting during the copy, its children
+            // have already moved to `init`, so the new child goes there too
+            proc_group* parent = pg_->who_exited_ ? init_process->pg_ : pg_;
+            parent->add_child(pg);
         }
     }
 
-    // return error if out of pids
-    if (i == NPROC) {
-        goto bad_fork_cleanup_procgroup;
+    if (r < 0) {
+        if (p) {
+            // free memory pages allocated by `fork_copy`
+            kfree_mem(p);
+            // free process page (struct proc and kernel stack)
+            kfree(p);
+        }
+        kfree(pg);
+        if (pagetable) {
+            kfree_pagetable(pagetable);
+        }
+        return r;
     }
 
+    // add child to a cpu
+    cpus[child_id % ncpu].enqueue(p);
 
-    // allocate process and assign found pid to it
-    p = knew<proc>();
-    if (!p) {
-        goto bad_fork_cleanup_procgroup;
-    }
-    ptable[child_id] = p;
+    return child_id;
+}
 
-    // initialize process and add it to process group
-    p->init_user(child_id, pg);
-    pg->add_proc(p);
+// proc::fork_copy(p, regs)
+//    Copy this process's memory, shared memory segments, file descriptors,
+//    and registers `regs` into `p`, a new process in a new process group.
+//    Returns 0 on success or E_NOMEM.
+int proc::fork_copy(proc* p, regstate* regs) {
+    // protect shared memory segments
+    spinlock_guard pg_lock(pg_->lock_);
+    proc_group* pg = p->pg_;
+
+    // share the parent's user pages copy-on-write, unless other threads
+    // may hold TLB entries we can't invalidate (see `proc_group::cow_fault`)
+    bool cow = pg_->procs_.front() == this && !pg_->procs_.next(this);
 
     // copy the parent process' user-accessible memory
     for (vmiter it(this, 0); it.low(); it.next()) {
@@ -590,7 +733,7 @@ int proc::syscall_fork(regstate* regs) {
         if(pg_->get_shared_mem_seg_id(it.va()) >= 0) {
             log_printf("sys_fork don't duplicate va %p pa %p\n", it.va(), it.pa());
             if(vmiter(p, it.va()).try_map(it.pa(), it.perm()) < 0) {
-                goto bad_fork_cleanup_childproc;
+                return E_NOMEM;
             }
             log_printf("sys_fork now child has va %p mapped to pa %p\n", vmiter(p, it.va()).va(), vmiter(p, it.va()).pa());
             continue;
@@ -599,7 +742,25 @@ int proc::syscall_fork(regstate* regs) {
         // don't duplicate console page
         if (it.pa() == CONSOLE_ADDR) {
             if(vmiter(p, it.va()).try_map(CONSOLE_ADDR, it.perm()) < 0) {
-                goto bad_fork_cleanup_childproc;
+                return E_NOMEM;
+            }
+            continue;
+        }
+
+        // share regular user pages; read-only pages (such as shared
+        // program text) never change, so they can always be shared
+        if (it.user() && (cow || !(it.perm() & (PTE_W | PTE_COW)))) {
+            int perm = it.perm();
+            if (perm & PTE_W) {
+                perm = (perm & ~PTE_W) | PTE_COW;
+            }
+            if (vmiter(p, it.va()).try_map(it.pa(), perm) < 0) {
+                return E_NOMEM;
+            }
+            kref(it.kptr());
+            if (perm != int(it.perm())) {
+                int r = it.try_map(it.pa(), perm);
+                assert(r == 0);
             }
             continue;
         }
@@ -607,18 +768,27 @@ int proc::syscall_fork(regstate* regs) {
         // copy regular user pages
         if (it.user()) {
             // allocate new page
-            void* new_page = kalloc(PAGESIZE);
+            // (no need to fill: it's overwritten below)
+            void* new_page = kalloc(PAGESIZE, KALLOC_NOFILL);
             // map page's physical address to a virtual address
             if (!new_page || vmiter(p, it.va()).try_map(new_page, it.perm()) != 0) {
                 // free most recently allocated memory page
                 kfree(new_page);
-                goto bad_fork_cleanup_childproc;
+                return E_NOMEM;
             }
             // copy parent's page
             memcpy(new_page, it.kptr(), PAGESIZE);
         }
     }
 
+    // child loads the same program segments on demand
+    pg->set_vmas(pg_->vmas_, pg_->nvmas_);
+
+    // drop the parent's now-stale writable TLB entries
+    if (cow) {
+        set_pagetable(pg_->pagetable_);
+    }
+
     // copy parent's shared memory segments
     for(int shimd = 0; shimd < NSEGS; ++shimd) {
         shared_mem_segment* sms = pg_->get_shared_mem_seg(shimd);
@@ -645,41 +815,24 @@ int proc::syscall_fork(regstate* regs) {
     // set %rax so 0 gets returned to child
     p->regs_->reg_rax = 0;
 
-    // add child to a cpu
-    cpus[child_id % ncpu].enqueue(p);
-
-    return child_id;
-
-    // error handling 'goto' statements
-    bad_fork_cleanup_childproc:
-        // remove process from ptable
-        ptable[child_id] = nullptr;
-        // free memory pages allocated in previous iterations
-        kfree_mem(p);
-        // free process page (struct proc and kernel stack)
-        kfree(p);
-    bad_fork_cleanup_procgroup:
-        // remove process group from pgtable
-        pgtable[child_pid] = nullptr;
-        // remove process group from this group's children
-        pg_->remove_child(pg);
-        // free process group
-        kfree(pg);
-    bad_fork_free_pagetable:
-        kfree_pagetable(pagetable);
-    return E_NOMEM;
+    return 0;
 }
 
 pid_t proc::syscall_clone(regstate* regs) {
     // protect access to ptable
-    spinlock_guard ptable_guard(ptable_lock);
+    rwspinlock_guard ptable_guard(ptable_lock);
+
+    // threads can't share copy-on-write pages (see `proc_group::cow_fault`)
+    if (pg_->unshare_cow() < 0) {
+        return E_NOMEM;
+    }
 
     proc* p;
     pid_t child_id;
     pid_t i;
     // look for available thread pid
     for (i = 1; i < NPROC; ++i) {
-        if (!ptable[i]) {
+        if (!ptable[i] && !ptable_reserved[i]) {
             child_id = i;
             break;
         }
@@ -721,7 +874,7 @@ void proc::syscall_exit(int status) {
     {
         // synchronize access to pstate_, ppid_, and proc_group::children_
         // TODO: protect pstate_ with a less generic lock
-        spinlock_guard guard(ptable_lock);
+        rwspinlock_guard guard(ptable_lock);
 
         // protect access to pg_ properties
         auto pg_lock_irqs = pg_->lock_.lock();
@@ -757,11 +910,10 @@ void proc::syscall_exit(int status) {
             while(p && p != this) {
                 // if 'p' is blocked, wake it up so it can switch its state to ps_exiting
                 if(p->pstate_ == ps_blocked) {
-                    // it may happen that 'p' will block, but just hasn't yet, so waking
-                    // it up will have not effect. Hence, the predicate will fail and this
-                    // process will block. This is okay, though, since whenever a timer
-                    // interrupt happens we wake this process, so it can rerun the predicate
-                    // By then, 'p' should be already blocked and we'll wake it up.
+                    // once running, 'p' eventually enters cpustate::schedule() (by
+                    // blocking again, or by preemption, which is forced while
+                    // its group exits). schedule() marks it ps_exiting and wakes
+                    // proc_group_exiting_wq, so this predicate reruns.
                     p->wake();
                     return false;
                 }
@@ -800,6 +952,7 @@ void proc::syscall_exit(int status) {
             // interrupt a thread if it's sleeping
             if(p->sleeping_) {
                 p->interrupted_ = true;
+                p->wake();
             }
 
             // wake thread if it's waiting for child process to exit
@@ -817,7 +970,7 @@ pid_t proc::syscall_texit(int status) {
     {
         // synchronize access to pstate_ and to ppid_
         // TODO: protect pstate_ with a less generic lock
-        spinlock_guard guard(ptable_lock);
+        rwspinlock_guard guard(ptable_lock);
 
         // set the state of this process as ps_exiting
         // parent will finish exit process in sys_waitpid
@@ -856,6 +1009,7 @@ pid_t proc::syscall_texit(int status) {
             // interrupt a thread if it's sleeping
             if(p->sleeping_) {
                 p->interrupted_ = true;
+                p->wake();
             }
 
             // wake thread if it's waiting for child process to exit
@@ -896,7 +1050,7 @@ pid_t proc::kill_zombie(proc_group* zombie, int* status) {
     }
 
     // remove zombie from pgtable and from its parent's children's list
-    spinlock_guard guard(pgtable_lock);
+    rwspinlock_guard guard(pgtable_lock);
     pid_t zid = zombie->pid_;
     pgtable[zid] = nullptr;
     pg_->children_.erase(zombie);
@@ -926,8 +1080,14 @@ bool proc_group::is_zombie() {
 }
 
 pid_t proc::syscall_waitpid(pid_t pid, int* status, int options) {
+    // `kill_zombie` writes `*status` under `ptable_lock`, so load it now
+    if(status && !prepare_user_range(reinterpret_cast<uintptr_t>(status),
+                                     sizeof(int), PTE_PWU)) {
+        return E_FAULT;
+    }
+
     // synchronize access to pstate_
-    spinlock_guard g(ptable_lock);
+    rwspinlock_guard g(ptable_lock);
 
     proc_group* child = pg_->children_.front();
     if(!child) {
@@ -1018,7 +1178,7 @@ uintptr_t proc::syscall_read(regstate* regs) {
 
 
     // test that memory range is present, writable, and user-accessible
-    if(!(vmiter(this, addr).range_perm(sz, PTE_PWU))) {
+    if(!prepare_user_range(addr, sz, PTE_PWU)) {
         return E_FAULT;
     }
     // read 'sz' bytes into 'addr' and from file descriptor
@@ -1046,7 +1206,7 @@ uintptr_t proc::syscall_write(regstate* regs) {
     }
 
     // check for present and user-accessible memory
-    if(!(vmiter(this, addr).range_perm(sz, PTE_P | PTE_U))) {
+    if(!prepare_user_range(addr, sz, PTE_P | PTE_U)) {
         return E_FAULT;
     }
 
@@ -1065,6 +1225,9 @@ uintptr_t proc::syscall_readdiskfile(regstate* regs) {
     if (!sata_disk) {
         return E_IO;
     }
+    if (!prepare_user_range(reinterpret_cast<uintptr_t>(buf), sz, PTE_PWU)) {
+        return E_FAULT;
+    }
 
     // read root directory to find file inode number
     auto ino = chkfsstate::get().lookup_inode(filename);
@@ -1078,8 +1241,12 @@ uintptr_t proc::syscall_readdiskfile(regstate* regs) {
 
     size_t nread = 0;
     while (nread < sz) {
+        // start loading the rest of this call's blocks in the current
+        // extent as one disk command, unless already started
+        it.find(off).load_ahead(sz - nread);
+
         // copy data from current block
-        if (bcentry* e = it.find(off).get_disk_entry()) {
+        if (bcentry* e = it.get_disk_entry()) {
             unsigned b = it.block_relative_offset();
             size_t ncopy = min(
                 size_t(ino->size - it.offset()),   // bytes left in file
@@ -1256,6 +1423,10 @@ bool proc::is_address_user_accessible(uintptr_t addr, size_t len) {
     vmiter it(this, addr);
     uintptr_t init_va = it.va();
     for(; it.va() < (init_va + len + 1) && it.va() < MEMSIZE_VIRTUAL; it += 1) {
+        // load demand-paged memory
+        if(!it.present() && pg_->vm_fault(it.va())) {
+            it.find(it.va());
+        }
         if(!it.user() || !it.present()) {
             return false;
         }
@@ -1268,6 +1439,29 @@ bool proc::is_address_user_accessible(uintptr_t addr, size_t len) {
     return true;
 }
 
+// prepare_user_range(addr, sz, perm)
+//      checks whether the range [addr, addr + sz) is user-accessible with
+//      permissions 'perm', first loading demand-paged memory in the range
+//      and, if 'perm' includes PTE_W, resolving copy-on-write pages (as
+//      page faults would). Doing this up front keeps faults out of code
+//      that copies to and from user memory while holding locks.
+bool proc::prepare_user_range(uintptr_t addr, size_t sz, int perm) {
+    for(uintptr_t va = round_down(addr, PAGESIZE); va < addr + sz; va += PAGESIZE) {
+        vmiter it(this, va);
+        if(!it.present() && !pg_->vm_fault(va)) {
+            return false;
+        }
+        it.find(va);
+        if(!it.user()) {
+            return false;
+        }
+        if((perm & PTE_W) && it.perm(PTE_COW) && !pg_->cow_fault(va)) {
+            return false;
+        }
+    }
+    return vmiter(this, addr).range_perm(sz, perm);
+}
+
 int proc::syscall_execv(uintptr_t program_name, const char* const* argv, size_t argc) {
     // validate program name
     if(!is_address_user_accessible(program_name, chkfs::maxnamelen)) {
@@ -1301,19 +1495,28 @@ int proc::syscall_execv(uintptr_t program_name, const char* const* argv, size_t
     auto ino = chkfsstate::get().lookup_inode(reinterpret_cast<const char*>(program_name));
     if(!ino) return E_FAULT;
 
+    // keep the file from being written before it is read; the inode
+    // lock orders this with writers' `text_source_busy` checks
+    chkfs::inum_t inum = chkfsstate::get().inode_number(ino);
+    ino->lock_read();
+    text_source_hold(-1, inum);
+    ino->unlock_read();
+
     // instantiate a proc_loader with the disk file and pagetable
     diskfile_loader ld(ino, pt);
 
     // load program into user-level memory
     int r = proc::load(ld);
     if(r < 0){
+        text_source_release(-1, inum);
         kfree_pagetable(pt);
         return r;
     }
 
     // map the user level stack at address MEMSIZE_VIRTUAL
-    void* stackpg = kalloc(PAGESIZE);
+    void* stackpg = kalloc(PAGESIZE, KALLOC_ZERO);
     if(!stackpg || vmiter(pt, MEMSIZE_VIRTUAL - PAGESIZE).try_map(stackpg, PTE_PWU) < 0) {
+        text_source_release(-1, inum);
         kfree(stackpg);
         kfree_pagetable(pt);
         return E_NOMEM;
@@ -1321,6 +1524,7 @@ int proc::syscall_execv(uintptr_t program_name, const char* const* argv, size_t
 
     // map the console at address CONSOLE_ADDR
     if(vmiter(pt, CONSOLE_ADDR).try_map(CONSOLE_ADDR, PTE_PWU) < 0) {
+        text_source_release(-1, inum);
         kfree(stackpg);
         kfree_pagetable(pt);
         return E_NOMEM;
@@ -1350,6 +1554,8 @@ int proc::syscall_execv(uintptr_t program_name, const char* const* argv, size_t
 
     // reset this process to have pagetable 'pt'
     pg_->pagetable_ = pt;
+    pg_->set_vmas(ld.vmas_, ld.nvmas_);
+    text_source_release(-1, inum);
     init_user(id_, pg_);
 
     // set the registers
@@ -1387,7 +1593,8 @@ int proc::syscall_open(const char* pathname, int flags) {
     }
 
     // allocate disk vnode
-    vnode* v = knew<diskfile_vnode>(ino);
+    chkfs::inum_t inum = chkfsstate::get().inode_number(ino);
+    vnode* v = knew<diskfile_vnode>(ino, inum);
     if(!v) {
         ino->put();
         return E_NOMEM;
@@ -1403,9 +1610,16 @@ int proc::syscall_open(const char* pathname, int flags) {
 
     if(flags & OF_TRUNC && flags & OF_WRITE) {
         ino->lock_write();
+        // a running program's source file may not be changed
+        if(text_source_busy(-1, inum)) {
+            ino->unlock_write();
+            syscall_close(fd);
+            return E_TXTBSY;
+        }
         ino->entry()->get_write();
         ino->size = 0;
         ino->entry()->put_write();
+        text_cache_invalidate(-1, inum);
         ino->unlock_write();
     }
 
@@ -1507,7 +1721,7 @@ static void memshow() {
         showing = (showing + 1) % NPROC;
         last_switch = ticks;
     }
-    spinlock_guard guard(ptable_lock);
+    rwspinlock_read_guard guard(ptable_lock);
 
     int search = 0;
     while ((!ptable[showing]
@@ -1527,12 +1741,17 @@ static void memshow() {
 }
 
 // tick()
-//    Called once every tick (0.01 sec, 1/HZ) by CPU 0. Updates the `ticks`
-//    counter and performs other periodic maintenance tasks.
+//    Called on every timer interrupt. Brings the `ticks` counter up to
+//    date with `ktime()`; the CPU that advances it performs other periodic
+//    maintenance tasks. Idle CPUs have no tick, so this may be any CPU.
 
 void tick() {
     // Update current time
-    ++ticks;
+    unsigned long t = ktime() / (1000000000 / HZ);
+    unsigned long old = ticks;
+    if (t <= old || !ticks.compare_exchange_strong(old, t)) {
+        return;
+    }
 
     // Update display
     if (consoletype == CONSOLE_MEMVIEWER) {
@@ -1544,8 +1763,9 @@ void tick() {
 
 /**
  * FUTEX
- *  keep a hash table keyed by the address (virtual of physycal?) to find the proper queue data
- *  structure and add the calling process to the wait queue.
+ *  keep a hash table keyed by the physical address to find the proper queue data
+ *  structure and add the calling process to the wait queue. See `k-futex.cc`
+ *  and `sys_futex` in u-lib.hh for the operations.
  *
  * FUTEX_WAIT: the kernel will block only if the futex word has the value that the calling thread supplied
  * as the expected value of the futex word
@@ -1555,65 +1775,51 @@ void tick() {
  *
  */
 
-// TODO: support timeout
-int proc::syscall_futex(uintptr_t uaddr, int futex_op, int val) {
+int proc::syscall_futex(uintptr_t uaddr, int futex_op, int val,
+                        uintptr_t val2, uintptr_t uaddr2, uint32_t val3) {
     // check that 32-bit word at 'uaddr' is valid user space
     if(!is_address_user_accessible(uaddr, 4)) return E_FAULT;
 
     // uaddr must be aligned on a 4 byte boundary
     if(uaddr % 4 != 0) return E_INVAL;
 
-    if(futex_op & FUTEX_WAIT) {
-        // beginning of critical area (loading, comparing, and blocking must be atomic)
-        spinlock_guard guard(ftable.lock_);
-
-        // atomically load the 32-bit word at 'uaddr'
-        // TODO: this is a user address: test that this works
-        std::atomic<int>* uaddr_ = reinterpret_cast<std::atomic<int>*>(uaddr);
-        int actual_val = std::atomic_load(uaddr_);
-
-
-        // if value at 'uaddr' doesn't match 'val', try again
-        if(actual_val != val) return E_AGAIN;
-            
-        // otherwis, we need to block
-
-        // get the wait_queue of processes that care about the futex in 'uaddr'
-        int* kptr = vmiter(this, uaddr).kptr<int*>();
-        wait_queue* wq = ftable.get_wait_queue(kptr);
-
-        // if not found, try allocating a new entry
-        if(!wq) wq = ftable.create_wait_queue(kptr);
-
-        // if failed, instruct caller to try again
-        if(!wq) return E_AGAIN;
-
-        // block until woken up by another thread, which must modify 'actual_val' 
-        waiter().block_until(*wq, [&]() {
-            actual_val = std::atomic_load(uaddr_);
-            return actual_val != val;
-        }, guard);
-
-        // TODO: return EINTR if blocking was interrupted by a signal
-
-        // success
-        return 0;
-    }
-    
-    if(futex_op & FUTEX_WAKE) {
-        // beginning of critical area
-        spinlock_guard guard(ftable.lock_);
-
-        // wake 'val' processes waiting on futex in 'uaddr'
-        int* kptr = vmiter(this, uaddr).kptr<int*>();
-        int awoken = ftable.wake_processes(kptr, val);
-
-        // return number of processes woken up
-        return awoken;
+    int* kptr = vmiter(this, uaddr).kptr<int*>();
+
+    // operations on a second futex
+    int* kptr2 = nullptr;
+    if(futex_op == FUTEX_REQUEUE || futex_op == FUTEX_CMP_REQUEUE
+       || futex_op == FUTEX_WAKE_OP) {
+        if(uaddr2 % 4 != 0) return E_INVAL;
+        // FUTEX_WAKE_OP writes to `uaddr2`
+        int perm = futex_op == FUTEX_WAKE_OP ? PTE_PWU : PTE_P | PTE_U;
+        if(!prepare_user_range(uaddr2, 4, perm)) return E_FAULT;
+        kptr2 = vmiter(this, uaddr2).kptr<int*>();
+    }
+
+    // TODO: return EINTR if blocking was interrupted by a signal
+    switch(futex_op) {
+    case FUTEX_WAIT:
+        return ftable.wait(kptr, val, FUTEX_BITSET_MATCH_ANY, val2);
+    case FUTEX_WAIT_BITSET:
+        if(!val3) return E_INVAL;
+        return ftable.wait(kptr, val, val3, val2);
+    case FUTEX_WAKE:
+        return ftable.wake(kptr, val, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAKE_BITSET:
+        if(!val3) return E_INVAL;
+        return ftable.wake(kptr, val, val3);
+    case FUTEX_REQUEUE:
+        return ftable.requeue(kptr, kptr2, val, val2, nullptr);
+    case FUTEX_CMP_REQUEUE: {
+        int cmpval = val3;
+        return ftable.requeue(kptr, kptr2, val, val2, &cmpval);
+    }
+    case FUTEX_WAKE_OP:
+        return ftable.wake_op(kptr, kptr2, val, val2, val3);
+    default:
+        // futex_op is invalid
+        return E_INVAL;
     }
-
-    // futex_op is invalid
-    return E_INVAL;
 }
 
 int proc::syscall_shmget(int key, size_t size) {
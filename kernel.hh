@@ -3,7 +3,9 @@
 #include "x86-64.h"
 #include "lib.hh"
 #include "k-list.hh"
+#include "k-heap.hh"
 #include "k-lock.hh"
+#include "k-timer.hh"
 #include "k-memrange.hh"
 #include "k-waitstruct.hh"
 #include "k-vfs.hh"
@@ -16,6 +18,8 @@ struct proc_group;
 struct yieldstate;
 struct proc_loader;
 struct elf_program;
+struct page;
+class vmiter;
 struct vnode;
 struct file_descriptor;
 #define PROC_RUNNABLE 1
@@ -46,11 +50,14 @@ struct __attribute__((aligned(4096))) proc {
     std::atomic<bool> interrupted_ = false;    // The process was interrupted while sleeping
     unsigned long resume_count_ = 0;           // How many times the process has resumed
     uintptr_t recent_user_rip_ = 0;            // Most recent user-mode %rip
+    std::atomic<int> cpu_index_ = 0;           // CPU whose run queue holds this
+    uint64_t vruntime_ = 0;                    // TSC cycles run (see `k-cpu.cc`)
+    uint64_t run_start_ = 0;                   // TSC when last charged
 #if HAVE_SANITIZERS
     int sanitizer_status_ = 0;
 #endif
 
-    list_links runq_link_;                     // cpustate::runq link
+    heap_links runq_link_;                     // cpustate::runq link
     list_links link_;                          // proc_group::threads link
 
     proc();
@@ -79,6 +86,7 @@ struct __attribute__((aligned(4096))) proc {
 
     int syscall_alloc(uintptr_t addr, uintptr_t sz);
     int syscall_fork(regstate* regs);
+    int fork_copy(proc* p, regstate* regs);
     void syscall_exit(int status);
     pid_t syscall_getppid(regstate* regs);
     pid_t syscall_waitpid(pid_t pid, int* status, int options);
@@ -98,7 +106,8 @@ struct __attribute__((aligned(4096))) proc {
     void try_close_pipe(file_descriptor* f);
     pid_t syscall_clone(regstate* regs);
     pid_t syscall_texit(int status);
-    int syscall_futex(uintptr_t addr, int futex_op, int val);
+    int syscall_futex(uintptr_t uaddr, int futex_op, int val,
+                      uintptr_t val2, uintptr_t uaddr2, uint32_t val3);
     int syscall_shmget(int key, size_t size);
     uintptr_t syscall_shmat(int shmid, uintptr_t shmaddr);
     int syscall_shmdt(uintptr_t shmaddr);
@@ -109,6 +118,7 @@ struct __attribute__((aligned(4096))) proc {
     int syscall_wildalloc(regstate *regs);
 
     bool is_address_user_accessible(uintptr_t addr, size_t len);
+    bool prepare_user_range(uintptr_t addr, size_t sz, int perm);
 
     void wake();
 
@@ -122,17 +132,55 @@ public:
     int canary = PROC_CANARY;
 };
 
+// orders `cpustate::runq_` by virtual runtime
+struct proc_vruntime_less {
+    bool operator()(const proc* a, const proc* b) const {
+        return a->vruntime_ < b->vruntime_;
+    }
+};
+
 #define NPROC 16
 #define NSEGS 16
 extern proc* ptable[NPROC];
-extern spinlock ptable_lock;
+extern rwspinlock ptable_lock;
 extern proc_group* pgtable[NPROC];
-extern spinlock pgtable_lock;
+extern rwspinlock pgtable_lock;
 extern struct keyboard_console_vnode* kbd_cons_vnode;
 extern futex_table ftable;
 #define PROCSTACK_SIZE 4096UL
 
 
+// program segment loaded on demand (see `proc::load_segment`)
+struct vm_area {
+    uintptr_t va = 0;               // first address of segment
+    uintptr_t end_file = 0;         // end of data loaded from the file
+    uintptr_t end_mem = 0;          // end of segment
+    size_t off = 0;                 // file offset of `va`
+    int mf_index = -1;              // source `memfile::initfs` index, or
+    uint32_t inum = 0;              // source disk file inode number
+    bool writable = false;          // false if pages can be shared
+};
+#define NVMAS 4
+
+// text_source_hold(mf_index, inum), text_source_release(mf_index, inum)
+//    Add or drop a reference that keeps a program file from being written.
+//    `proc_group::set_vmas` manages the references of program segments.
+//    Pass -1 or 0 for the kind of source not involved.
+void text_source_hold(int mf_index, uint32_t inum);
+void text_source_release(int mf_index, uint32_t inum);
+
+// text_source_busy(mf_index, inum)
+//    Return true iff this file has references, so it must not be written
+//    (`E_TXTBSY`). Call with the file's lock held (see `k-proc.cc`).
+bool text_source_busy(int mf_index, uint32_t inum);
+
+// text_cache_invalidate(mf_index, inum)
+//    Forget shared read-only program pages loaded from a file that has
+//    just been changed. Call after the new data is written, so loads in
+//    progress cannot cache old data. Pass -1 or 0 for the kind of source
+//    not involved.
+void text_cache_invalidate(int mf_index, uint32_t inum);
+
 struct shared_mem_segment {
     int ref = 0;            // how many processes referece this segment
     size_t size = 0;        // segment size (at least PAGESIZE)
@@ -161,7 +209,11 @@ struct proc_group {
     // shared memory segments
     shared_mem_segment* sm_segs_[NSEGS] = {nullptr};
 
-    spinlock lock_;                                 // protects pagetable_, sm_segs_
+    // program segments not yet loaded into pagetable_
+    vm_area vmas_[NVMAS];
+    unsigned nvmas_ = 0;
+
+    spinlock lock_;                                 // protects pagetable_, sm_segs_, vmas_
     void init_fd_table();
     void add_proc(proc* p);
     void add_child(proc_group* pg);
@@ -175,16 +227,31 @@ struct proc_group {
     int map_shared_mem_seg_at(int shmid, uintptr_t shmaddr);
     int unmap_shared_mem_seg_at(uintptr_t shmaddr);
     int unmap_all_shared_mem();
+
+    // demand paging and copy-on-write pages
+    void set_vmas(const vm_area* vmas, unsigned n);
+    bool vm_fault(uintptr_t va);
+    bool cow_fault(uintptr_t va);
+    int unshare_cow();
+  private:
+    int cow_copy(vmiter& it);
 };
 
 struct proc_loader {
     x86_64_pagetable* pagetable_;
     uintptr_t entry_rip_ = 0;
+    vm_area vmas_[NVMAS];           // segments to load on demand
+    unsigned nvmas_ = 0;
     inline proc_loader(x86_64_pagetable* pt)
         : pagetable_(pt) {
     }
     virtual ssize_t get_page(uint8_t** pg, size_t off) = 0;
     virtual void put_page() = 0;
+    // Record this loader's source in `vma`; return false if the
+    // program must be loaded eagerly.
+    virtual bool set_source(vm_area&) {
+        return false;
+    }
 };
 
 
@@ -199,13 +266,36 @@ struct __attribute__((aligned(4096))) cpustate {
     int cpuindex_;
     int lapic_id_;
 
-    list<proc, &proc::runq_link_> runq_;
-    spinlock runq_lock_;
+    heap<proc, &proc::runq_link_, proc_vruntime_less> runq_;
+    spinlock runq_lock_{"runq_lock"};
+    std::atomic<unsigned> runq_count_;   // length of `runq_`, read unlocked
+    uint64_t min_vruntime_;              // never decreases; see `k-cpu.cc`
+    static constexpr uint64_t sched_wakeup_credit = 2000000;  // TSC cycles
+    uint64_t next_balance_;              // `ktime` of next `balance`
+    static constexpr uint64_t balance_interval_ns = 100000000;
+
+    // kernel timers (see `k-timer.cc`)
+    heap<ktimer, &ktimer::link_, ktimer_less> timers_;
+    spinlock timer_lock_{"timer_lock"};  // protects `timers_`, `timer_deadline_`
+    uint64_t timer_deadline_;            // when the LAPIC timer will fire
+    std::atomic<bool> tickless_;         // idle and halted without a tick
     unsigned long nschedule_;
     proc* idle_task_;
 
     unsigned spinlock_depth_;
 
+    // per-CPU cache of free single pages (see `k-alloc.cc`)
+    static constexpr unsigned pagecache_capacity = 32;
+    static constexpr unsigned pagecache_batch = 16;
+    page* pagecache_[pagecache_capacity];
+    unsigned pagecache_count_;
+    unsigned long pagecache_hits_;
+    unsigned long pagecache_misses_;
+
+    // per-CPU active slab for each `kmalloc` size class
+    static constexpr int slab_nclasses = 8;
+    page* slab_active_[slab_nclasses];
+
     uint64_t gdt_segments_[7];
     x86_64_taskstate taskstate_;
 
@@ -226,12 +316,23 @@ struct __attribute__((aligned(4096))) cpustate {
     void enqueue(proc* p);
     [[noreturn]] void schedule(proc* yielding_from);
 
+    void balance();
+    bool should_preempt();
+
+    void run_timers();
+    void program_timer(uint64_t now);
+    void idle_halt();
+    void kick();
+
     void enable_irq(int irqno);
     void disable_irq(int irqno);
 
  private:
     void init_cpu_hardware();
     void init_idle_task();
+    proc* steal(unsigned min_count);
+    void account(proc* p);
+    void restart_tick();
 };
 
 #define MAXCPU 16
@@ -282,16 +383,16 @@ extern std::atomic<unsigned long> ticks;        // number of ticks since boot
 #define SEGSEL_TASKSTATE        0x28            // task state segment
 
 
-// Physical memory size
+// Minimum physical memory size (the real size is found at boot)
 #define MEMSIZE_PHYSICAL        0x200000
 // Virtual memory size
 #define MEMSIZE_VIRTUAL         0x300000
-// Number of pages in physical memory
-// TODO: define it in terms of other constants
-#define PAGES_COUNT 512
+// Page table entry bit marking a read-only copy-on-write user page
+#define PTE_COW                 PTE_OS1
+// Buddy allocator block orders: blocks hold 2^MIN_ORDER to 2^MAX_ORDER bytes
 #define MIN_ORDER 12
-#define MAX_ORDER 21
-#define ORDER_COUNT 10
+#define MAX_ORDER 30
+#define ORDER_COUNT (MAX_ORDER - MIN_ORDER + 1)
 
 enum memtype_t {
     mem_nonexistent = 0,
@@ -399,19 +500,43 @@ inline T read_unaligned(const uint8_t* ptr, T (U::* member)) {
 }
 
 
-// kalloc(sz)
+// kalloc(sz, flags)
 //    Allocate and return a pointer to at least `sz` contiguous bytes
 //    of memory. Returns `nullptr` if `sz == 0` or on failure.
 //
 //    If `sz` is a multiple of `PAGESIZE`, the returned pointer is guaranteed
 //    to be page-aligned.
-void* kalloc(size_t sz) __attribute__((malloc));
+//
+//    `flags` says how to initialize the memory: `KALLOC_POISON` (the
+//    default) fills it with 0xCC, `KALLOC_ZERO` with zeros, and
+//    `KALLOC_NOFILL` leaves it uninitialized, for callers that overwrite
+//    it anyway. Zeroed single pages come from a pool that idle CPUs fill.
+#define KALLOC_POISON   0
+#define KALLOC_NOFILL   1
+#define KALLOC_ZERO     2
+void* kalloc(size_t sz, int flags = KALLOC_POISON) __attribute__((malloc));
+
+// kmalloc(sz)
+//    Allocate and return a pointer to at least `sz` bytes of memory.
+//    Requests of up to `KMALLOC_MAX` bytes are carved from per-size-class
+//    slabs; larger requests are passed to `kalloc`. The result is aligned
+//    to its size class (at least 16 bytes). `flags` are as for `kalloc`.
+//    Free the result with `kfree`.
+#define KMALLOC_MAX 2048
+void* kmalloc(size_t sz, int flags = KALLOC_POISON) __attribute__((malloc));
 
 // kfree(ptr)
-//    Free a pointer previously returned by `kalloc`. Does nothing if
-//    `ptr == nullptr`.
+//    Free a pointer previously returned by `kalloc` or `kmalloc`. Does
+//    nothing if `ptr == nullptr`.
 void kfree(void* ptr);
 
+// kref(ptr), krefcount(ptr)
+//    Add a reference to, or count references to, a block returned by
+//    `kalloc`. A block starts with one reference; `kfree` drops one and
+//    frees the block when the last is dropped. Used to share pages.
+void kref(void* ptr);
+unsigned krefcount(void* ptr);
+
 // kfree_mem(pt, pg)
 //    Free user-accessible memory of pagetable 'pt'
 void kfree_mem(x86_64_pagetable* pt, proc_group* pg);
@@ -426,7 +551,7 @@ void kfree_pagetable(x86_64_pagetable* pagetable);
 
 // operator new, operator delete
 //    Expressions like `new (std::nothrow) T(...)` and `delete x` work,
-//    and call kalloc/kfree.
+//    and call kmalloc/kfree.
 void* operator new(size_t sz, const std::nothrow_t&) noexcept;
 void* operator new(size_t sz, std::align_val_t al, const std::nothrow_t&) noexcept;
 void* operator new[](size_t sz, const std::nothrow_t&) noexcept;
@@ -451,6 +576,22 @@ inline __attribute__((malloc)) T* knew(Args&&... args) {
     return new (std::nothrow) T(std::forward<Args>(args)...);
 }
 
+// refill_zero_pages()
+//    Zero one free page and add it to the pool used by
+//    `kalloc(PAGESIZE, KALLOC_ZERO)`. Returns false if the pool is full or
+//    memory is short. Called by idle tasks.
+bool refill_zero_pages();
+
+// log_kalloc_stats()
+//    Print page cache and slab statistics to the log.
+void log_kalloc_stats();
+
+// log_lockstats()
+//    Print contention statistics for named spinlocks to the log, most
+//    contended first. Returns the number of locks printed, or `E_NOSYS`
+//    if the kernel was built without `LOCKSTAT=1`.
+int log_lockstats();
+
 // init_kalloc
 //    Initialize stuff needed by `kalloc`. Called from `init_hardware`,
 //    after `physical_ranges` is initialized.
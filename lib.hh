@@ -294,6 +294,7 @@ struct bitset_view {
 #define SYSCALL_SHMGET      138
 #define SYSCALL_SHMAT       139
 #define SYSCALL_SHMDT       140
+#define SYSCALL_LOCKSTATS   141
 
 // System call error return values
 
@@ -319,6 +320,7 @@ struct bitset_view {
 #define E_RANGE -34       // Out of range
 #define E_SPIPE -29       // Illegal seek
 #define E_SRCH -3         // No such process
+#define E_TIMEDOUT -110   // Timed out
 #define E_TXTBSY -26      // Text file busy
 #define E_2BIG -7         // Argument list too long
 
@@ -347,9 +349,34 @@ inline bool is_error(uintptr_t r)
 #define LSEEK_END 2  // Seek from end of file
 #define LSEEK_SIZE 3 // Do not seek; return file size
 
-// sys_futex() flags
+// sys_futex() operations
 #define FUTEX_WAIT 1
 #define FUTEX_WAKE 2
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAKE_OP 5
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAKE_BITSET 10
+
+#define FUTEX_BITSET_MATCH_ANY 0xFFFFFFFFU
+
+// FUTEX_WAKE_OP operations and comparisons, as on Linux.
+// `FUTEX_OP(op, oparg, cmp, cmparg)` builds the `val3` argument.
+#define FUTEX_OP_SET 0              // *uaddr2 = oparg
+#define FUTEX_OP_ADD 1              // *uaddr2 += oparg
+#define FUTEX_OP_OR 2               // *uaddr2 |= oparg
+#define FUTEX_OP_ANDN 3             // *uaddr2 &= ~oparg
+#define FUTEX_OP_XOR 4              // *uaddr2 ^= oparg
+#define FUTEX_OP_OPARG_SHIFT 8      // use (1 << oparg) as operand
+#define FUTEX_OP_CMP_EQ 0           // wake uaddr2 if old == cmparg
+#define FUTEX_OP_CMP_NE 1           // ... if old != cmparg
+#define FUTEX_OP_CMP_LT 2           // ... if old < cmparg
+#define FUTEX_OP_CMP_LE 3           // ... if old <= cmparg
+#define FUTEX_OP_CMP_GT 4           // ... if old > cmparg
+#define FUTEX_OP_CMP_GE 5           // ... if old >= cmparg
+#define FUTEX_OP(op, oparg, cmp, cmparg) \
+    ((((op) & 0xF) << 28) | (((cmp) & 0xF) << 24) \
+     | (((oparg) & 0xFFF) << 12) | ((cmparg) & 0xFFF))
 
 // shared memory flags
 #define IPC_PRIVATE 50        // careful: must be greater than NSEGS
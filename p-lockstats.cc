@@ -0,0 +1,43 @@
+#include "u-lib.hh"
+
+// p-lockstats
+//    Put some load on the kernel's shared locks, then write spinlock
+//    contention statistics to `log.txt`. Needs a kernel built with
+//    `make LOCKSTAT=1`.
+
+void process_main() {
+    for (int i = 0; i < 4; ++i) {
+        pid_t child = sys_fork();
+        assert_ge(child, 0);
+        if (child == 0) {
+            // page allocation, process table, and buffer cache traffic
+            for (int j = 0; j < 20; ++j) {
+                pid_t grandchild = sys_fork();
+                assert_ge(grandchild, 0);
+                if (grandchild == 0) {
+                    char buf[128];
+                    int fd = sys_open("emerson.txt", OF_READ);
+                    if (fd >= 0) {
+                        while (sys_read(fd, buf, sizeof(buf)) > 0) {
+                        }
+                        sys_close(fd);
+                    }
+                    sys_exit(0);
+                }
+                sys_waitpid(grandchild);
+            }
+            sys_exit(0);
+        }
+    }
+    while (sys_waitpid(0) > 0) {
+    }
+
+    int n = sys_lockstats();
+    if (n == E_NOSYS) {
+        console_printf("lockstats: rebuild with `make LOCKSTAT=1`\n");
+    } else {
+        assert_ge(n, 0);
+        console_printf("lockstats: %d locks written to log.txt\n", n);
+    }
+    sys_exit(0);
+}
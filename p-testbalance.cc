@@ -0,0 +1,84 @@
+#include "u-lib.hh"
+#include <atomic>
+
+// p-testbalance
+//    Tests that processes keep running correctly while idle CPUs steal
+//    them and the timer tick rebalances run queues. Groups of CPU-bound
+//    and sleeping processes start together; short ones finish early and
+//    leave their CPUs idle, so the long ones migrate. Every process must
+//    finish with all of its work done.
+
+extern uint8_t end[];
+
+static constexpr int nchildren = 10;
+static constexpr int nrounds = 3;
+
+struct shared_state {
+    std::atomic<int> started;
+    std::atomic<unsigned long> work[nchildren];
+};
+static shared_state* shared;
+
+// child_main(i)
+//    Child `i` spins for a time that grows with `i`; odd children also
+//    sleep now and then, so they block and wake while others migrate.
+static void child_main(int i) {
+    ++shared->started;
+    unsigned long n = 200000UL * (i + 1);
+    for (unsigned long k = 0; k != n; ++k) {
+        ++shared->work[i];
+        if (i % 2 == 1 && k % 50000 == 0) {
+            int r = sys_msleep(10);
+            assert_eq(r, 0);
+        }
+    }
+    sys_exit(i);
+}
+
+void process_main() {
+    int shmid = shmget(IPC_PRIVATE);
+    assert_ge(shmid, 0);
+    void* addr = reinterpret_cast<void*>(
+        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+    );
+    void* shmaddr = shmat(shmid, addr);
+    assert_eq(shmaddr, addr);
+    shared = reinterpret_cast<shared_state*>(shmaddr);
+
+    for (int round = 0; round != nrounds; ++round) {
+        shared->started = 0;
+        for (int i = 0; i != nchildren; ++i) {
+            shared->work[i] = 0;
+        }
+
+        pid_t pids[nchildren];
+        for (int i = 0; i != nchildren; ++i) {
+            pids[i] = sys_fork();
+            assert_ge(pids[i], 0);
+            if (pids[i] == 0) {
+                child_main(i);
+            }
+        }
+
+        // collect children in the order they finish
+        bool done[nchildren] = {};
+        for (int n = 0; n != nchildren; ++n) {
+            int status;
+            pid_t ch = sys_waitpid(0, &status);
+            assert_gt(ch, 0);
+            assert(status >= 0 && status < nchildren);
+            assert_eq(pids[status], ch);
+            assert(!done[status]);
+            done[status] = true;
+        }
+
+        assert_eq(shared->started.load(), nchildren);
+        for (int i = 0; i != nchildren; ++i) {
+            assert_eq(shared->work[i].load(), 200000UL * (i + 1));
+        }
+        console_printf("round %d: %d processes finished\n", round, nchildren);
+    }
+
+    console_printf("testbalance succeeded.\n");
+    sys_exit(0);
+}
@@ -0,0 +1,132 @@
+#include "u-lib.hh"
+
+// p-testbufcache
+//    Tests that file data survives the buffer cache's background
+//    writeback, `sync`, eviction, and shrinking when memory runs out.
+
+extern uint8_t end[];
+
+static constexpr unsigned nblocks = 64;
+static constexpr size_t blocksize = 4096;
+static char buf[blocksize];
+static char rbuf[blocksize];
+
+// fill_block(i, gen)
+//    Fill `buf` with the contents of block `i` for generation `gen`.
+static void fill_block(unsigned i, unsigned gen) {
+    memset(buf, 'a' + (i + gen) % 26, blocksize);
+    snprintf(buf, 32, "block %u gen %u\n", i, gen);
+}
+
+static void write_file(unsigned gen) {
+    int f = sys_open("bctest.txt", OF_WRITE | OF_CREATE);
+    assert_gt(f, 2);
+    for (unsigned i = 0; i != nblocks; ++i) {
+        fill_block(i, gen);
+        ssize_t n = sys_write(f, buf, blocksize);
+        assert_eq(n, ssize_t(blocksize));
+    }
+    sys_close(f);
+}
+
+static void check_file(unsigned gen) {
+    int f = sys_open("bctest.txt", OF_READ);
+    assert_gt(f, 2);
+    for (unsigned i = 0; i != nblocks; ++i) {
+        ssize_t n = sys_read(f, rbuf, blocksize);
+        assert_eq(n, ssize_t(blocksize));
+        fill_block(i, gen);
+        assert_memeq(rbuf, buf, blocksize);
+    }
+    assert_eq(sys_read(f, rbuf, blocksize), 0);
+    sys_close(f);
+}
+
+
+void process_main() {
+    printf("Starting testbufcache (assuming clean file system)...\n");
+
+    // written data is visible from the cache, and from disk after `sync`
+    printf("%s:%d: write and sync...\n", __FILE__, __LINE__);
+    write_file(1);
+    check_file(1);
+    int r = sys_sync(1);
+    assert_ge(r, 0);
+    check_file(1);
+
+
+    // `sync` waits for blocks the writeback task already took
+    printf("%s:%d: sync during writeback...\n", __FILE__, __LINE__);
+    write_file(2);
+    // dirty blocks expire after a second; writeback runs every 250ms
+    sys_msleep(1100);
+    r = sys_sync(1);
+    assert_ge(r, 0);
+    check_file(2);
+
+    write_file(3);
+    sys_msleep(2000);
+    r = sys_sync(1);
+    assert_ge(r, 0);
+    check_file(3);
+
+
+    // when memory runs out, the cache shrinks without losing dirty
+    // blocks, and further writes evict and write back
+    printf("%s:%d: memory pressure...\n", __FILE__, __LINE__);
+    write_file(4);
+
+    int to_child[2], to_parent[2];
+    r = sys_pipe(to_child);
+    assert_eq(r, 0);
+    r = sys_pipe(to_parent);
+    assert_eq(r, 0);
+
+    pid_t p = sys_fork();
+    assert_ge(p, 0);
+    if (p == 0) {
+        // copy the pages the parent will write, so the parent needs no
+        // memory for copy-on-write while this child holds all of it
+        memset(buf, 0, blocksize);
+        memset(rbuf, 0, blocksize);
+
+        // allocate pages until `kalloc` fails
+        uintptr_t heap = round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE);
+        unsigned nalloc = 0;
+        while (sys_page_alloc(reinterpret_cast<void*>(heap)) == 0) {
+            heap += PAGESIZE;
+            ++nalloc;
+        }
+        assert_gt(nalloc, 0U);
+        ssize_t n = sys_write(to_parent[1], "!", 1);
+        assert_eq(n, 1);
+        // hold the memory until the parent is done
+        char ch;
+        n = sys_read(to_child[0], &ch, 1);
+        assert_eq(n, 1);
+        sys_exit(0);
+    }
+
+    char ch;
+    ssize_t n = sys_read(to_parent[0], &ch, 1);
+    assert_eq(n, 1);
+    check_file(4);
+    write_file(5);
+    check_file(5);
+    n = sys_write(to_child[1], "!", 1);
+    assert_eq(n, 1);
+
+    pid_t ch_pid = sys_waitpid(p);
+    assert_eq(ch_pid, p);
+    r = sys_sync(1);
+    assert_ge(r, 0);
+    check_file(5);
+
+    sys_close(to_child[0]);
+    sys_close(to_child[1]);
+    sys_close(to_parent[0]);
+    sys_close(to_parent[1]);
+
+    printf("testbufcache succeeded.\n");
+    sys_exit(0);
+}
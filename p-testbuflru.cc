@@ -0,0 +1,75 @@
+#include "u-lib.hh"
+
+// p-testbuflru
+//    Tests buffer cache lookups. Several files' blocks are read in
+//    shuffled order, again and again, so lookups hit blocks all over the
+//    cache's index and keep reordering its LRU list; dropping the cache
+//    between rounds removes every entry. Every read must return the
+//    right data.
+
+static constexpr int nfiles = 3;
+static constexpr unsigned nblocks = 40;
+static constexpr size_t blocksize = 4096;
+static const char* const names[nfiles] = {
+    "lrutest0.txt", "lrutest1.txt", "lrutest2.txt"
+};
+static char buf[blocksize];
+static char rbuf[blocksize];
+
+// fill_block(f, i)
+//    Fill `buf` with the contents of block `i` of file `f`.
+static void fill_block(int f, unsigned i) {
+    memset(buf, 'A' + (f * 7 + i) % 26, blocksize);
+    snprintf(buf, 32, "file %d block %u\n", f, i);
+}
+
+static void check_block(int fd, int f, unsigned i) {
+    ssize_t r = sys_lseek(fd, i * blocksize, LSEEK_SET);
+    assert_eq(r, ssize_t(i * blocksize));
+    ssize_t n = sys_read(fd, rbuf, blocksize);
+    assert_eq(n, ssize_t(blocksize));
+    fill_block(f, i);
+    assert_memeq(rbuf, buf, blocksize);
+}
+
+
+void process_main() {
+    printf("Starting testbuflru (assuming clean file system)...\n");
+
+    int fds[nfiles];
+    for (int f = 0; f != nfiles; ++f) {
+        fds[f] = sys_open(names[f], OF_READ | OF_WRITE | OF_CREATE);
+        assert_gt(fds[f], 2);
+        for (unsigned i = 0; i != nblocks; ++i) {
+            fill_block(f, i);
+            ssize_t n = sys_write(fds[f], buf, blocksize);
+            assert_eq(n, ssize_t(blocksize));
+        }
+    }
+    int r = sys_sync(0);
+    assert_ge(r, 0);
+
+    for (int round = 0; round != 4; ++round) {
+        if (round % 2 == 1) {
+            r = sys_sync(1);
+            assert_ge(r, 0);
+        }
+        // a hot block, read between every other lookup
+        for (unsigned k = 0; k != nfiles * nblocks; ++k) {
+            unsigned x = rand(0, nfiles * nblocks - 1);
+            check_block(fds[x % nfiles], x % nfiles, x / nfiles);
+            check_block(fds[0], 0, round);
+        }
+        // then every block once, in reverse
+        for (unsigned x = nfiles * nblocks; x != 0; --x) {
+            check_block(fds[(x - 1) % nfiles], (x - 1) % nfiles,
+                        (x - 1) / nfiles);
+        }
+    }
+
+    for (int f = 0; f != nfiles; ++f) {
+        sys_close(fds[f]);
+    }
+    printf("testbuflru succeeded.\n");
+    sys_exit(0);
+}
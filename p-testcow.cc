@@ -0,0 +1,174 @@
+#include "u-lib.hh"
+#include <atomic>
+
+// p-testcow
+//    Tests copy-on-write fork: parent and child write the same data,
+//    stack, and heap pages and see only their own writes; the kernel
+//    writes into copy-on-write pages for `read` and `waitpid`; and a
+//    thread cloned after fork shares the child's writes but not the
+//    parent's.
+
+extern uint8_t end[];
+
+int global = 1;
+// each gets a page of its own, so no user write un-shares it first
+alignas(PAGESIZE) char readbuf[PAGESIZE] = "original";
+alignas(PAGESIZE) int status[PAGESIZE / sizeof(int)] = {-1};
+
+static char* heap_page() {
+    return reinterpret_cast<char*>(
+        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE) + 8 * PAGESIZE
+    );
+}
+
+// notify(fd), await(fd)
+//    Hand control to the other process through a pipe.
+static void notify(int fd) {
+    ssize_t n = sys_write(fd, "!", 1);
+    assert_eq(n, 1);
+}
+
+static void await(int fd) {
+    char ch;
+    ssize_t n = sys_read(fd, &ch, 1);
+    assert_eq(n, 1);
+    assert_eq(ch, '!');
+}
+
+
+static void test_private_writes() {
+    char* heap = heap_page();
+    int r = sys_page_alloc(heap);
+    assert_eq(r, 0);
+    strcpy(heap, "heap");
+    int stack = 1;
+    // fault in the data page, so fork shares it
+    assert_eq(global, 1);
+
+    int to_child[2], to_parent[2];
+    r = sys_pipe(to_child);
+    assert_eq(r, 0);
+    r = sys_pipe(to_parent);
+    assert_eq(r, 0);
+
+    pid_t p = sys_fork();
+    assert_ge(p, 0);
+    if (p == 0) {
+        // child writes first...
+        global = 2;
+        stack = 2;
+        strcpy(heap, "child");
+        notify(to_parent[1]);
+        // ...and keeps its values after the parent writes
+        await(to_child[0]);
+        assert_eq(global, 2);
+        assert_eq(stack, 2);
+        assert_memeq(heap, "child", 6);
+        sys_exit(0);
+    }
+
+    // parent does not see the child's writes
+    await(to_parent[0]);
+    assert_eq(global, 1);
+    assert_eq(stack, 1);
+    assert_memeq(heap, "heap", 5);
+    global = 3;
+    stack = 3;
+    strcpy(heap, "parent");
+    notify(to_child[1]);
+
+    pid_t ch = sys_waitpid(p);
+    assert_eq(ch, p);
+    assert_eq(global, 3);
+    assert_eq(stack, 3);
+    assert_memeq(heap, "parent", 7);
+
+    sys_close(to_child[0]);
+    sys_close(to_child[1]);
+    sys_close(to_parent[0]);
+    sys_close(to_parent[1]);
+    console_printf("fork writes are private\n");
+}
+
+
+static void test_kernel_writes() {
+    // fault in the pages, so fork shares them
+    assert_memeq(readbuf, "original", 9);
+    assert_eq(status[0], -1);
+
+    int pfd[2];
+    int r = sys_pipe(pfd);
+    assert_eq(r, 0);
+
+    pid_t p = sys_fork();
+    assert_ge(p, 0);
+    if (p == 0) {
+        ssize_t n = sys_write(pfd[1], "from child", 10);
+        assert_eq(n, 10);
+        // wait until the parent's read has copied its page
+        sys_msleep(100);
+        assert_memeq(readbuf, "original", 9);
+        sys_exit(77);
+    }
+
+    // `read` and `waitpid` store into pages still shared with the child
+    ssize_t n = sys_read(pfd[0], readbuf, 10);
+    assert_eq(n, 10);
+    assert_memeq(readbuf, "from child", 10);
+
+    pid_t ch = sys_waitpid(p, &status[0]);
+    assert_eq(ch, p);
+    assert_eq(status[0], 77);
+
+    sys_close(pfd[0]);
+    sys_close(pfd[1]);
+    console_printf("kernel writes to copy-on-write pages\n");
+}
+
+
+std::atomic<int> thread_done;
+
+static int thread_function(void*) {
+    global = 5;
+    thread_done = 1;
+    sys_texit(0);
+}
+
+static void test_clone_after_fork() {
+    global = 4;
+    pid_t p = sys_fork();
+    assert_ge(p, 0);
+    if (p == 0) {
+        // the thread's write is visible to the child's main thread
+        char* stack = reinterpret_cast<char*>(
+            round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+            + 16 * PAGESIZE
+        );
+        int r = sys_page_alloc(stack);
+        assert_eq(r, 0);
+        pid_t t = sys_clone(thread_function, nullptr, stack + PAGESIZE);
+        assert_gt(t, 0);
+        while (!thread_done) {
+            sys_yield();
+        }
+        assert_eq(global, 5);
+        sys_exit(0);
+    }
+
+    // but not to the parent
+    pid_t ch = sys_waitpid(p);
+    assert_eq(ch, p);
+    assert_eq(global, 4);
+    assert_eq(thread_done.load(), 0);
+    console_printf("threads share the child's copies\n");
+}
+
+
+void process_main() {
+    test_private_writes();
+    test_kernel_writes();
+    test_clone_after_fork();
+
+    console_printf("testcow succeeded.\n");
+    sys_exit(0);
+}
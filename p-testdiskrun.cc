@@ -0,0 +1,97 @@
+#include "u-lib.hh"
+
+// p-testdiskrun
+//    Tests multi-block disk transfers. A file is written with large
+//    writes, so its blocks form long extents; `sync` flushes them as
+//    runs of blocks, and reads from an empty cache load them as runs.
+//    Reads of every size, aligned or not, must return the right data,
+//    including after part of the file is overwritten.
+
+static constexpr unsigned nblocks = 96;
+static constexpr size_t blocksize = 4096;
+static constexpr size_t filesize = nblocks * blocksize;
+static constexpr size_t chunk = 16 * blocksize;
+static char buf[chunk];
+static char rbuf[chunk];
+
+// byte_at(off, gen)
+//    Return the byte at file offset `off` for generation `gen`.
+static char byte_at(size_t off, unsigned gen) {
+    return 'a' + (off / 97 + off / blocksize + gen) % 26;
+}
+
+static void fill(size_t off, size_t sz, unsigned gen) {
+    for (size_t i = 0; i != sz; ++i) {
+        buf[i] = byte_at(off + i, gen);
+    }
+}
+
+// check_file(readsz, gen_of)
+//    Read the whole file `readsz` bytes at a time and check that block
+//    `b` holds generation `gen_of(b)`.
+static void check_file(size_t readsz, unsigned (*gen_of)(size_t)) {
+    int fd = sys_open("runtest.txt", OF_READ);
+    assert_gt(fd, 2);
+    size_t off = 0;
+    while (off < filesize) {
+        size_t want = min(readsz, filesize - off);
+        ssize_t n = sys_read(fd, rbuf, want);
+        assert_eq(n, ssize_t(want));
+        for (size_t i = 0; i != want; ++i) {
+            assert_eq(rbuf[i], byte_at(off + i, gen_of((off + i) / blocksize)));
+        }
+        off += want;
+    }
+    assert_eq(sys_read(fd, rbuf, 1), 0);
+    sys_close(fd);
+}
+
+static unsigned first_gen(size_t) {
+    return 0;
+}
+
+static unsigned second_gen(size_t b) {
+    return b >= 20 && b < 52 ? 1 : 0;
+}
+
+
+void process_main() {
+    printf("Starting testdiskrun (assuming clean file system)...\n");
+
+    int fd = sys_open("runtest.txt", OF_WRITE | OF_CREATE);
+    assert_gt(fd, 2);
+    for (size_t off = 0; off < filesize; off += chunk) {
+        fill(off, chunk, 0);
+        ssize_t n = sys_write(fd, buf, chunk);
+        assert_eq(n, ssize_t(chunk));
+    }
+    sys_close(fd);
+
+    // runs are flushed, then loaded, with reads of several sizes
+    const size_t readszs[] = { chunk, blocksize, 5000, 100, 3 * blocksize + 1 };
+    for (size_t readsz : readszs) {
+        int r = sys_sync(1);
+        assert_ge(r, 0);
+        check_file(readsz, first_gen);
+    }
+
+    // overwrite blocks 20-51, which span extents, and flush again
+    fd = sys_open("runtest.txt", OF_WRITE);
+    assert_gt(fd, 2);
+    ssize_t r = sys_lseek(fd, 20 * blocksize, LSEEK_SET);
+    assert_eq(r, ssize_t(20 * blocksize));
+    for (size_t b = 20; b < 52; b += 8) {
+        fill(b * blocksize, 8 * blocksize, 1);
+        ssize_t n = sys_write(fd, buf, 8 * blocksize);
+        assert_eq(n, ssize_t(8 * blocksize));
+    }
+    sys_close(fd);
+    check_file(chunk, second_gen);
+    int s = sys_sync(1);
+    assert_ge(s, 0);
+    check_file(chunk, second_gen);
+    check_file(7000, second_gen);
+
+    printf("testdiskrun succeeded.\n");
+    sys_exit(0);
+}
@@ -0,0 +1,103 @@
+#include "u-lib.hh"
+
+// p-testelevator
+//    Tests the disk request queue. Several processes read, and then
+//    overwrite, interleaved blocks of one file at once, so requests for
+//    adjacent sectors arrive together and are merged and reordered in
+//    the queue. Every read must return the right data, and the file
+//    must read back correctly after the writes reach the disk.
+
+static constexpr int nworkers = 4;
+static constexpr unsigned nblocks = 64;
+static constexpr size_t blocksize = 4096;
+static char buf[blocksize];
+static char rbuf[blocksize];
+
+// fill_block(i, gen)
+//    Fill `buf` with the contents of block `i` for generation `gen`.
+static void fill_block(unsigned i, unsigned gen) {
+    memset(buf, 'a' + (i + gen * 3) % 26, blocksize);
+    snprintf(buf, 32, "block %u gen %u\n", i, gen);
+}
+
+static void check_file(unsigned gen) {
+    int fd = sys_open("elevtest.txt", OF_READ);
+    assert_gt(fd, 2);
+    for (unsigned i = 0; i != nblocks; ++i) {
+        ssize_t n = sys_read(fd, rbuf, blocksize);
+        assert_eq(n, ssize_t(blocksize));
+        fill_block(i, gen);
+        assert_memeq(rbuf, buf, blocksize);
+    }
+    sys_close(fd);
+}
+
+// worker(w)
+//    Read blocks `w`, `w + nworkers`, ... of generation 1, then
+//    overwrite them with generation 2.
+static void worker(int w) {
+    int fd = sys_open("elevtest.txt", OF_READ | OF_WRITE);
+    assert_gt(fd, 2);
+    for (unsigned i = w; i < nblocks; i += nworkers) {
+        ssize_t r = sys_lseek(fd, i * blocksize, LSEEK_SET);
+        assert_eq(r, ssize_t(i * blocksize));
+        ssize_t n = sys_read(fd, rbuf, blocksize);
+        assert_eq(n, ssize_t(blocksize));
+        fill_block(i, 1);
+        assert_memeq(rbuf, buf, blocksize);
+    }
+    for (unsigned i = w; i < nblocks; i += nworkers) {
+        ssize_t r = sys_lseek(fd, i * blocksize, LSEEK_SET);
+        assert_eq(r, ssize_t(i * blocksize));
+        fill_block(i, 2);
+        ssize_t n = sys_write(fd, buf, blocksize);
+        assert_eq(n, ssize_t(blocksize));
+    }
+    sys_close(fd);
+    sys_exit(0);
+}
+
+static void run_workers() {
+    pid_t pids[nworkers];
+    for (int w = 0; w != nworkers; ++w) {
+        pids[w] = sys_fork();
+        assert_ge(pids[w], 0);
+        if (pids[w] == 0) {
+            worker(w);
+        }
+    }
+    for (int w = 0; w != nworkers; ++w) {
+        int status = -1;
+        pid_t ch = sys_waitpid(pids[w], &status);
+        assert_eq(ch, pids[w]);
+        assert_eq(status, 0);
+    }
+}
+
+
+void process_main() {
+    printf("Starting testelevator (assuming clean file system)...\n");
+
+    int fd = sys_open("elevtest.txt", OF_WRITE | OF_CREATE);
+    assert_gt(fd, 2);
+    for (unsigned i = 0; i != nblocks; ++i) {
+        fill_block(i, 1);
+        ssize_t n = sys_write(fd, buf, blocksize);
+        assert_eq(n, ssize_t(blocksize));
+    }
+    sys_close(fd);
+    int r = sys_sync(1);
+    assert_ge(r, 0);
+
+    // interleaved reads from an empty cache, then interleaved writes
+    run_workers();
+    check_file(2);
+
+    // the writes reach the disk together
+    r = sys_sync(1);
+    assert_ge(r, 0);
+    check_file(2);
+
+    printf("testelevator succeeded.\n");
+    sys_exit(0);
+}
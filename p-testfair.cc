@@ -0,0 +1,78 @@
+#include "u-lib.hh"
+#include <atomic>
+
+// p-testfair
+//    Tests that the scheduler shares the CPUs fairly. Several CPU-bound
+//    processes spin for a second, counting iterations; the least served
+//    must get a good fraction of the most served's share. A process that
+//    sleeps briefly in a loop must still wake up and run promptly.
+
+extern uint8_t end[];
+
+static constexpr int nspinners = 6;
+
+struct shared_state {
+    std::atomic<int> stop;
+    std::atomic<int> nsleeps;
+    // one cache line per counter
+    struct alignas(64) counter {
+        std::atomic<unsigned long> n;
+    } count[nspinners];
+};
+static shared_state* shared;
+
+void process_main() {
+    int shmid = shmget(IPC_PRIVATE);
+    assert_ge(shmid, 0);
+    void* addr = reinterpret_cast<void*>(
+        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+    );
+    void* shmaddr = shmat(shmid, addr);
+    assert_eq(shmaddr, addr);
+    shared = reinterpret_cast<shared_state*>(shmaddr);
+
+    for (int i = 0; i != nspinners; ++i) {
+        pid_t p = sys_fork();
+        assert_ge(p, 0);
+        if (p == 0) {
+            while (!shared->stop) {
+                shared->count[i].n.fetch_add(1, std::memory_order_relaxed);
+            }
+            sys_exit(0);
+        }
+    }
+
+    pid_t sleeper = sys_fork();
+    assert_ge(sleeper, 0);
+    if (sleeper == 0) {
+        while (!shared->stop) {
+            int r = sys_msleep(5);
+            assert_eq(r, 0);
+            ++shared->nsleeps;
+        }
+        sys_exit(0);
+    }
+
+    int r = sys_msleep(1000);
+    assert_eq(r, 0);
+    shared->stop = 1;
+    for (int i = 0; i != nspinners + 1; ++i) {
+        pid_t ch = sys_waitpid(0);
+        assert_gt(ch, 0);
+    }
+
+    unsigned long min_n = shared->count[0].n, max_n = min_n;
+    for (int i = 1; i != nspinners; ++i) {
+        min_n = min(min_n, shared->count[i].n.load());
+        max_n = max(max_n, shared->count[i].n.load());
+    }
+    console_printf("spinners: %lu to %lu iterations; sleeper: %d sleeps\n",
+                   min_n, max_n, shared->nsleeps.load());
+    assert_gt(min_n, 0UL);
+    assert_ge(min_n, max_n / 3);
+    // 5ms sleeps for one second; allow for ticks and wakeup latency
+    assert_ge(shared->nsleeps.load(), 20);
+
+    console_printf("testfair succeeded.\n");
+    sys_exit(0);
+}
@@ -0,0 +1,143 @@
+#include "u-lib.hh"
+#include <atomic>
+
+// p-testfutexhash
+//    Tests the hashed futex table. Threads wait on many futex words
+//    spread over several pages, so words share buckets; waking one word
+//    must wake exactly its own waiter and report no waiters for idle
+//    words. Repeated rounds on fresh words reuse idle table entries.
+//    Finally, a forked child waits on a shared memory word that its
+//    parent wakes through its own page table, so futexes are matched by
+//    physical address.
+
+extern uint8_t end[];
+
+static constexpr int nthreads = 8;
+static constexpr int nrounds = 4;
+static constexpr int words_per_page = PAGESIZE / sizeof(int);
+
+// three pages of futex words
+alignas(PAGESIZE) std::atomic<int> words[3 * words_per_page];
+std::atomic<int>* waiting_on[nthreads];
+std::atomic<int> nready;
+std::atomic<int> nwoken;
+std::atomic<int> woken[nthreads];
+
+static int waiter(void* arg) {
+    int i = reinterpret_cast<uintptr_t>(arg);
+    std::atomic<int>* w = waiting_on[i];
+    ++nready;
+    while (w->load() == 0) {
+        sys_futex(w, FUTEX_WAIT, 0);
+    }
+    ++nwoken;
+    woken[i] = 1;
+    sys_texit(0);
+}
+
+static void test_targeted_wakeups() {
+    for (int round = 0; round != nrounds; ++round) {
+        nready = 0;
+        nwoken = 0;
+        for (int i = 0; i != nthreads; ++i) {
+            // spread waiters over all pages, differently each round
+            int idx = (round * nthreads + i) * 37 % arraysize(words);
+            waiting_on[i] = &words[idx];
+            waiting_on[i]->store(0);
+            woken[i] = 0;
+
+            char* stack = reinterpret_cast<char*>(
+                round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+                + (16 + i) * PAGESIZE
+            );
+            if (round == 0) {
+                int r = sys_page_alloc(stack);
+                assert_eq(r, 0);
+            }
+            pid_t t = sys_clone(waiter, reinterpret_cast<void*>(i),
+                                stack + PAGESIZE);
+            assert_gt(t, 0);
+        }
+        while (nready != nthreads) {
+            sys_yield();
+        }
+        // give every thread time to block
+        sys_msleep(100);
+
+        // a word nobody waits on has no waiters, even if its bucket does
+        for (int k = 0; k != 16; ++k) {
+            std::atomic<int>* w = &words[(round * 131 + k * 61 + 5) % arraysize(words)];
+            bool busy = false;
+            for (int i = 0; i != nthreads; ++i) {
+                busy = busy || w == waiting_on[i];
+            }
+            if (!busy) {
+                assert_eq(sys_futex(w, FUTEX_WAKE, 1), 0);
+            }
+        }
+
+        // wake threads in reverse order; only the target wakes
+        for (int i = nthreads - 1; i >= 0; --i) {
+            waiting_on[i]->store(1);
+            int n = sys_futex(waiting_on[i], FUTEX_WAKE, 1);
+            assert_eq(n, 1);
+            while (!woken[i]) {
+                sys_yield();
+            }
+            assert_eq(nwoken.load(), nthreads - i);
+            for (int j = 0; j != i; ++j) {
+                assert_eq(woken[j].load(), 0);
+            }
+        }
+        // let the threads exit before their stacks are reused
+        sys_msleep(50);
+    }
+    console_printf("targeted wakeups on shared buckets work\n");
+}
+
+static void test_cross_process() {
+    int shmid = shmget(IPC_PRIVATE);
+    assert_ge(shmid, 0);
+    void* addr = reinterpret_cast<void*>(
+        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE) + 8 * PAGESIZE
+    );
+    void* shmaddr = shmat(shmid, addr);
+    assert_eq(shmaddr, addr);
+    auto w = reinterpret_cast<std::atomic<int>*>(shmaddr);
+    w[0] = 0;
+    w[1] = 0;
+
+    pid_t p = sys_fork();
+    assert_ge(p, 0);
+    if (p == 0) {
+        w[1] = 1;
+        while (w[0].load() == 0) {
+            sys_futex(&w[0], FUTEX_WAIT, 0);
+        }
+        sys_exit(0);
+    }
+
+    while (w[1].load() == 0) {
+        sys_yield();
+    }
+    sys_msleep(100);
+    w[0] = 1;
+    int n = sys_futex(&w[0], FUTEX_WAKE, 1);
+    assert_eq(n, 1);
+    pid_t ch = sys_waitpid(p);
+    assert_eq(ch, p);
+    console_printf("futexes match by physical address\n");
+}
+
+void process_main() {
+    // fault in the futex pages
+    for (int i = 0; i != int(arraysize(words)); i += words_per_page) {
+        words[i] = 0;
+    }
+
+    test_targeted_wakeups();
+    test_cross_process();
+
+    console_printf("testfutexhash succeeded.\n");
+    sys_exit(0);
+}
@@ -0,0 +1,151 @@
+#include "u-lib.hh"
+#include <atomic>
+
+extern uint8_t end[];
+
+std::atomic<int> f1;
+std::atomic<int> f2;
+std::atomic<int> nwoken;
+int nthreads = 0;
+
+static pid_t clone(int (*function)(void*), void* arg) {
+    // each thread gets its own stack page
+    char* stack = reinterpret_cast<char*>(
+        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+        + (16 + nthreads) * PAGESIZE
+    );
+    ++nthreads;
+    int r = sys_page_alloc(stack);
+    assert_eq(r, 0);
+    pid_t t = sys_clone(function, arg, stack + PAGESIZE);
+    assert_gt(t, 0);
+    return t;
+}
+
+static int wait_f1(void*) {
+    int r = sys_futex(&f1, FUTEX_WAIT, 0);
+    assert_eq(r, 0);
+    ++nwoken;
+    sys_texit(0);
+}
+
+static int wait_f2(void*) {
+    int r = sys_futex(&f2, FUTEX_WAIT, 0);
+    assert_eq(r, 0);
+    ++nwoken;
+    sys_texit(0);
+}
+
+static int wait_f1_bitset(void* arg) {
+    uint32_t bitset = reinterpret_cast<uintptr_t>(arg);
+    int r = sys_futex(&f1, FUTEX_WAIT_BITSET, 0, 0, nullptr, bitset);
+    assert_eq(r, 0);
+    ++nwoken;
+    sys_texit(0);
+}
+
+
+static void test_timeout() {
+    f1 = 0;
+    int r = sys_futex(&f1, FUTEX_WAIT, 1, 50);
+    assert_eq(r, E_AGAIN);
+    r = sys_futex(&f1, FUTEX_WAIT, 0, 50);
+    assert_eq(r, E_TIMEDOUT);
+    console_printf("FUTEX_WAIT timeout works\n");
+}
+
+static void test_requeue() {
+    f1 = 0;
+    f2 = 0;
+    nwoken = 0;
+    for (int i = 0; i != 4; ++i) {
+        clone(wait_f1, nullptr);
+    }
+    sys_msleep(50);
+    assert_eq(nwoken.load(), 0);
+
+    // comparison fails: nothing happens
+    int r = sys_futex(&f1, FUTEX_CMP_REQUEUE, 1, 10, &f2, 1);
+    assert_eq(r, E_AGAIN);
+
+    // like a condition variable broadcast: change the value, wake one,
+    // and move the rest to `f2`
+    f1 = 1;
+    r = sys_futex(&f1, FUTEX_CMP_REQUEUE, 1, 10, &f2, 1);
+    assert_eq(r, 4);
+    sys_msleep(20);
+    assert_eq(nwoken.load(), 1);
+
+    // the others now wait on `f2`, and return when woken there
+    r = sys_futex(&f1, FUTEX_WAKE, 10);
+    assert_eq(r, 0);
+    r = sys_futex(&f2, FUTEX_WAKE, 10);
+    assert_eq(r, 3);
+    sys_msleep(20);
+    assert_eq(nwoken.load(), 4);
+    console_printf("FUTEX_CMP_REQUEUE works\n");
+}
+
+static void test_wake_op() {
+    f1 = 0;
+    f2 = 0;
+    nwoken = 0;
+    clone(wait_f1, nullptr);
+    clone(wait_f1, nullptr);
+    clone(wait_f2, nullptr);
+    sys_msleep(50);
+
+    // `f2 += 5` fails the comparison `old == 1`: wake only on `f1`
+    f1 = 1;
+    int r = sys_futex(&f1, FUTEX_WAKE_OP, 1, 1, &f2,
+                      FUTEX_OP(FUTEX_OP_ADD, 5, FUTEX_OP_CMP_EQ, 1));
+    assert_eq(r, 1);
+    assert_eq(f2.load(), 5);
+    sys_msleep(20);
+    assert_eq(nwoken.load(), 1);
+
+    // `f2 = 0` passes `old > 4`: wake on both
+    r = sys_futex(&f1, FUTEX_WAKE_OP, 1, 1, &f2,
+                  FUTEX_OP(FUTEX_OP_SET, 0, FUTEX_OP_CMP_GT, 4));
+    assert_eq(r, 2);
+    assert_eq(f2.load(), 0);
+    sys_msleep(20);
+    // the `f2` waiter sees an unchanged value and sleeps again
+    assert_eq(nwoken.load(), 2);
+    f2 = 1;
+    r = sys_futex(&f2, FUTEX_WAKE, 1);
+    assert_eq(r, 1);
+    sys_msleep(20);
+    assert_eq(nwoken.load(), 3);
+    console_printf("FUTEX_WAKE_OP works\n");
+}
+
+static void test_bitset() {
+    f1 = 0;
+    nwoken = 0;
+    clone(wait_f1_bitset, reinterpret_cast<void*>(1));
+    clone(wait_f1_bitset, reinterpret_cast<void*>(2));
+    sys_msleep(50);
+
+    f1 = 1;
+    int r = sys_futex(&f1, FUTEX_WAKE_BITSET, 10, 0, nullptr, 4);
+    assert_eq(r, 0);
+    r = sys_futex(&f1, FUTEX_WAKE_BITSET, 10, 0, nullptr, 2);
+    assert_eq(r, 1);
+    sys_msleep(20);
+    assert_eq(nwoken.load(), 1);
+    r = sys_futex(&f1, FUTEX_WAKE, 10);
+    assert_eq(r, 1);
+    sys_msleep(20);
+    assert_eq(nwoken.load(), 2);
+    console_printf("FUTEX_WAKE_BITSET works\n");
+}
+
+void process_main() {
+    test_timeout();
+    test_requeue();
+    test_wake_op();
+    test_bitset();
+    console_printf("testfutexops succeeded.\n");
+    sys_exit(0);
+}
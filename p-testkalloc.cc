@@ -28,6 +28,21 @@ void process_main() {
     r = sys_testkalloc(7);
     assert_eq(r, 0);
 
+    r = sys_testkalloc(8);
+    assert_eq(r, 0);
+
+    r = sys_testkalloc(9);
+    assert_eq(r, 0);
+
+    r = sys_testkalloc(10);
+    assert_eq(r, 0);
+
+    r = sys_testkalloc(11);
+    assert_eq(r, 0);
+
+    r = sys_testkalloc(12);
+    assert_eq(r, 0);
+
     // wild alloc tests: they should cause assertion failures!
     // sys_wildalloc(1);
     // sys_wildalloc(2);
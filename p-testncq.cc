@@ -0,0 +1,81 @@
+#include "u-lib.hh"
+
+// p-testncq
+//    Tests concurrent disk reads. Several processes read their own files
+//    at once from an empty buffer cache, so the disk has many commands
+//    in flight in different slots; one of them keeps dropping the cache
+//    so reads keep going to disk. Every read must return the right data.
+
+static constexpr int nreaders = 4;
+static constexpr unsigned nblocks = 32;
+static constexpr int npasses = 4;
+static constexpr size_t blocksize = 4096;
+static const char* const names[nreaders] = {
+    "ncqtest0.txt", "ncqtest1.txt", "ncqtest2.txt", "ncqtest3.txt"
+};
+static char buf[blocksize];
+static char rbuf[blocksize];
+
+// fill_block(f, i)
+//    Fill `buf` with the contents of block `i` of file `f`.
+static void fill_block(int f, unsigned i) {
+    memset(buf, 'a' + (f * 5 + i) % 26, blocksize);
+    snprintf(buf, 32, "reader %d block %u\n", f, i);
+}
+
+static void reader(int f) {
+    int fd = sys_open(names[f], OF_READ);
+    assert_gt(fd, 2);
+    for (int pass = 0; pass != npasses; ++pass) {
+        ssize_t r = sys_lseek(fd, 0, LSEEK_SET);
+        assert_eq(r, 0);
+        for (unsigned i = 0; i != nblocks; ++i) {
+            ssize_t n = sys_read(fd, rbuf, blocksize);
+            assert_eq(n, ssize_t(blocksize));
+            fill_block(f, i);
+            assert_memeq(rbuf, buf, blocksize);
+            if (f == 0 && i % 8 == 0) {
+                int s = sys_sync(1);
+                assert_ge(s, 0);
+            }
+        }
+    }
+    sys_close(fd);
+    sys_exit(0);
+}
+
+
+void process_main() {
+    printf("Starting testncq (assuming clean file system)...\n");
+
+    for (int f = 0; f != nreaders; ++f) {
+        int fd = sys_open(names[f], OF_WRITE | OF_CREATE);
+        assert_gt(fd, 2);
+        for (unsigned i = 0; i != nblocks; ++i) {
+            fill_block(f, i);
+            ssize_t n = sys_write(fd, buf, blocksize);
+            assert_eq(n, ssize_t(blocksize));
+        }
+        sys_close(fd);
+    }
+    int r = sys_sync(1);
+    assert_ge(r, 0);
+
+    pid_t pids[nreaders];
+    for (int f = 0; f != nreaders; ++f) {
+        pids[f] = sys_fork();
+        assert_ge(pids[f], 0);
+        if (pids[f] == 0) {
+            reader(f);
+        }
+    }
+    for (int f = 0; f != nreaders; ++f) {
+        int status = -1;
+        pid_t ch = sys_waitpid(pids[f], &status);
+        assert_eq(ch, pids[f]);
+        assert_eq(status, 0);
+    }
+
+    printf("testncq succeeded.\n");
+    sys_exit(0);
+}
@@ -0,0 +1,212 @@
+#include "u-lib.hh"
+#include <atomic>
+
+// p-testsync
+//    Tests the u-mutex.hh synchronization primitives with threads, and
+//    with a forked process.
+
+extern uint8_t end[];
+
+int nthreads = 0;
+
+static pid_t clone(int (*function)(void*), void* arg) {
+    // each thread gets its own stack page
+    char* stack = reinterpret_cast<char*>(
+        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+        + (16 + nthreads) * PAGESIZE
+    );
+    ++nthreads;
+    int r = sys_page_alloc(stack);
+    assert_eq(r, 0);
+    pid_t t = sys_clone(function, arg, stack + PAGESIZE);
+    assert_gt(t, 0);
+    return t;
+}
+
+
+// mutexes and condition variables
+mutex* m;
+condvar* cv;
+semaphore* done;
+int counter;
+int ready;
+int nwaiting;
+
+static int count_thread(void*) {
+    for (int i = 0; i != 1000; ++i) {
+        m->lock();
+        ++counter;
+        m->unlock();
+    }
+    done->post();
+    sys_texit(0);
+}
+
+static int wait_ready_thread(void*) {
+    m->lock();
+    ++nwaiting;
+    while (!ready) {
+        cv->wait(*m);
+    }
+    ++counter;
+    m->unlock();
+    done->post();
+    sys_texit(0);
+}
+
+static void test_mutex_condvar() {
+    // many mutexes share one page
+    mutex ms[32];
+    for (int i = 0; i != 32; ++i) {
+        ms[i].lock();
+    }
+    for (int i = 0; i != 32; ++i) {
+        assert(!ms[i].trylock());
+        ms[i].unlock();
+    }
+
+    counter = 0;
+    for (int i = 0; i != 4; ++i) {
+        clone(count_thread, nullptr);
+    }
+    for (int i = 0; i != 4; ++i) {
+        done->wait();
+    }
+    assert_eq(counter, 4000);
+    console_printf("mutex works\n");
+
+    counter = ready = nwaiting = 0;
+    for (int i = 0; i != 4; ++i) {
+        clone(wait_ready_thread, nullptr);
+    }
+    while (true) {
+        m->lock();
+        int n = nwaiting;
+        m->unlock();
+        if (n == 4) {
+            break;
+        }
+        sys_yield();
+    }
+    m->lock();
+    ready = 1;
+    cv->broadcast();
+    m->unlock();
+    for (int i = 0; i != 4; ++i) {
+        done->wait();
+    }
+    assert_eq(counter, 4);
+    console_printf("condvar broadcast works\n");
+}
+
+
+// reader-writer locks
+rwlock* rw;
+int shared_a, shared_b;
+
+static int rw_thread(void* arg) {
+    bool writer = reinterpret_cast<uintptr_t>(arg);
+    for (int i = 0; i != 500; ++i) {
+        if (writer) {
+            rw->write_lock();
+            ++shared_a;
+            sys_yield();
+            ++shared_b;
+            rw->write_unlock();
+        } else {
+            rw->read_lock();
+            assert_eq(shared_a, shared_b);
+            rw->read_unlock();
+        }
+    }
+    done->post();
+    sys_texit(0);
+}
+
+static void test_rwlock() {
+    for (int i = 0; i != 4; ++i) {
+        clone(rw_thread, reinterpret_cast<void*>(uintptr_t(i < 2)));
+    }
+    for (int i = 0; i != 4; ++i) {
+        done->wait();
+    }
+    assert_eq(shared_a, 1000);
+    assert_eq(shared_b, 1000);
+    console_printf("rwlock works\n");
+}
+
+
+// barriers
+barrier* bar;
+std::atomic<int> nserial;
+std::atomic<int> round_arrived[3];
+
+static int barrier_thread(void*) {
+    for (int round = 0; round != 3; ++round) {
+        ++round_arrived[round];
+        if (bar->wait()) {
+            ++nserial;
+        }
+        // everyone arrived before anyone left
+        assert_eq(round_arrived[round].load(), 4);
+    }
+    done->post();
+    sys_texit(0);
+}
+
+static void test_barrier() {
+    for (int i = 0; i != 4; ++i) {
+        clone(barrier_thread, nullptr);
+    }
+    for (int i = 0; i != 4; ++i) {
+        done->wait();
+    }
+    assert_eq(nserial.load(), 3);
+    console_printf("barrier works\n");
+}
+
+
+// semaphores across processes
+static void test_semaphore_fork() {
+    semaphore ping(0);
+    semaphore pong(0);
+    pid_t p = sys_fork();
+    assert_ge(p, 0);
+    if (p == 0) {
+        for (int i = 0; i != 10; ++i) {
+            ping.wait();
+            pong.post();
+        }
+        sys_exit(0);
+    }
+    for (int i = 0; i != 10; ++i) {
+        ping.post();
+        pong.wait();
+    }
+    assert(!pong.trywait());
+    pid_t ch = sys_waitpid(p);
+    assert_eq(ch, p);
+    console_printf("semaphore works across fork\n");
+}
+
+
+void process_main() {
+    mutex m_;
+    condvar cv_;
+    semaphore done_(0);
+    rwlock rw_;
+    barrier bar_(4);
+    m = &m_;
+    cv = &cv_;
+    done = &done_;
+    rw = &rw_;
+    bar = &bar_;
+
+    test_mutex_condvar();
+    test_rwlock();
+    test_barrier();
+    test_semaphore_fork();
+
+    console_printf("testsync succeeded.\n");
+    sys_exit(0);
+}
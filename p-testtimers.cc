@@ -0,0 +1,63 @@
+#include "u-lib.hh"
+#include <atomic>
+
+// p-testtimers
+//    Tests kernel timers through `sys_msleep`. Processes sleep for
+//    durations from a few ticks to several seconds, so their timers
+//    start in different levels of the timer wheel, and they start in
+//    shuffled order. They must wake in order of deadline. Two processes
+//    share each deadline.
+
+extern uint8_t end[];
+
+// sleep lengths in milliseconds, in starting order
+static const unsigned durations[] = {
+    700, 20, 2600, 250, 1300, 90
+};
+static constexpr int ndurations = arraysize(durations);
+static constexpr int nsame = 2;         // processes per duration
+
+struct shared_state {
+    std::atomic<int> nwoken;
+    int woken[ndurations * nsame];      // duration index, in wakeup order
+};
+static shared_state* shared;
+
+void process_main() {
+    int shmid = shmget(IPC_PRIVATE);
+    assert_ge(shmid, 0);
+    void* addr = reinterpret_cast<void*>(
+        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+    );
+    void* shmaddr = shmat(shmid, addr);
+    assert_eq(shmaddr, addr);
+    shared = reinterpret_cast<shared_state*>(shmaddr);
+
+    for (int i = 0; i != ndurations; ++i) {
+        for (int j = 0; j != nsame; ++j) {
+            pid_t p = sys_fork();
+            assert_ge(p, 0);
+            if (p == 0) {
+                int r = sys_msleep(durations[i]);
+                assert_eq(r, 0);
+                shared->woken[shared->nwoken++] = i;
+                sys_exit(0);
+            }
+        }
+    }
+
+    for (int n = 0; n != ndurations * nsame; ++n) {
+        pid_t ch = sys_waitpid(0);
+        assert_gt(ch, 0);
+    }
+
+    // every sleeper woke, in order of duration
+    assert_eq(shared->nwoken.load(), ndurations * nsame);
+    for (int n = 1; n != ndurations * nsame; ++n) {
+        assert_le(durations[shared->woken[n - 1]],
+                  durations[shared->woken[n]]);
+    }
+
+    console_printf("testtimers succeeded.\n");
+    sys_exit(0);
+}
@@ -66,6 +66,36 @@ __always_inline uintptr_t make_syscall(int syscallno, uintptr_t arg0,
     return rax;
 }
 
+__always_inline uintptr_t make_syscall(int syscallno, uintptr_t arg0,
+                                       uintptr_t arg1, uintptr_t arg2,
+                                       uintptr_t arg3, uintptr_t arg4) {
+    register uintptr_t rax asm("rax") = syscallno;
+    register uintptr_t r10 asm("r10") = arg3;
+    register uintptr_t r8 asm("r8") = arg4;
+    asm volatile ("syscall"
+            : "+a" (rax), "+D" (arg0), "+S" (arg1), "+d" (arg2), "+r" (r10),
+              "+r" (r8)
+            :
+            : "cc", "rcx", "r9", "r11");
+    return rax;
+}
+
+__always_inline uintptr_t make_syscall(int syscallno, uintptr_t arg0,
+                                       uintptr_t arg1, uintptr_t arg2,
+                                       uintptr_t arg3, uintptr_t arg4,
+                                       uintptr_t arg5) {
+    register uintptr_t rax asm("rax") = syscallno;
+    register uintptr_t r10 asm("r10") = arg3;
+    register uintptr_t r8 asm("r8") = arg4;
+    register uintptr_t r9 asm("r9") = arg5;
+    asm volatile ("syscall"
+            : "+a" (rax), "+D" (arg0), "+S" (arg1), "+d" (arg2), "+r" (r10),
+              "+r" (r8), "+r" (r9)
+            :
+            : "cc", "rcx", "r11");
+    return rax;
+}
+
 __always_inline void clobber_memory(void* ptr) {
     asm volatile ("" : "+m" (*(char*) ptr));
 }
@@ -303,11 +333,27 @@ inline pid_t sys_gettid() {
     return make_syscall(SYSCALL_GETTID);
 }
 
-// sys_futex(path, flags, val)
-inline int sys_futex(std::atomic<int>* uaddr, int futex_op, int val) {
+// sys_futex(uaddr, futex_op, val, val2, uaddr2, val3)
+//    Futex operations, as on Linux:
+//    FUTEX_WAIT[_BITSET]: block while `*uaddr == val`, for at most `val2`
+//      milliseconds if `val2 != 0`; returns E_TIMEDOUT on timeout.
+//      The _BITSET variant only wakes for wakes whose bitset intersects
+//      `val3`.
+//    FUTEX_WAKE[_BITSET]: wake up to `val` waiters on `uaddr` (whose
+//      bitsets intersect `val3`).
+//    FUTEX_[CMP_]REQUEUE: wake up to `val` waiters on `uaddr` and move up
+//      to `val2` more to `uaddr2`; CMP_ fails with E_AGAIN unless
+//      `*uaddr == val3`.
+//    FUTEX_WAKE_OP: update `*uaddr2` as in `val3` (see `FUTEX_OP`), wake
+//      up to `val` waiters on `uaddr`, and, if the comparison in `val3`
+//      held for the old `*uaddr2`, up to `val2` waiters on `uaddr2`.
+inline int sys_futex(std::atomic<int>* uaddr, int futex_op, int val,
+                     uintptr_t val2 = 0, std::atomic<int>* uaddr2 = nullptr,
+                     uint32_t val3 = 0) {
     access_memory(uaddr);
     return make_syscall(SYSCALL_FUTEX, reinterpret_cast<uintptr_t>(uaddr),
-                        futex_op, val);
+                        futex_op, val, val2,
+                        reinterpret_cast<uintptr_t>(uaddr2), val3);
 }
 
 // sys_clone(function, arg, stack_top)
@@ -347,6 +393,14 @@ inline int sys_logprocs() {
     return make_syscall(SYSCALL_LOGPROCS);
 }
 
+// sys_lockstats()
+//    Write spinlock contention statistics to `log.txt`. Returns the
+//    number of locks listed, or E_NOSYS unless the kernel was built with
+//    `make LOCKSTAT=1`.
+inline int sys_lockstats() {
+    return make_syscall(SYSCALL_LOCKSTATS);
+}
+
 // dprintf(fd, format, ...)
 //    Construct a string from `format` and pass it to `sys_write(fd)`.
 //    Returns the number of characters printed, or E_2BIG if the string
@@ -2,22 +2,98 @@
 
 extern uint8_t end[];
 
+// Shared synchronization pages
+//    Futex words come from up to `max_sync_pages` contiguous pages right
+//    after the program's data, so forked children find them at the same
+//    addresses. Each page is its own shared memory segment, mapped when
+//    the first word in it is handed out. Word 0 of the first page counts
+//    the words handed out so far. It lives in shared memory so that
+//    forked processes never hand out the same word twice. A page first
+//    used after a fork is mapped separately in each process, which is
+//    fine: only that process's primitives use it.
+
+static constexpr int max_sync_pages = 8;
+static constexpr int sync_page_words = PAGESIZE / sizeof(int);
+
+static std::atomic<int>* sync_page;
+static std::atomic<int> sync_page_state[max_sync_pages];
+                                            // 0 = unmapped, 1 = mapping,
+                                            // 2 = mapped, -1 = failed
+
+// sync_page_map(pn)
+//    Map sync page `pn` in this process if it is not mapped yet. Returns
+//    false if that fails.
+static bool sync_page_map(int pn) {
+    int s = 0;
+    if (sync_page_state[pn].compare_exchange_strong(s, 1)) {
+        void* addr = reinterpret_cast<void*>(
+            round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
+            + pn * PAGESIZE
+        );
+        int shmid = shmget(IPC_PRIVATE);
+        if (shmid < 0 || shmat(shmid, addr) != addr) {
+            sync_page_state[pn] = -1;
+            return false;
+        }
+        if (pn == 0) {
+            sync_page = reinterpret_cast<std::atomic<int>*>(addr);
+            sync_page[0] = 1;
+        }
+        sync_page_state[pn] = 2;
+    }
+    while ((s = sync_page_state[pn]) == 1) {
+        pause();
+    }
+    return s == 2;
+}
+
+std::atomic<int>* sync_alloc(int n) {
+    assert(n > 0 && n <= sync_page_words);
+    if (!sync_page_map(0)) {
+        return nullptr;
+    }
+    // keep each allocation within one page
+    int i = sync_page[0].load();
+    int start;
+    do {
+        start = i;
+        if (start / sync_page_words != (start + n - 1) / sync_page_words) {
+            start = (start / sync_page_words + 1) * sync_page_words;
+        }
+        if (start + n > max_sync_pages * sync_page_words) {
+            return nullptr;
+        }
+    } while (!sync_page[0].compare_exchange_weak(i, start + n));
+    if (!sync_page_map(start / sync_page_words)) {
+        return nullptr;
+    }
+    return &sync_page[start];
+}
+
+// count for waking every waiter
+static constexpr int all_waiters = 0x7FFFFFFF;
+
+// sync_spin(word, busy)
+//    Spin until `*word != busy`, for at most `sync_spin_count` iterations.
+//    Returns the last value seen.
+static int sync_spin(std::atomic<int>* word, int busy) {
+    int v = word->load(std::memory_order_relaxed);
+    for (int i = 0; i < sync_spin_count && v == busy; ++i) {
+        pause();
+        v = word->load(std::memory_order_relaxed);
+    }
+    return v;
+}
+
+
 mutex::mutex() {
-    // map futex to shared memory segment so child has access to it when forking
-    int* shared_addr = reinterpret_cast<int*>(
-        round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE)
-    );
-    shmid_ = shmget(IPC_PRIVATE);
-    shmaddr_ = shmat(shmid_, reinterpret_cast<const void*>(shared_addr));
-    assert_eq(shmaddr_, shared_addr);
-
-    // set futex
-    atom_ = reinterpret_cast<std::atomic<int>*>(shmaddr_);
+    atom_ = sync_alloc(1);
+    assert(atom_);
     std::atomic_store(atom_, 0);
 }
 
 void mutex::destroy() {
-    shmdt(shmaddr_);
+    // futex words are never freed
 }
 
 void mutex::lock() {
@@ -26,6 +102,13 @@ void mutex::lock() {
     // if we grabbed the lock, return without blocking
     if(c == 0) return;
 
+    // the holder probably releases soon, so spin first while there are
+    // no sleeping waiters
+    if(c == 1 && sync_spin(atom_, 1) == 0) {
+        c = compare_exchange_strong(atom_, 0, 1);
+        if(c == 0) return;
+    }
+
     // othwerwise, block until lock is free
     do {
         // signal that we are waiting for the lock
@@ -39,9 +122,183 @@ void mutex::lock() {
     // wet get here if we grabbed the lock in the while loop
 }
 
+// mutex::lock_contended()
+//    Lock, leaving the mutex marked as having waiters. Used by condition
+//    variable waiters, which may have company requeued onto `atom_`.
+void mutex::lock_contended() {
+    while(std::atomic_exchange(atom_, 2) != 0) {
+        sys_futex(atom_, FUTEX_WAIT, 2);
+    }
+}
+
 void mutex::unlock() {
     if(std::atomic_fetch_sub(atom_, 1) != 1) {
         std::atomic_store(atom_, 0);
         sys_futex(atom_, FUTEX_WAKE, 1);
     }
-}
\ No newline at end of file
+}
+
+
+condvar::condvar() {
+    seq_ = sync_alloc(2);
+    assert(seq_);
+    mutex_slot_ = seq_ + 1;
+}
+
+void condvar::wait(mutex& m) {
+    mutex_slot_->store(m.atom_ - sync_page);
+    int seq = seq_->load();
+    m.unlock();
+    sys_futex(seq_, FUTEX_WAIT, seq);
+    // we may have been requeued onto the mutex along with other waiters,
+    // so keep it marked contended; its next unlock wakes the next one
+    m.lock_contended();
+}
+
+void condvar::signal() {
+    ++*seq_;
+    sys_futex(seq_, FUTEX_WAKE, 1);
+}
+
+void condvar::broadcast() {
+    int slot = mutex_slot_->load();
+    if (!slot) {
+        // nobody has waited yet
+        ++*seq_;
+        return;
+    }
+    // wake one waiter and move the rest to the mutex. If a signal races
+    // with us, the comparison fails; then retry
+    while (true) {
+        int seq = ++*seq_;
+        int r = sys_futex(seq_, FUTEX_CMP_REQUEUE, 1, all_waiters,
+                          &sync_page[slot], seq);
+        if (r != E_AGAIN) {
+            return;
+        }
+    }
+}
+
+
+rwlock::rwlock() {
+    state_ = sync_alloc(4);
+    assert(state_);
+    seq_ = state_ + 1;
+    nwaiters_ = state_ + 2;
+    nwriters_ = state_ + 3;
+}
+
+void rwlock::read_lock() {
+    while (true) {
+        int seq = seq_->load();
+        int s = state_->load();
+        if (s >= 0 && *nwriters_ == 0) {
+            if (state_->compare_exchange_weak(s, s + 1)) {
+                return;
+            }
+        } else if (sync_spin(seq_, seq) == seq) {
+            wait(seq);
+        }
+    }
+}
+
+void rwlock::read_unlock() {
+    if (state_->fetch_sub(1) == 1) {
+        wake();
+    }
+}
+
+void rwlock::write_lock() {
+    ++*nwriters_;
+    while (true) {
+        int seq = seq_->load();
+        int s = 0;
+        if (state_->compare_exchange_strong(s, -1)) {
+            break;
+        } else if (sync_spin(seq_, seq) == seq) {
+            wait(seq);
+        }
+    }
+    --*nwriters_;
+}
+
+void rwlock::write_unlock() {
+    state_->store(0);
+    wake();
+}
+
+// rwlock::wait(seq)
+//    Sleep until `wake` changes `*seq_` from `seq`. Callers read `seq`
+//    before checking `state_`, so no wakeup is missed.
+void rwlock::wait(int seq) {
+    ++*nwaiters_;
+    sys_futex(seq_, FUTEX_WAIT, seq);
+    --*nwaiters_;
+}
+
+void rwlock::wake() {
+    ++*seq_;
+    if (*nwaiters_ > 0) {
+        sys_futex(seq_, FUTEX_WAKE, all_waiters);
+    }
+}
+
+
+semaphore::semaphore(int value) {
+    value_ = sync_alloc(2);
+    assert(value_);
+    nwaiters_ = value_ + 1;
+    value_->store(value);
+}
+
+bool semaphore::trywait() {
+    int v = value_->load();
+    while (v > 0) {
+        if (value_->compare_exchange_weak(v, v - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void semaphore::wait() {
+    while (!trywait()) {
+        if (sync_spin(value_, 0) > 0) {
+            continue;
+        }
+        ++*nwaiters_;
+        sys_futex(value_, FUTEX_WAIT, 0);
+        --*nwaiters_;
+    }
+}
+
+void semaphore::post() {
+    ++*value_;
+    if (*nwaiters_ > 0) {
+        sys_futex(value_, FUTEX_WAKE, 1);
+    }
+}
+
+
+barrier::barrier(int n)
+    : n_(n) {
+    assert_gt(n, 0);
+    arrived_ = sync_alloc(2);
+    assert(arrived_);
+    generation_ = arrived_ + 1;
+}
+
+bool barrier::wait() {
+    int gen = generation_->load();
+    if (arrived_->fetch_add(1) + 1 == n_) {
+        // last to arrive: reset for the next round and release the rest
+        arrived_->store(0);
+        ++*generation_;
+        sys_futex(generation_, FUTEX_WAKE, all_waiters);
+        return true;
+    }
+    while (sync_spin(generation_, gen) == gen) {
+        sys_futex(generation_, FUTEX_WAIT, gen);
+    }
+    return false;
+}
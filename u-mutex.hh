@@ -2,6 +2,32 @@
 #define CHICKADEE_U_MUTEX_HH
 #include <atomic>
 
+// u-mutex.hh
+//    Futex-based synchronization: mutexes, condition variables,
+//    reader-writer locks, semaphores, and barriers.
+//
+//    Each primitive keeps its state in futex words allocated from the
+//    process's shared synchronization pages (see `sync_alloc`). Those
+//    pages are shared memory, so primitives created before `sys_fork` work
+//    across processes as well as across threads. Each page holds hundreds
+//    of primitives, and more pages are mapped as needed. Words are never
+//    freed.
+//
+//    Blocking operations first spin for a while (`sync_spin_count`
+//    iterations), since the holder is often running on another CPU and
+//    about to release; only then do they sleep in `sys_futex`.
+
+// sync_alloc(n)
+//    Return `n` consecutive zeroed futex words from the shared
+//    synchronization pages, mapping another page if the current one is
+//    full. Returns nullptr if every page is full or a page cannot be
+//    mapped; the primitives' constructors fail an assertion then.
+std::atomic<int>* sync_alloc(int n);
+
+// number of `pause` iterations to spin before sleeping
+constexpr int sync_spin_count = 100;
+
+
 // reference: https://eli.thegreenplace.net/2018/basics-of-futexes
 struct mutex {
     mutex();
@@ -16,11 +42,78 @@ private:
     // 2 means locked, with waiters
     std::atomic<int>* atom_;
 
-    int shmid_;             // shared memory id
-    void* shmaddr_;         // shared memory address
-
+    // lock, marking the mutex as having waiters
+    void lock_contended();
 
     inline int compare_exchange_strong(std::atomic<int>* atom, int expected, int desired);
+
+    friend struct condvar;
+};
+
+
+// condvar
+//    A condition variable. `broadcast` wakes one waiter and moves the
+//    rest onto the mutex's futex with FUTEX_CMP_REQUEUE, so they acquire
+//    the mutex one at a time instead of all waking at once.
+struct condvar {
+    condvar();
+    // Atomically unlock `m` and wait; relock `m` before returning
+    void wait(mutex& m);
+    void signal();
+    void broadcast();
+
+private:
+    std::atomic<int>* seq_;             // incremented by every signal
+    std::atomic<int>* mutex_slot_;      // waiters' mutex word (index in
+                                        // sync page), or 0
+};
+
+
+// rwlock
+//    A reader-writer lock that prefers writers: once a writer is waiting,
+//    new readers wait too.
+struct rwlock {
+    rwlock();
+    void read_lock();
+    void read_unlock();
+    void write_lock();
+    void write_unlock();
+
+private:
+    std::atomic<int>* state_;           // # readers, or -1 if write-locked
+    std::atomic<int>* seq_;             // changes whenever `state_` frees up
+    std::atomic<int>* nwaiters_;        // # threads sleeping on `seq_`
+    std::atomic<int>* nwriters_;        // # writers waiting
+
+    void wait(int seq);
+    void wake();
+};
+
+
+// semaphore
+struct semaphore {
+    explicit semaphore(int value = 0);
+    void wait();
+    bool trywait();
+    void post();
+
+private:
+    std::atomic<int>* value_;
+    std::atomic<int>* nwaiters_;        // # threads sleeping on `value_`
+};
+
+
+// barrier
+//    Blocks callers of `wait` until `n` have arrived. `wait` returns true
+//    in exactly one of them.
+struct barrier {
+    explicit barrier(int n);
+    bool wait();
+
+private:
+    int n_;
+    std::atomic<int>* arrived_;
+    std::atomic<int>* generation_;
 };
 
 